@@ -0,0 +1,388 @@
+# -*- coding: utf-8 -*-
+import argparse
+import bisect
+import json
+import os
+import shlex
+import subprocess
+import sys
+import time
+
+def get_arguments():
+    parser = argparse.ArgumentParser(description="Coordinator - utility to run MIG on several hosts at once "
+                                                 "and merge results")
+    parser.add_argument("-a", "--agent", action="append", default=[], required=True,
+                        help='command to start MIG agent (for example "ssh host1 /opt/mig/mig" or "./mig" '
+                             'for local agent), can be repeated')
+    parser.add_argument("-o", "--output",
+                        help="file to write merged output to (default stdout)")
+    parser.add_argument("-n", "--queries", type=int, default=None,
+                        help="total number of queries split between agents")
+    parser.add_argument("-l", "--limit", type=int, default=None,
+                        help="total query rate split between agents")
+    parser.add_argument("--lead", type=float, default=1.0,
+                        help="delay in seconds between clock synchronization and start (default 1)")
+    parser.add_argument("--probes", type=int, default=16,
+                        help="number of clock probes per agent (default 16)")
+    parser.add_argument("--keep",
+                        help="directory to store per agent results")
+    parser.add_argument("arguments", nargs=argparse.REMAINDER,
+                        help="MIG arguments common for all agents (after --)", metavar="ARGUMENTS")
+
+    arguments = parser.parse_args()
+    mig_arguments = arguments.arguments
+    if mig_arguments and mig_arguments[0] == "--":
+        mig_arguments = mig_arguments[1:]
+
+    return arguments.agent, arguments.output, arguments.queries, arguments.limit, \
+           arguments.lead, arguments.probes, arguments.keep, mig_arguments
+
+__NANOSECONDS = 1e9
+__PERCENTILES = (50.0, 90.0, 99.0, 99.9, 99.99)
+
+def realtime():
+    return int(time.time()*__NANOSECONDS)
+
+def split(total, parts, index):
+    if total is None:
+        return None
+
+    return total//parts + (1 if index < total % parts else 0)
+
+def start_agent(command, mig_arguments, queries, limit):
+    arguments = shlex.split(command) + ["--agent"] + mig_arguments
+    if queries is not None:
+        arguments += ["-n", str(queries)]
+
+    if limit is not None:
+        arguments += ["-l", str(limit)]
+
+    return subprocess.Popen(arguments, stdin=subprocess.PIPE, stdout=subprocess.PIPE, bufsize=0)
+
+def synchronize(agent, probes):
+    best = None
+    for i in range(probes):
+        before = realtime()
+        agent.stdin.write(b"time\n")
+        agent.stdin.flush()
+        line = agent.stdout.readline()
+        after = realtime()
+
+        if not line:
+            raise Exception("agent exited during clock synchronization")
+
+        remote = int(line.split()[0])
+        rtt = after - before
+        offset = remote - (before + after)//2
+        if best is None or rtt < best[1]:
+            best = (offset, rtt)
+
+    return best
+
+def get_bucket_upper(lower):
+    if lower < 128:
+        return lower
+
+    return lower + (1 << (lower.bit_length() - 7)) - 1
+
+def merge_histograms(histograms):
+    buckets = {}
+    count = 0
+    total = 0
+    minimum = None
+    maximum = 0
+    for histogram in histograms:
+        if not histogram.get("count"):
+            continue
+
+        count += histogram["count"]
+        total += histogram["mean"]*histogram["count"]
+        minimum = histogram["min"] if minimum is None else min(minimum, histogram["min"])
+        maximum = max(maximum, histogram["max"])
+        for lower, value in histogram["buckets"]:
+            buckets[lower] = buckets.get(lower, 0) + value
+
+    buckets = sorted(buckets.items())
+    percentiles = {}
+    for percentile in __PERCENTILES:
+        value = 0
+        if count > 0:
+            rank = min(max(int(percentile*count/100. + 0.5), 1), count)
+            seen = 0
+            for lower, number in buckets:
+                seen += number
+                if seen >= rank:
+                    value = min(max(get_bucket_upper(lower), minimum), maximum)
+                    break
+
+        percentiles["%g" % percentile] = value
+
+    return {"count": count, "min": minimum or 0, "max": maximum, "mean": total/count if count else 0,
+            "percentiles": percentiles, "buckets": [list(bucket) for bucket in buckets]}
+
+def add_counters(left, right):
+    for key, value in right.items():
+        if isinstance(value, dict):
+            add_counters(left.setdefault(key, {}), value)
+        elif isinstance(value, (int, float)):
+            left[key] = left.get(key, 0) + value
+
+    return left
+
+# Lag and busy time are properties of every agent, so the worst agent is kept.
+def merge_generator(merged, part):
+    for key, value in part.items():
+        if key in ("drops", "limited_intervals"):
+            merged[key] = merged.get(key, 0) + value
+        elif key == "limited":
+            merged[key] = merged.get(key, False) or value
+        else:
+            merged[key] = max(merged.get(key, 0), value)
+
+    return merged
+
+# Mean in-flight counts of agents add up, the merged minimum and maximum can't
+# be told from theirs: the sum of agent minimums is at most the merged minimum
+# and the sum of maximums at least the merged maximum, so these are bounds.
+def merge_inflight(merged, part):
+    merged["mean"] = merged.get("mean", 0) + part.get("mean", 0)
+    merged["min_bound"] = merged.get("min_bound", 0) + part.get("min", 0)
+    merged["max_bound"] = merged.get("max_bound", 0) + part.get("max", 0)
+
+    return merged
+
+def merge_targets(results):
+    targets = {}
+    order = []
+    for data, offset in results:
+        for target in data.get("targets", []):
+            key = (target["address"], target["port"])
+            if key not in targets:
+                order.append(key)
+                targets[key] = []
+
+            targets[key].append(target)
+
+    merged = []
+    for key in order:
+        parts = targets[key]
+        merged.append({"address": key[0], "port": key[1], "weight": parts[0]["weight"],
+                       "sent": sum(part["sent"] for part in parts),
+                       "received": sum(part["received"] for part in parts),
+                       "max_inflight": max(part["max_inflight"] for part in parts),
+                       "latency": merge_histograms([part["latency"] for part in parts])})
+
+    return merged
+
+# Agents run at once, so their linear counts add up: rates are summed and
+# intercepts are moved to the first send of the merged run. The fit holds
+# only where ranges of all agents overlap.
+def merge_fits(agent_fits, name, origin):
+    left = None
+    right = None
+    intercept = 0.
+    rate = 0.
+    for agent_origin, fits in agent_fits:
+        fit = fits.get(name, [])
+        if agent_origin is None or not fit:
+            return []
+
+        (agent_left, agent_right), (agent_intercept, agent_rate) = fit[0]
+        agent_left += agent_origin - origin
+        agent_right += agent_origin - origin
+        left = agent_left if left is None else max(left, agent_left)
+        right = agent_right if right is None else min(right, agent_right)
+        intercept += agent_intercept - agent_rate*(agent_origin - origin)/__NANOSECONDS
+        rate += agent_rate
+
+    if left is None or left >= right:
+        return []
+
+    return [[[left, right], [intercept, rate]]]
+
+def merge_steady(agent_steady, sends, receives):
+    # Merged run is steady where every agent is steady, points are found again
+    # in merged timestamps and fits are left to the analyser.
+    if not agent_steady:
+        return None
+
+    steady = {"found": all(value.get("found") for translate, value in agent_steady),
+              "window": max(value.get("window", 0) for translate, value in agent_steady)}
+    if not steady["found"]:
+        return steady
+
+    start = max(translate(value["start"]) for translate, value in agent_steady)
+    end = min(translate(value["end"]) for translate, value in agent_steady)
+    if start >= end:
+        return {"found": False, "window": steady["window"]}
+
+    receives = [timestamp for timestamp in receives if timestamp > 0]
+    steady.update({"start": start, "end": end,
+                   "points": [bisect.bisect_left(sends, start), bisect.bisect_left(sends, end)],
+                   "receive_points": [bisect.bisect_left(receives, start), bisect.bisect_left(receives, end)]})
+    return steady
+
+def merge(results):
+    def shift(data, offset):
+        clock = data["clock"]
+        return lambda timestamp: timestamp - clock["monotonic"] + clock["realtime"] - offset
+
+    starts = [shift(data, offset)(data["clock"]["monotonic"]) for data, offset in results]
+    start = min(starts)
+
+    sends = []
+    receives = []
+    pairs = []
+    lost = 0
+    responses = {}
+    load = {}
+    attempts = []
+    sockets = []
+    generator = {}
+    agent_fits = []
+    agent_steady = []
+    interval_length = None
+    intervals = []
+    for (data, offset), agent_start in zip(results, starts):
+        translate = shift(data, offset)
+
+        sends += [translate(timestamp) for timestamp in data.get("sends", [])]
+        agent_fits.append((translate(data["sends"][0]) if data.get("sends") else None, data.get("fits", {})))
+
+        agent_receives = [translate(timestamp) for timestamp in data.get("receives", []) if timestamp > 0]
+        lost += len(data.get("receives", [])) - len(agent_receives)
+        receives += agent_receives
+
+        for pair in data.get("pairs", []):
+            pair = list(pair)
+            pair[0] = translate(pair[0])
+            if len(pair) > 1:
+                pair[1] = translate(pair[1])
+
+            if len(pair) > 3:
+                pair[3] = translate(pair[3])
+
+            pairs.append(pair)
+
+        add_counters(responses, data.get("responses", {}))
+        add_counters(load, data.get("load", {}))
+        sockets += data.get("sockets", [])
+        if "steady" in data:
+            agent_steady.append((translate, data["steady"]))
+        merge_generator(generator, data.get("generator", {}))
+        for i, value in enumerate(data.get("load", {}).get("attempts", [])):
+            while len(attempts) <= i:
+                attempts.append(0)
+
+            attempts[i] += value
+
+        agent_intervals = data.get("intervals", {})
+        if interval_length is None:
+            interval_length = agent_intervals.get("length")
+
+        if agent_intervals.get("length") == interval_length and interval_length:
+            first = int(round(float(agent_start - start)/interval_length))
+            for i, values in enumerate(agent_intervals.get("values", [])):
+                while len(intervals) <= first + i:
+                    intervals.append({})
+
+                add_counters(intervals[first + i], dict((key, value) for key, value in values.items()
+                                                        if key not in ("generator", "inflight")))
+                if "inflight" in values:
+                    merge_inflight(intervals[first + i].setdefault("inflight", {}), values["inflight"])
+                if "generator" in values:
+                    merge_generator(intervals[first + i].setdefault("generator", {}), values["generator"])
+
+    sends = sorted(sends)
+    origin = sends[0] if sends else start
+    merged = {"clock": {"monotonic": start, "realtime": start},
+              "sends": sends,
+              "receives": sorted(receives) + [0]*lost,
+              "pairs": sorted(pairs, key=lambda x: x[0]),
+              "fits": {"sends": merge_fits(agent_fits, "sends", origin),
+                       "receives": merge_fits(agent_fits, "receives", origin)},
+              "latency": {"actual": merge_histograms([data.get("latency", {}).get("actual", {})
+                                                      for data, offset in results]),
+                          "intended": merge_histograms([data.get("latency", {}).get("intended", {})
+                                                        for data, offset in results])},
+              "responses": responses,
+              "load": dict(load, attempts=attempts),
+              "sockets": sockets,
+              "targets": merge_targets(results),
+              "generator": generator,
+              "intervals": {"start": start, "length": interval_length, "values": intervals}}
+
+    # A/B differences are paired within one agent and top domains are picked by
+    # sketches of one agent, so every agent keeps its own.
+    floors = [data["latency"]["floor"] for data, offset in results if "floor" in data.get("latency", {})]
+    if floors:
+        merged["latency"]["floor"] = merge_histograms(floors)
+
+    steady = merge_steady(agent_steady, sends, merged["receives"])
+    if steady is not None:
+        merged["steady"] = steady
+
+    for key in ("ab", "domains"):
+        values = [data[key] for data, offset in results if key in data]
+        if values:
+            merged[key] = values
+
+    return merged
+
+def main():
+    commands, output, queries, limit, lead, probes, keep, mig_arguments = get_arguments()
+
+    agents = []
+    for i, command in enumerate(commands):
+        agents.append(start_agent(command, mig_arguments,
+                                  split(queries, len(commands), i), split(limit, len(commands), i)))
+
+    clocks = []
+    for command, agent in zip(commands, agents):
+        offset, rtt = synchronize(agent, probes)
+        sys.stderr.write("%s: clock offset %d ns (+/- %d ns)\n" % (command, offset, rtt//2))
+        clocks.append((offset, rtt))
+
+    start = realtime() + int(lead*__NANOSECONDS) + max(rtt for offset, rtt in clocks)
+    for agent, (offset, rtt) in zip(agents, clocks):
+        agent.stdin.write(("start %d\n" % (start + offset)).encode())
+        agent.stdin.flush()
+
+    results = []
+    failed = False
+    for i, (command, agent, (offset, rtt)) in enumerate(zip(commands, agents, clocks)):
+        data, _ = agent.communicate()
+        if agent.returncode != 0:
+            sys.stderr.write("%s: agent failed with code %d\n" % (command, agent.returncode))
+            failed = True
+            continue
+
+        if keep:
+            with open(os.path.join(keep, "agent-%d.json" % i), "wb") as f:
+                f.write(data)
+
+        results.append((json.loads(data.decode()), offset))
+
+    if failed:
+        return 1
+
+    merged = merge(results)
+    merged["agents"] = [{"command": command, "offset": offset, "rtt": rtt,
+                         "sent": len(data["sends"]),
+                         "received": len([timestamp for timestamp in data["receives"] if timestamp > 0])}
+                        for command, (offset, rtt), (data, _) in zip(commands, clocks, results)]
+
+    if output:
+        with open(output, "w") as f:
+            json.dump(merged, f)
+    else:
+        json.dump(merged, sys.stdout)
+
+    sent = len(merged["sends"])
+    received = len([timestamp for timestamp in merged["receives"] if timestamp > 0])
+    sys.stderr.write("Agents: %d, sent: %d, received: %d, lost: %d\n" % (len(results), sent, received,
+                                                                         sent - received))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
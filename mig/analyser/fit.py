@@ -2,9 +2,6 @@ import sys
 import json
 import math
 
-import numpy
-from scipy.optimize import leastsq
-
 def jload(name):
     with open(name) as f:
        data = json.load(f)
@@ -12,14 +9,18 @@ def jload(name):
     sends = data.get("sends", [])
     receives = data.get("receives", [])
     pairs = data.get("pairs", [])
+    fits = data.get("fits", {})
 
     receives = filter(lambda x: x > 0, receives)
 
-    return sends, receives, pairs
+    return sends, receives, pairs, fits
 
 __NANOSECONDS = 1e9
 
 def calculate_fit(timestamps, start, params):
+    import numpy
+    from scipy.optimize import leastsq
+
     def linear_count(x, timestamp):
         return x[0] + x[1]*(timestamp - start)/__NANOSECONDS
 
@@ -42,12 +43,19 @@ def calculate_fit(timestamps, start, params):
     return leastsq(linear_count_residuals, numpy.array(x0),
                    args=(numpy.array(timestamp_train), numpy.array(count_train)))[0]
 
+# MiG fits rates online while running, fall back to fitting timestamps for older output.
+def get_rate(fits, name, timestamps, start):
+    if fits.get(name):
+        return fits[name][0][1][1]
+
+    return calculate_fit(timestamps, start, [])[1]
+
 def main():
     path = sys.argv[1]
 
-    sends, receives, pairs = jload(path)
-    send = calculate_fit(sends, sends[0], [])[1]
-    recv = calculate_fit(receives, sends[0], [])[1] if receives else 0
+    sends, receives, pairs, fits = jload(path)
+    send = get_rate(fits, "sends", sends, sends[0])
+    recv = get_rate(fits, "receives", receives, sends[0]) if receives else 0
     lost = len(sends) - len(receives)
 
     print json.dumps({"send": send, "recv": recv, "lost": lost})
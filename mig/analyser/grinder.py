@@ -1,5 +1,6 @@
 # -*- coding: utf-8 -*-
 import argparse
+import bisect
 import sys
 import json
 import math
@@ -23,6 +24,8 @@ def get_arguments():
                         help="left data limit (ignore all data before the point)")
     parser.add_argument("--to-point", type=int, default=None,
                         help="right data limit (ignore all data after the point)")
+    parser.add_argument("--whole", action="store_true", default=False,
+                        help="ignore steady state marked in input files and use the whole run")
     parser.add_argument("--no-fit", action="store_true", default=False,
                         help="ignore fits section in input files")
     parser.add_argument("--rates", action="store_true", default=False,
@@ -33,7 +36,7 @@ def get_arguments():
 
     arguments = parser.parse_args()
     return arguments.output, arguments.title, arguments.details, arguments.inputs, \
-           arguments.from_point, arguments.to_point, arguments.no_fit, arguments.rates
+           arguments.from_point, arguments.to_point, arguments.whole, arguments.no_fit, arguments.rates
 
 __SENDS_MARK = "sends"
 __RECEIVES_MARK = "receives"
@@ -112,7 +115,7 @@ def load(name):
         for line in f.readlines():
             processor = processor(line.strip().lower())
 
-    return sends, receives, pairs, fits
+    return sends, receives, pairs, fits, {}, {}
 
 def jload(name):
     with open(name) as f:
@@ -122,6 +125,8 @@ def jload(name):
     receives = data.get("receives", [])
     pairs = data.get("pairs", [])
     fits = data.get("fits", {})
+    intervals = data.get("intervals", {})
+    steady = data.get("steady", {})
 
     receives = filter(lambda x: x > 0, receives)
 
@@ -131,7 +136,7 @@ def jload(name):
     if __RECEIVES_MARK not in fits:
         fits[__RECEIVES_MARK] = []
 
-    return sends, receives, pairs, fits
+    return sends, receives, pairs, fits, intervals, steady
 
 NAME_REGEX = re.compile("test\\-(\\d+)\\.json$", flags=re.IGNORECASE)
 
@@ -158,6 +163,7 @@ __FITPOINTS = 500
 __MICROSECOND = 1e3
 __MILLISECOND = 1e6
 __NANOSECONDS = 1e9
+__FIT_TOLERANCE = 0.05
 
 def make_count(timestamps, name, start, fit, color):
     data = []
@@ -323,6 +329,15 @@ def make_queue(pairs, name, start, color):
 
     return {"values": data, "key": name, "color": color}
 
+# MiG tracks in-flight queries itself, mean of every interval is placed at its middle.
+def make_interval_queue(intervals, name, start, color):
+    data = []
+    for i, value in enumerate(intervals["values"]):
+        timestamp = intervals["start"] + (i + 0.5)*intervals["length"]
+        data.append({"x": (timestamp - start)/__MILLISECOND, "y": value["inflight"]["mean"]})
+
+    return {"values": data, "key": name, "color": color}
+
 def calculate_fit(timestamps, start, params):
     def linear_count(x, timestamp):
         return x[0] + x[1]*(timestamp - start)/__NANOSECONDS
@@ -339,23 +354,41 @@ def calculate_fit(timestamps, start, params):
     points = [(timestamp, i + 1) for i, timestamp in enumerate(timestamps) if left <= timestamp - start <= right]
     timestamp_train, count_train = zip(*points)
 
-    timestamp_train = numpy.array(timestamps)
-    count_train = numpy.array(range(1, len(timestamps) + 1))
-
     x0 = params[1] if len(params) > 1 else [0., 1.]
     return leastsq(linear_count_residuals, numpy.array(x0),
                    args=(numpy.array(timestamp_train), numpy.array(count_train)))[0]
 
 
+# Fit is drawn over the data it has been taken from, so it has to pass through
+# them in the middle of its range. A miss means the fit and the timestamps
+# count time or queries from different points.
+def check_fit(timestamps, start, left, right, fit, name):
+    index = min(bisect.bisect_left(timestamps, start + (left + right)/2), len(timestamps) - 1)
+    count = fit[0] + fit[1]*(timestamps[index] - start)/__NANOSECONDS
+    if abs(count - (index + 1)) <= max(__FIT_TOLERANCE*(index + 1), 1):
+        return True
+
+    print "Warning: %s misses the data by %.0f queries at %.3f ms" % \
+          (name, count - (index + 1), (timestamps[index] - start)/__MILLISECOND)
+    return False
+
 def make_fit(timestamps, count_name, rate_name, start, params, color):
-    fit = calculate_fit(timestamps, start, params)
+    if params:
+        left, right = tuple(params[0])
+    else:
+        left = timestamps[0] - start
+        right = timestamps[-1] - start
+
+    # Fits written by MiG are drawn as they are, the others are fitted here.
+    fit = params[1] if len(params) > 1 else calculate_fit(timestamps, start, params)
+    check_fit(timestamps, start, left, right, fit, count_name)
 
     count_data = []
     rate_data = []
-    time_step = (right - left)/__MILLISECOND/__FITPOINTS
-    for i in range(__FITPOINTS):
-        timestamp = time_step*i
-        count_data.append({"x": timestamp, "y": linear_count(fit, timestamp*__MILLISECOND + start)})
+    time_step = float(right - left)/__MILLISECOND/__FITPOINTS
+    for i in range(__FITPOINTS + 1):
+        timestamp = left/__MILLISECOND + time_step*i
+        count_data.append({"x": timestamp, "y": fit[0] + fit[1]*timestamp*__MILLISECOND/__NANOSECONDS})
         rate_data.append({"x": timestamp, "y": fit[1]})
 
     print "%s: %f QpS, delay: %f ms" % (rate_name, fit[1], -fit[0]/fit[1]*1e3)
@@ -371,7 +404,7 @@ def hide(series, start=0):
         line["disabled"] = True
 
 def main():
-    output, title, details, inputs, from_point, to_point, no_fit, build_rates = get_arguments()
+    output, title, details, inputs, from_point, to_point, whole, no_fit, build_rates = get_arguments()
 
     inputs = list(enumerate_inputs(inputs))
     scaled_speed = 0
@@ -420,11 +453,21 @@ def main():
     receiving_labels_series = {"values": [], "key": "Receiving", "color": "#000000"}
 
     for i, name, label, speed in inputs:
-        sends, receives, pairs, fits = jload(name)
+        sends, receives, pairs, fits, intervals, steady = jload(name)
         if no_fit:
             fits = {__SENDS_MARK: [], __RECEIVES_MARK: []}
 
-        if from_point is not None and to_point is not None:
+        # Steady state marked by mig replaces manual limits unless they are given.
+        if steady.get("found") and not whole and from_point is None and to_point is None:
+            sends_from, sends_to = steady["points"]
+            receives_from, receives_to = steady["receive_points"]
+            sends = sends[sends_from:sends_to]
+            receives = receives[receives_from:receives_to]
+            pairs = pairs[sends_from:sends_to]
+            if not no_fit:
+                fits = steady.get("fits", {__SENDS_MARK: [], __RECEIVES_MARK: []})
+
+        elif from_point is not None and to_point is not None:
             sends = sends[from_point:to_point]
             receives = receives[from_point:to_point]
             pairs = pairs[from_point:to_point]
@@ -512,7 +555,11 @@ def main():
 
         processing.append(series)
 
-        queue.append(make_queue(pairs, "Queue%s" % additional, start, __COLORS[i % len(__COLORS)]))
+        values = intervals.get("values", [])
+        if values and all("inflight" in value for value in values):
+            queue.append(make_interval_queue(intervals, "Queue%s" % additional, start, __COLORS[i % len(__COLORS)]))
+        else:
+            queue.append(make_queue(pairs, "Queue%s" % additional, start, __COLORS[i % len(__COLORS)]))
 
     charts = []
     if build_rates:
@@ -2,9 +2,6 @@ import sys
 import json
 import math
 
-import numpy
-from scipy.optimize import leastsq
-
 def jload(name):
     with open(name) as f:
        data = json.load(f)
@@ -12,14 +9,18 @@ def jload(name):
     sends = data.get("sends", [])
     receives = data.get("receives", [])
     pairs = data.get("pairs", [])
+    fits = data.get("fits", {})
 
     receives = filter(lambda x: x > 0, receives)
 
-    return sends, receives, pairs
+    return sends, receives, pairs, fits
 
 __NANOSECONDS = 1e9
 
 def calculate_fit(timestamps, start, params):
+    import numpy
+    from scipy.optimize import leastsq
+
     def linear_count(x, timestamp):
         return x[0] + x[1]*(timestamp - start)/__NANOSECONDS
 
@@ -42,6 +43,13 @@ def calculate_fit(timestamps, start, params):
     return leastsq(linear_count_residuals, numpy.array(x0),
                    args=(numpy.array(timestamp_train), numpy.array(count_train)))[0]
 
+# MiG fits rates online while running, fall back to fitting timestamps for older output.
+def get_rate(fits, name, timestamps, start):
+    if fits.get(name):
+        return fits[name][0][1][1]
+
+    return calculate_fit(timestamps, start, [])[1]
+
 def rate_round(r):
     i = 0
     while r > 100:
@@ -56,8 +64,8 @@ def main():
     high = int(sys.argv[3])
     test = int(sys.argv[4])
 
-    sends, receives, pairs = jload(path)
-    rate = calculate_fit(sends, sends[0], [])[1]
+    sends, receives, pairs, fits = jload(path)
+    rate = get_rate(fits, "sends", sends, sends[0])
     lost = len(sends) - len(receives)
 
     if high < 0:
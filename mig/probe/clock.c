@@ -0,0 +1,184 @@
+#ifdef __x86_64__
+	#include <cpuid.h>
+	#include <x86intrin.h>
+	#define HAVE_TSC 1
+#endif
+
+#include "clock.h"
+#include "logger.h"
+
+#define NANOSECONDS 1000000000ULL
+
+// Rate is measured twice over the window, both measurements have to agree
+// within the tolerance (parts per million) for TSC to be used. Every sample
+// pairs clock call with the closest TSC reads out of several attempts.
+#define TSC_CALIBRATION_TIME (20*(NANOSECONDS/1000))
+#define TSC_TOLERANCE 100
+#define TSC_SAMPLE_ATTEMPTS 16
+#define TSC_SHIFT 32
+
+static int tsc_enabled = 0;
+static unsigned long long tsc_base = 0;
+static unsigned long long clock_base = 0;
+static unsigned long long tsc_multiplier = 0;
+
+static int get_clock_time(unsigned long long *timestamp)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_SOURCE, &now) == -1)
+	{
+		log_errno("Error on getting timestamp.");
+		return -1;
+	}
+
+	*timestamp = now.tv_sec;
+	*timestamp *= NANOSECONDS;
+	*timestamp += now.tv_nsec;
+
+	return 0;
+}
+
+#ifdef HAVE_TSC
+static int has_invariant_tsc(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) return 0;
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) return 0;
+
+	return (edx & (1 << 8)) != 0;
+}
+
+static int get_clock_sample(unsigned long long *tsc, unsigned long long *timestamp)
+{
+	unsigned long long best = 0;
+
+	int i;
+	for (i = 0; i < TSC_SAMPLE_ATTEMPTS; i++)
+	{
+		unsigned long long before = __rdtsc();
+		unsigned long long now;
+		if (get_clock_time(&now) != 0) return -1;
+		unsigned long long after = __rdtsc();
+
+		if (i == 0 || after - before < best)
+		{
+			best = after - before;
+			*tsc = before + best/2;
+			*timestamp = now;
+		}
+	}
+
+	return 0;
+}
+
+static int wait_clock(unsigned long long until)
+{
+	unsigned long long now;
+	do
+	{
+		if (get_clock_time(&now) != 0) return -1;
+	}
+	while (now < until);
+
+	return 0;
+}
+
+static unsigned long long get_multiplier(unsigned long long ticks, unsigned long long nanoseconds)
+{
+	return (unsigned long long) (((unsigned __int128) nanoseconds << TSC_SHIFT)/ticks);
+}
+
+static unsigned long long convert_tsc(unsigned long long tsc)
+{
+	return clock_base + (unsigned long long) (((unsigned __int128) (tsc - tsc_base)*tsc_multiplier) >> TSC_SHIFT);
+}
+#endif
+
+int enable_tsc_clock(void)
+{
+#ifdef HAVE_TSC
+	if (!has_invariant_tsc())
+	{
+		log_error("Can't use TSC clock: CPU doesn't report invariant TSC.");
+		return -1;
+	}
+
+	unsigned long long tsc[3];
+	unsigned long long timestamp[3];
+	if (get_clock_sample(&tsc[0], &timestamp[0]) != 0 ||
+	    wait_clock(timestamp[0] + TSC_CALIBRATION_TIME) != 0 ||
+	    get_clock_sample(&tsc[1], &timestamp[1]) != 0 ||
+	    wait_clock(timestamp[1] + TSC_CALIBRATION_TIME) != 0 ||
+	    get_clock_sample(&tsc[2], &timestamp[2]) != 0) return -1;
+
+	if (tsc[1] <= tsc[0] || tsc[2] <= tsc[1])
+	{
+		log_error("Can't use TSC clock: TSC doesn't grow.");
+		return -1;
+	}
+
+	unsigned long long first = get_multiplier(tsc[1] - tsc[0], timestamp[1] - timestamp[0]);
+	unsigned long long second = get_multiplier(tsc[2] - tsc[1], timestamp[2] - timestamp[1]);
+	double difference = 1e6*((double) second - first)/first;
+	if (difference > TSC_TOLERANCE || difference < -TSC_TOLERANCE)
+	{
+		log_error("Can't use TSC clock: its rate is unstable (%.1f ppm between calibrations).", difference);
+		return -1;
+	}
+
+	tsc_base = tsc[0];
+	clock_base = timestamp[0];
+	tsc_multiplier = get_multiplier(tsc[2] - tsc[0], timestamp[2] - timestamp[0]);
+	tsc_enabled = 1;
+
+	log_message("Using TSC clock at %.6f GHz (%.1f ppm between calibrations).",
+	            (double) (tsc[2] - tsc[0])/(timestamp[2] - timestamp[0]), difference);
+	return 0;
+#else
+	log_error("Can't use TSC clock: not supported on this platform.");
+	return -1;
+#endif
+}
+
+int is_tsc_clock(void)
+{
+	return tsc_enabled;
+}
+
+int get_timestamp(unsigned long long *timestamp)
+{
+#ifdef HAVE_TSC
+	if (tsc_enabled)
+	{
+		*timestamp = convert_tsc(__rdtsc());
+		return 0;
+	}
+#endif
+
+	return get_clock_time(timestamp);
+}
+
+int check_clock_drift(long long *drift)
+{
+	*drift = 0;
+
+#ifdef HAVE_TSC
+	if (!tsc_enabled) return 0;
+
+	unsigned long long tsc;
+	unsigned long long timestamp;
+	if (get_clock_sample(&tsc, &timestamp) != 0) return -1;
+
+	*drift = (long long) (convert_tsc(tsc) - timestamp);
+
+	double elapsed = (double) (timestamp - clock_base);
+	double rate = (elapsed > 0)? 1e6*(*drift)/elapsed : 0;
+	if (rate > TSC_TOLERANCE || rate < -TSC_TOLERANCE)
+	{
+		log_error("Warning: TSC clock has drifted by %lld ns in %.3f s (%.1f ppm), "
+		          "timestamps may be off by up to that much.", *drift, elapsed/NANOSECONDS, rate);
+	}
+#endif
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+
+#define SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HALF_SUB_COUNT (1 << (HISTOGRAM_SUB_BITS - 1))
+
+static const double percentiles[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+
+static size_t get_bucket_index(unsigned long long value)
+{
+	if (value < SUB_COUNT) return (size_t) value;
+
+	int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS + 1;
+	if (shift > HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) return HISTOGRAM_BUCKETS - 1;
+
+	return SUB_COUNT + (shift - 1)*HALF_SUB_COUNT + (size_t) (value >> shift) - HALF_SUB_COUNT;
+}
+
+static unsigned long long get_bucket_lower(size_t index)
+{
+	if (index < SUB_COUNT) return index;
+
+	index -= SUB_COUNT;
+	int shift = index/HALF_SUB_COUNT + 1;
+	unsigned long long mantissa = index % HALF_SUB_COUNT + HALF_SUB_COUNT;
+
+	return mantissa << shift;
+}
+
+static unsigned long long get_bucket_upper(size_t index)
+{
+	if (index < SUB_COUNT) return index;
+
+	return get_bucket_lower(index + 1) - 1;
+}
+
+void reset_histogram(struct histogram *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+void add_histogram_value(struct histogram *histogram, unsigned long long value)
+{
+	if (histogram->count == 0 || value < histogram->min) histogram->min = value;
+	if (value > histogram->max) histogram->max = value;
+
+	histogram->count++;
+	histogram->sum += value;
+	histogram->buckets[get_bucket_index(value)]++;
+}
+
+void merge_histogram(struct histogram *histogram, const struct histogram *other)
+{
+	if (other->count == 0) return;
+
+	if (histogram->count == 0 || other->min < histogram->min) histogram->min = other->min;
+	if (other->max > histogram->max) histogram->max = other->max;
+
+	histogram->count += other->count;
+	histogram->sum += other->sum;
+
+	size_t i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) histogram->buckets[i] += other->buckets[i];
+}
+
+unsigned long long get_histogram_percentile(const struct histogram *histogram, double percentile)
+{
+	if (histogram->count == 0) return 0;
+
+	unsigned long long rank = (unsigned long long) (percentile*histogram->count/100.0 + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > histogram->count) rank = histogram->count;
+
+	unsigned long long seen = 0;
+	size_t i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->buckets[i];
+		if (seen >= rank)
+		{
+			unsigned long long value = get_bucket_upper(i);
+			if (value > histogram->max) value = histogram->max;
+			if (value < histogram->min) value = histogram->min;
+
+			return value;
+		}
+	}
+
+	return histogram->max;
+}
+
+void print_histogram(FILE *output, const struct histogram *histogram)
+{
+	fprintf(output, "{\"count\": %llu, \"min\": %llu, \"max\": %llu, \"mean\": %llu,\n\t\t \"percentiles\": {",
+	        histogram->count, histogram->min, histogram->max,
+	        histogram->count > 0? histogram->sum/histogram->count : 0);
+
+	size_t i;
+	for (i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); i++)
+	{
+		fprintf(output, "%s\"%g\": %llu", i > 0? ", " : "",
+		        percentiles[i], get_histogram_percentile(histogram, percentiles[i]));
+	}
+
+	fprintf(output, "},\n\t\t \"buckets\": [");
+
+	int first = 1;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (histogram->buckets[i] == 0) continue;
+
+		fprintf(output, "%s[%llu, %llu]", first? "" : ", ", get_bucket_lower(i), histogram->buckets[i]);
+		first = 0;
+	}
+
+	fprintf(output, "]}");
+}
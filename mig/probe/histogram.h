@@ -0,0 +1,30 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdio.h>
+
+// Log-linear buckets: values below 2^HISTOGRAM_SUB_BITS are exact, above that
+// every power of two is split into 2^(HISTOGRAM_SUB_BITS - 1) equal buckets
+// (relative error under 1.6%). Values above 2^HISTOGRAM_MAX_BITS are clamped.
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((1 << HISTOGRAM_SUB_BITS) + \
+                           (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1)*(1 << (HISTOGRAM_SUB_BITS - 1)))
+
+struct histogram
+{
+	unsigned long long count;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long sum;
+
+	unsigned long long buckets[HISTOGRAM_BUCKETS];
+};
+
+void reset_histogram(struct histogram *histogram);
+void add_histogram_value(struct histogram *histogram, unsigned long long value);
+void merge_histogram(struct histogram *histogram, const struct histogram *other);
+unsigned long long get_histogram_percentile(const struct histogram *histogram, double percentile);
+void print_histogram(FILE *output, const struct histogram *histogram);
+
+#endif // __HISTOGRAM_H__
@@ -7,6 +7,13 @@
 #define TIMESTAMP_MAXLENGTH 64
 #define TIMESTAMP_FORMAT "%x %X"
 
+static FILE *message_stream = NULL;
+
+void set_message_stream(FILE *stream)
+{
+	message_stream = stream;
+}
+
 void print_timestamp(FILE *stream)
 {
 	time_t timestamp = time(NULL);
@@ -23,10 +30,12 @@ void log_message(const char *format, ...)
 	va_list ap;
 	va_start(ap, format);
 
-	print_timestamp(stdout);
-	vprintf(format, ap);
-	printf("\n");
-	fflush(stdout);
+	FILE *stream = message_stream? message_stream : stdout;
+
+	print_timestamp(stream);
+	vfprintf(stream, format, ap);
+	fprintf(stream, "\n");
+	fflush(stream);
 }
 
 void log_error(const char *format, ...)
@@ -1,6 +1,10 @@
 #ifndef __LOGGER_H__
 #define __LOGGER_H__
 
+#include <stdio.h>
+
+void set_message_stream(FILE *stream);
+
 void log_message(const char *format, ...);
 void log_error(const char *format, ...);
 void log_errno(const char *format, ...);
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <time.h>
 #include <errno.h>
@@ -6,21 +8,23 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <limits.h>
+#include <math.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "logger.h"
-
-#ifdef CLOCK_MONOTONIC_RAW
-	#define CLOCK_SOURCE CLOCK_MONOTONIC_RAW
-#else
-	#define CLOCK_SOURCE CLOCK_MONOTONIC
-#endif
+#include "histogram.h"
+#include "pcap.h"
+#include "timer_wheel.h"
+#include "clock.h"
 
 #define CLIENT_ID_LENGTH 16
 #define RECEIVE_BUFFER_SIZE 65535
@@ -28,16 +32,175 @@
 
 #define NANOSECONDS 1000000000
 
-#define RECV_TIMEOUT 35
+#define DEFAULT_TIMEOUT 5000
+#define MAX_TARGETS 255
+#define MAX_TARGET_WEIGHT 1000
+#define DEFAULT_SLICE 100
+
+#define MAX_TOP 1000
+
+// Per domain latency sketch: 2^DOMAIN_SKETCH_SUB_BITS buckets per power of
+// two from 2^DOMAIN_SKETCH_MIN_BITS nanoseconds (relative error under 25%),
+// everything below goes to the first bucket, above range to the last one.
+#define DOMAIN_SKETCH_SUB_BITS 2
+#define DOMAIN_SKETCH_MIN_BITS 10
+#define DOMAIN_SKETCH_BUCKETS 96
+#define DOMAIN_NAME_SIZE 256
+
+#define MAX_SOCKETS 512
+#define MAX_BIND_ADDRESSES 16
+
+#define MAX_RETRIES 15
+#define DEFAULT_RETRY_TIMEOUT 1000
+#define DEFAULT_BACKOFF 2.0
+
+#define TIMER_TICK (NANOSECONDS/1000)
+#define RECEIVE_POLL_TIME (10*(NANOSECONDS/1000))
+
+#define SEND_SPIN_TIME 100000
+
+// Interval is limited by the tool itself when sends lag behind schedule by
+// more than this on average, its busiest loop is busy more than this part
+// of the interval or the kernel drops replies on its sockets.
+#define GENERATOR_LAG_LIMIT (NANOSECONDS/1000)
+#define GENERATOR_BUSY_LIMIT 0.9
+
+// Window of intervals is steady when receive rate of every interval in it is
+// within the tolerance of their mean and so is median latency of queries
+// sent during the interval (or within the slack for sub-millisecond ones).
+#define STEADY_RATE_TOLERANCE 0.1
+#define STEADY_LATENCY_TOLERANCE 0.25
+#define STEADY_LATENCY_SLACK (50*(NANOSECONDS/1000))
+#define MIN_STEADY_WINDOW 2
+
+// Room for drop counter and GRO segment size control messages.
+#define RECEIVE_CONTROL_SIZE 64
+
+#define MAX_BUSY_POLL 1000000
+#define FLOOR_TIMEOUT (100*(NANOSECONDS/1000))
+
+#define AGENT_COMMAND_SIZE 256
+#define AGENT_SPIN_TIME (NANOSECONDS/1000)
+
+#define DEFAULT_INTERVAL 1000
+#define INTERVALS_INITIAL_CAPACITY 64
+
+#define RCODE_COUNT 16
+#define FLAG_RESPONSE 0x8000
+#define FLAG_TRUNCATED 0x0200
+#define RCODE_MASK 0x000f
+
+// OPT pseudo record (RDLENGTH is filled in), followed by client id option
+// and room for EDNS Client Subnet option which are patched at send time.
+char opt_record[] = {'\x00', '\x00', '\x29', '\x10', '\x00', '\x00', '\x00', '\x80',
+                     '\x00', '\x00', '\x00'};
+char client_option[] = {'\xff', '\xee', '\x00', '\x10'};
+char ecs_option[] = {'\x00', '\x08', '\x00', '\x08', '\x00', '\x01', '\x20', '\x00',
+                     '\x00', '\x00', '\x00', '\x00'};
+
+#define OPT_RDLENGTH_OFFSET 9
+#define CLIENT_OPTION_SIZE (sizeof(client_option) + CLIENT_ID_LENGTH)
+#define ECS_OPTION_SIZE sizeof(ecs_option)
+#define ECS_ADDRESS_SIZE 4
+
+#define MAX_ECS_POOL (1 << 24)
+
+#define STATUS_SENT 0x40
+#define STATUS_ANSWERED 0x80
+#define STATUS_LOST 0x20
+#define STATUS_TRUNCATED 0x10
+#define STATUS_RCODE_MASK 0x0f
+
+struct query_table
+{
+	size_t count;
+	unsigned long long start;
+	unsigned long long start_realtime;
+
+	unsigned long long *sent;
+	unsigned long long *intended;
+	unsigned long long *received;
+	unsigned char *status;
+
+	unsigned long long *receives;
+
+	// Only with retries: time of the last retransmission, number of attempts
+	// sent (written by sender) and attempt the answer is attributed to.
+	size_t retries;
+	unsigned long long *retried;
+	unsigned char *attempts;
+	unsigned char *answered_by;
+
+	// Only with several targets: target of each query.
+	unsigned char *targets;
+
+	// Queries sent and neither answered nor lost yet (shared by threads).
+	size_t inflight;
+};
+
+struct latency_histograms
+{
+	struct histogram actual;
+	struct histogram intended;
+};
+
+const char *rcode_names[RCODE_COUNT] = {"noerror", "formerr", "servfail", "nxdomain",
+                                         "notimp", "refused", "yxdomain", "yxrrset",
+                                         "nxrrset", "notauth", "notzone", "rcode11",
+                                         "rcode12", "rcode13", "rcode14", "rcode15"};
+
+struct response_counters
+{
+	size_t rcodes[RCODE_COUNT];
+	size_t truncated;
+	size_t empty;
+	size_t good;
+};
 
-char additional[] = {'\x00', '\x00', '\x29', '\x10', '\x00', '\x00', '\x00', '\x80',
-                     '\x00', '\x00', '\x14', '\xff', '\xee', '\x00', '\x10'};
+struct interval_stats
+{
+	size_t sent;
+	size_t retries;
+	size_t received;
+	size_t lost;
+	struct response_counters responses;
+
+	// Queries answered or lost during the interval, extremes of in-flight
+	// count seen by sends and resolutions (minimum is valid only if anything
+	// has been resolved) and signed part of in-flight count integral over
+	// the interval (query-nanoseconds) contributed by its own events.
+	size_t resolved;
+	size_t max_inflight;
+	size_t min_inflight;
+	double inflight_area;
+
+	// Self checks of the tool: lag of sends behind schedule, time its
+	// busiest loop spent sending and receiving and replies the kernel
+	// dropped on its sockets because of full receive buffer.
+	unsigned long long max_lag;
+	unsigned long long lag;
+	unsigned long long busy;
+	size_t drops;
+};
 
-struct pair_timespec
+struct run_stats
 {
-	struct timespec sent;
-	unsigned int answer;
-	struct timespec received;
+	struct response_counters responses;
+	size_t malformed;
+	size_t unexpected;
+	size_t duplicates;
+	size_t late;
+	size_t lost;
+
+	size_t retries;
+	size_t attempts[MAX_RETRIES + 1];
+	size_t drops;
+
+	unsigned long long interval;
+
+	size_t interval_count;
+	size_t interval_capacity;
+	struct interval_stats *intervals;
 };
 
 struct dns_query
@@ -50,17 +213,24 @@ struct dns_query
 	unsigned short additional;
 };
 
-void *make_queries(char *names, size_t count, char *client)
+size_t get_opt_size(char *client, int ecs)
+{
+	if (client == NULL && !ecs) return 0;
+
+	return sizeof(opt_record) + (client? CLIENT_OPTION_SIZE : 0) + (ecs? ECS_OPTION_SIZE : 0);
+}
+
+void *make_queries(char *names, size_t count, char *client, int ecs)
 {
 	size_t i;
 	size_t total = 0;
 	char *name = names;
+	size_t opt_size = get_opt_size(client, ecs);
 
 	for (i = 0; i < count; i++)
 	{
 		size_t name_size = strlen(name) + 1;
-		size_t size = sizeof(size_t) + sizeof(struct dns_query) + name_size + 2*sizeof(unsigned short);
-		if (client) size += sizeof(additional) + CLIENT_ID_LENGTH;
+		size_t size = sizeof(size_t) + sizeof(struct dns_query) + name_size + 2*sizeof(unsigned short) + opt_size;
 
 		total += size;
 		name += name_size;
@@ -75,8 +245,7 @@ void *make_queries(char *names, size_t count, char *client)
 	for (i = 0; i < count; i++)
 	{
 		size_t name_size = strlen(name) + 1;
-		size_t size = sizeof(struct dns_query) + name_size + 2*sizeof(unsigned short);
-		if (client) size += sizeof(additional) + CLIENT_ID_LENGTH;
+		size_t size = sizeof(struct dns_query) + name_size + 2*sizeof(unsigned short) + opt_size;
 
 		*((size_t *) offset) = size;
 		offset += sizeof(size_t);
@@ -87,7 +256,7 @@ void *make_queries(char *names, size_t count, char *client)
 		q->questions = htons(1);
 		q->answers = htons(0);
 		q->authorities = htons(0);
-		q->additional = htons(client? 1 : 0);
+		q->additional = htons(opt_size > 0? 1 : 0);
 		offset += sizeof(struct dns_query);
 
 		char *q_name = (char *) offset;
@@ -105,637 +274,3718 @@ void *make_queries(char *names, size_t count, char *client)
 		*q_class = htons(0x0001);
 		offset += sizeof(unsigned short);
 
+		if (opt_size > 0)
+		{
+			memcpy(offset, opt_record, sizeof(opt_record));
+			unsigned short rdlength = htons((unsigned short) (opt_size - sizeof(opt_record)));
+			memcpy(offset + OPT_RDLENGTH_OFFSET, &rdlength, sizeof(rdlength));
+			offset += sizeof(opt_record);
+		}
+
 		if (client)
 		{
-			memcpy(offset, additional, sizeof(additional));
-			offset += sizeof(additional);
+			memcpy(offset, client_option, sizeof(client_option));
+			offset += sizeof(client_option);
 
 			memcpy(offset, client, CLIENT_ID_LENGTH);
 			offset += CLIENT_ID_LENGTH;
 		}
+
+		if (ecs)
+		{
+			memcpy(offset, ecs_option, sizeof(ecs_option));
+			offset += sizeof(ecs_option);
+		}
 	}
 
 	return buffer;
 }
 
-void *get_next_query(char **offset, size_t *size)
+// Per query EDNS values: client id of one of emulated subscribers and ECS
+// prefix out of the pool, chosen by query index so retransmission of the
+// query gets the same values.
+struct query_variation
 {
-	*size = *(size_t *) *offset;
-	*offset += sizeof(size_t);
+	int random;
 
-	void *query = *offset;
-	*offset += *size;
+	int client;
+	size_t subscribers;
+	char base_client[CLIENT_ID_LENGTH];
 
-	return query;
+	size_t ecs_count;
+	size_t ecs_capacity;
+	unsigned int *ecs_addresses;
+	unsigned char *ecs_bits;
+};
+
+unsigned long long mix_index(unsigned long long value)
+{
+	value += 0x9e3779b97f4a7c15ULL;
+	value = (value ^ (value >> 30))*0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27))*0x94d049bb133111ebULL;
+
+	return value ^ (value >> 31);
 }
 
-int sent_query(int fd, struct sockaddr_in *server, void *query, size_t size,
-               size_t *index, struct timespec *sends, struct pair_timespec *pairs, int verbose)
+size_t pick_variant(struct query_variation *variation, size_t index, size_t count, unsigned long long salt)
 {
-	ssize_t bytes_sent = sendto(fd, query, size, 0, (struct sockaddr *) server, sizeof(struct sockaddr_in));
-	if (bytes_sent == -1)
-	{
-		int errnum = errno;
+	if (!variation->random) return index % count;
 
-		char address[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, server, address, sizeof(address));
+	return (size_t) (mix_index(2*(unsigned long long) index + salt) % count);
+}
 
-		log_errno_ex(errnum, "[%s] Error on sending to %s:%hu.", address, htons(server->sin_port));
-		return -1;
-	}
+void patch_query(struct query_variation *variation, char *query, size_t *size, size_t index)
+{
+	char *end = query + *size;
+	size_t removed = 0;
 
-	if (bytes_sent != size)
+	if (variation->ecs_count > 0)
 	{
-		log_error("Expected to send %lu bytes but actually sent %ld.", size, bytes_sent);
-		return -1;
+		size_t k = pick_variant(variation, index, variation->ecs_count, 1);
+		unsigned char bits = variation->ecs_bits[k];
+		unsigned int address = variation->ecs_addresses[k];
+		size_t address_size = (bits + 7)/8;
+
+		unsigned char *option = (unsigned char *) end - ECS_OPTION_SIZE;
+		// Option length: family, source and scope prefix lengths and truncated address.
+		option[3] = (unsigned char) (4 + address_size);
+		option[6] = bits;
+		option[8] = (unsigned char) (address >> 24);
+		option[9] = (unsigned char) (address >> 16);
+		option[10] = (unsigned char) (address >> 8);
+		option[11] = (unsigned char) address;
+
+		removed = ECS_ADDRESS_SIZE - address_size;
+		end -= ECS_OPTION_SIZE;
+
+		unsigned short rdlength = (unsigned short) (ECS_OPTION_SIZE - removed + (variation->client? CLIENT_OPTION_SIZE : 0));
+		rdlength = htons(rdlength);
+		memcpy(end - (variation->client? CLIENT_OPTION_SIZE : 0) - sizeof(opt_record) + OPT_RDLENGTH_OFFSET,
+		       &rdlength, sizeof(rdlength));
 	}
 
-	int r = clock_gettime(CLOCK_SOURCE, &sends[*index]);
-	if (r == -1)
+	if (variation->subscribers > 0)
 	{
-		log_errno("Error on getting timestamp.");
-		return -1;
+		size_t k = pick_variant(variation, index, variation->subscribers, 0);
+
+		unsigned char *client = (unsigned char *) end - CLIENT_ID_LENGTH;
+		memcpy(client, variation->base_client, CLIENT_ID_LENGTH);
+		client[CLIENT_ID_LENGTH - 4] ^= (unsigned char) (k >> 24);
+		client[CLIENT_ID_LENGTH - 3] ^= (unsigned char) (k >> 16);
+		client[CLIENT_ID_LENGTH - 2] ^= (unsigned char) (k >> 8);
+		client[CLIENT_ID_LENGTH - 1] ^= (unsigned char) k;
 	}
 
-	pairs[*index].sent = sends[*index];
-
-	if (verbose) log_message("Sent %ld bytes.", bytes_sent);
-
-	(*index)++;
-
-	return 0;
+	*size -= removed;
 }
 
-int recv_answer(int fd, struct sockaddr_in *server, void *buffer, size_t size,
-                size_t *index, size_t count, struct timespec *receives, struct pair_timespec *pairs, int verbose)
+int add_ecs_prefixes(struct query_variation *variation, char *string)
 {
-	while (1)
-	{
-		ssize_t bytes_received = recv(fd, buffer, size, 0);
-		if (bytes_received == -1)
-		{
-			int errnum = errno;
-			if (errnum == EAGAIN) break;
+	char buffer[INET_ADDRSTRLEN + 8];
+	if (strlen(string) >= sizeof(buffer)) return -1;
 
-			char address[INET_ADDRSTRLEN];
-			inet_ntop(AF_INET, server, address, sizeof(address));
+	strcpy(buffer, string);
 
-			log_errno_ex(errnum, "Error on receiving from %s:%hu.", address, htons(server->sin_port));
-			return -1;
-		}
+	char *slash = strchr(buffer, '/');
+	if (slash == NULL) return -1;
 
-		if (bytes_received < sizeof(struct dns_query))
-		{
-			log_error("Expected at least %lu bytes but got only %ld.",
-			          sizeof(struct dns_query), bytes_received);
-			return -1;
-		}
+	*slash = '\0';
 
-		struct timespec received;
-		int r = clock_gettime(CLOCK_SOURCE, &received);
-		if (r == -1)
-		{
-			log_errno("Error on getting timestamp.");
-			return -1;
-		}
+	struct in_addr network;
+	if (inet_aton(buffer, &network) <= 0) return -1;
 
-		if (verbose) log_message("Got %ld bytes.", bytes_received);
+	char *endptr = NULL;
+	unsigned long bits = strtoul(slash + 1, &endptr, 10);
+	if (endptr == slash + 1 || bits > 32) return -1;
 
-		struct dns_query *query = (struct dns_query *) buffer;
-		query->transaction_id = htons(query->transaction_id);
-		query->flags = htons(query->flags);
-		query->questions = htons(query->questions);
-		query->answers = htons(query->answers);
-		query->authorities = htons(query->authorities);
-		query->additional = htons(query->additional);
+	unsigned long source = bits;
+	if (*endptr == '/')
+	{
+		char *start = endptr + 1;
+		source = strtoul(start, &endptr, 10);
+		if (endptr == start || source < bits || source > 32) return -1;
+	}
 
-		if (count < USHRT_MAX && query->transaction_id >= count)
-		{
-			log_error("Recevied message with transaction id %hu while expected maximum is %lu.",
-			          query->transaction_id, count);
-			return -1;
-		}
+	if (*endptr != '\0') return -1;
 
-		size_t pair_index = query->transaction_id;
-		struct pair_timespec *pair = NULL;
+	unsigned long long count = 1ULL << (source - bits);
+	if (variation->ecs_count + count > MAX_ECS_POOL) return -1;
 
-		unsigned long long received_nsec = received.tv_sec;
-		received_nsec *= NANOSECONDS;
-		received_nsec += received.tv_nsec;
+	if (variation->ecs_count + count > variation->ecs_capacity)
+	{
+		size_t capacity = variation->ecs_capacity? variation->ecs_capacity : 16;
+		while (capacity < variation->ecs_count + count) capacity *= 2;
 
-		while (pair_index < count)
-		{
-			pair = &pairs[pair_index];
-			unsigned long long sent_nsec = pair->sent.tv_sec;
-			sent_nsec *= NANOSECONDS;
-			sent_nsec += pair->sent.tv_nsec;
-			if (sent_nsec < received_nsec && pair->answer == 0) break;
+		unsigned int *addresses = realloc(variation->ecs_addresses, capacity*sizeof(unsigned int));
+		if (addresses == NULL) return -1;
+		variation->ecs_addresses = addresses;
 
-			pair_index += USHRT_MAX;
-		}
+		unsigned char *prefix_bits = realloc(variation->ecs_bits, capacity*sizeof(unsigned char));
+		if (prefix_bits == NULL) return -1;
+		variation->ecs_bits = prefix_bits;
 
-		if (pair_index < count)
-		{
-			pair->answer++;
-			receives[*index] = received;
-			pair->received = receives[*index];
-
-			if (verbose) log_message("Answer:\n"
-			                         "\tID.........: %hu\n"
-			                         "\tFlags......: 0x%hx\n"
-			                         "\tQueries....: %hu\n"
-			                         "\tAnswers....: %hu\n"
-			                         "\tAuthorities: %hu\n"
-			                         "\tAdditional.: %hu\n\n",
-			                         query->transaction_id,
-			                         query->flags,
-			                         query->questions,
-			                         query->answers,
-			                         query->authorities,
-			                         query->additional);
-
-			(*index)++;
-			if (verbose) log_message("Remains messages: %lu.", count - *index);
-		}
-		else if (verbose) log_error("Received duplicate answer for query with transaction id %hu.",
-		                            query->transaction_id);
+		variation->ecs_capacity = capacity;
+	}
+
+	unsigned int mask = (source == 0)? 0 : 0xffffffffU << (32 - source);
+	unsigned int base = ntohl(network.s_addr) & mask;
+
+	unsigned long long i;
+	for (i = 0; i < count; i++)
+	{
+		variation->ecs_addresses[variation->ecs_count] = base + (source == 0? 0 : (unsigned int) (i << (32 - source)));
+		variation->ecs_bits[variation->ecs_count] = (unsigned char) source;
+		variation->ecs_count++;
 	}
 
 	return 0;
 }
 
-void usage(void)
+void free_query_variation(struct query_variation *variation)
 {
-	printf("mig - DNS performance measurement tool\n\n"
-	       "Usage: mig <options>\n\n"
-	       "Options:\n"
-	       "\t-s, --server  - name server IPv4 address (required);\n"
-	       "\t-p, --port    - name server port (default 53);\n"
-	       "\t-c, --client  - client id (16 bytes hex string);\n"
-	       "\t-n, --queries - number of queries (default length of domain set);\n"
-	       "\t-l, --limit   - limit query rate to the number (default - no limit);\n"
-	       "\t-d, --domains - file with list of domains to query (ASCII lowercase separated by new line);\n"
-	       "\t-v, --verbose - print more details;\n"
-	       "\t-o, --output  - write statistics to specified file (default stdout);\n"
-               "\t-h, --help    - this message.\n");
+	free(variation->ecs_addresses);
+	free(variation->ecs_bits);
+
+	variation->ecs_addresses = NULL;
+	variation->ecs_bits = NULL;
+	variation->ecs_count = 0;
+	variation->ecs_capacity = 0;
 }
 
-struct mdig_options
+void *get_next_query(char **offset, size_t *size)
 {
-	struct sockaddr_in server;
-
-	int got_client;
-	char client[CLIENT_ID_LENGTH];
+	*size = *(size_t *) *offset;
+	*offset += sizeof(size_t);
 
-	int got_query_number;
-	size_t query_number;
-	size_t query_limit;
+	void *query = *offset;
+	*offset += *size;
 
-	size_t domain_count;
-	char *domains;
+	return query;
+}
 
-	FILE *output;
+void *make_replay_queries(struct pcap_queries *capture, size_t count, double speed,
+                          unsigned long long *intended)
+{
+	size_t i;
+	size_t total = 0;
+	char *offset = capture->buffer;
+	for (i = 0; i < count; i++)
+	{
+		if (i % capture->count == 0) offset = capture->buffer;
 
-	int verbose;
-};
+		size_t size;
+		get_next_query(&offset, &size);
+		total += sizeof(size_t) + size;
+	}
 
-static struct option long_options[] = {
-	{"help",    no_argument,       NULL, 'h'},
-	{"server",  required_argument, NULL, 's'},
-	{"port",    required_argument, NULL, 'p'},
-	{"client",  required_argument, NULL, 'c'},
-	{"queries", required_argument, NULL, 'n'},
-	{"limit",   required_argument, NULL, 'l'},
-	{"domains", required_argument, NULL, 'd'},
-	{"verbose", no_argument,       NULL, 'v'},
-	{"output",  required_argument, NULL, 'o'},
-	{NULL,      0,                 NULL, 0}
-};
+	char *buffer = malloc(total);
+	if (buffer == NULL) return NULL;
 
-enum get_options_result
-{
-	GOR_OK,
-	GOR_HELP,
-	GOR_ERROR
-};
+	unsigned long long span = capture->timestamps[capture->count - 1];
+	unsigned long long period = span + (capture->count > 1? span/(capture->count - 1) : 0);
+	if (period == 0) period = 1;
 
-extern char *optarg;
-extern int optind;
-extern int optopt;
-extern int opterr;
+	char *destination = buffer;
+	for (i = 0; i < count; i++)
+	{
+		size_t index = i % capture->count;
+		if (index == 0) offset = capture->buffer;
 
-int get_port_value(char *string, unsigned short *port)
-{
-	char *endptr = NULL;
+		size_t size;
+		void *query = get_next_query(&offset, &size);
 
-	errno = 0;
-	unsigned long value = strtoul(string, &endptr, 10);
+		*((size_t *) destination) = size;
+		destination += sizeof(size_t);
 
-	if (*endptr != '\0' || errno != 0 || value > USHRT_MAX) return -1;
+		memcpy(destination, query, size);
+		((struct dns_query *) destination)->transaction_id = htons((unsigned short) (i % USHRT_MAX));
+		destination += size;
 
-	*port = (unsigned short) value;
+		if (speed > 0)
+		{
+			unsigned long long timestamp = (i/capture->count)*period + capture->timestamps[index];
+			intended[i] = (unsigned long long) (timestamp/speed);
+		}
+	}
 
-	return 0;
+	return buffer;
 }
 
-int get_client_value(char *string, char *client)
+// Comparison by queries sends every query to both servers one right after the
+// other, so query i of the run is query i/2 of the list. Intended times of
+// replayed queries are spread the same way.
+void *make_query_pairs(void *queries, size_t count, unsigned long long *intended)
 {
-	if (strlen(string) != 2*CLIENT_ID_LENGTH) return -1;
+	size_t i;
+	size_t total = 0;
+	size_t size = 0;
+	char *offset = (char *) queries;
+	for (i = 0; i < count; i++)
+	{
+		if (i % 2 == 0) get_next_query(&offset, &size);
+		total += sizeof(size_t) + size;
+	}
 
-	char byte[] = "00";
-	char *endptr = NULL;
-	int i;
-	for (i = 0; i < CLIENT_ID_LENGTH; i++)
+	char *buffer = malloc(total);
+	if (buffer == NULL) return NULL;
+
+	offset = (char *) queries;
+	void *query = NULL;
+	char *destination = buffer;
+	for (i = 0; i < count; i++)
 	{
-		byte[0] = string[2*i];
-		byte[1] = string[2*i + 1];
+		if (i % 2 == 0) query = get_next_query(&offset, &size);
 
-		errno = 0;
-		unsigned long value = strtoul(byte, &endptr, 16);
-		if (*endptr != '\0' || errno != 0 || value > UCHAR_MAX)	return -1;
+		*((size_t *) destination) = size;
+		destination += sizeof(size_t);
 
-		client[i] = (char) value;
+		memcpy(destination, query, size);
+		((struct dns_query *) destination)->transaction_id = htons((unsigned short) (i % USHRT_MAX));
+		destination += size;
 	}
 
-	return 0;
+	if (intended != NULL)
+	{
+		for (i = count; i-- > 0;) intended[i] = intended[i/2];
+	}
+
+	return buffer;
 }
 
-int get_query_number_value(char *string, size_t *number)
+int get_realtime(unsigned long long *timestamp)
 {
-	char *endptr = NULL;
-
-	errno = 0;
-	unsigned long long value = strtoull(string, &endptr, 10);
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now) == -1)
+	{
+		log_errno("Error on getting real time.");
+		return -1;
+	}
 
-	if (*endptr != '\0' || errno != 0) return -1;
+	*timestamp = now.tv_sec;
+	*timestamp *= NANOSECONDS;
+	*timestamp += now.tv_nsec;
 
-	*number = (size_t) value;
 	return 0;
 }
 
-int get_domains(char *string, size_t *count, char **domains)
+int wait_for_start(void)
 {
-	int fd = open(string, O_RDONLY);
-	if (fd == -1)
-	{
-		log_errno("Can't open file.");
-		return -1;
-	}
+	char command[AGENT_COMMAND_SIZE];
+	unsigned long long start = 0;
 
-	struct stat stat;
-	int r = fstat(fd, &stat);
-	if (r == -1)
+	while (start == 0)
 	{
-		log_errno("Can't get file size.");
+		if (fgets(command, sizeof(command), stdin) == NULL)
+		{
+			log_error("Coordinator closed connection before start.");
+			return -1;
+		}
 
-		close(fd);
-		return -1;
+		if (strncmp(command, "time", 4) == 0)
+		{
+			unsigned long long realtime;
+			unsigned long long monotonic;
+			if (get_realtime(&realtime) != 0 || get_timestamp(&monotonic) != 0) return -1;
+
+			printf("%llu %llu\n", realtime, monotonic);
+			fflush(stdout);
+		}
+		else if (sscanf(command, "start %llu", &start) != 1 || start == 0)
+		{
+			log_error("Unexpected coordinator command: \"%s\".", command);
+			return -1;
+		}
 	}
 
-	if (stat.st_size > DOMAINS_FILE_LIMIT)
+	log_message("Waiting for start at %llu.", start);
+	while (1)
 	{
-		log_error("File too big (%lld > %lld)\n", stat.st_size, (long long) DOMAINS_FILE_LIMIT);
+		unsigned long long now;
+		if (get_realtime(&now) != 0) return -1;
+		if (now >= start) break;
 
-		close(fd);
-		return -1;
+		if (start - now > AGENT_SPIN_TIME)
+		{
+			unsigned long long sleep = start - now - AGENT_SPIN_TIME;
+			struct timespec interval = {sleep/NANOSECONDS, sleep % NANOSECONDS};
+			nanosleep(&interval, NULL);
+		}
 	}
 
-	char *buffer = malloc(stat.st_size);
-	if (buffer == NULL)
-	{
-		log_errno("Can't allocate %lld bytes for read buffer.", stat.st_size);
+	return 0;
+}
 
-		close(fd);
+int make_query_table(size_t count, size_t retries, struct query_table *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->count = count;
+	table->retries = retries;
+
+	size_t column_size = count*sizeof(unsigned long long);
+
+	table->sent = malloc(column_size);
+	table->intended = malloc(column_size);
+	table->received = malloc(column_size);
+	table->receives = calloc(count, sizeof(unsigned long long));
+	table->status = calloc(count, sizeof(unsigned char));
+	if (table->sent == NULL || table->intended == NULL || table->received == NULL ||
+	    table->receives == NULL || table->status == NULL)
+	{
+		log_errno("Can't allocate timestamp table of %lu bytes.",
+		          4*column_size + count*sizeof(unsigned char));
 		return -1;
 	}
 
-	ssize_t bytes_read = read(fd, buffer, stat.st_size);
-	if (bytes_read < 0)
+	if (retries > 0)
 	{
-		log_errno("Error on reading file.");
-
-		free(buffer);
-		close(fd);
-		return -1;
+		table->retried = malloc(column_size);
+		table->attempts = calloc(count, sizeof(unsigned char));
+		table->answered_by = calloc(count, sizeof(unsigned char));
+		if (table->retried == NULL || table->attempts == NULL || table->answered_by == NULL)
+		{
+			log_errno("Can't allocate retry table of %lu bytes.", column_size + 2*count*sizeof(unsigned char));
+			return -1;
+		}
 	}
 
-	close(fd);
+	return 0;
+}
 
-	if (bytes_read == 0)
-	{
-		log_error("File is empty\n");
+void free_query_table(struct query_table *table)
+{
+	free(table->targets);
+	free(table->answered_by);
+	free(table->attempts);
+	free(table->retried);
+	free(table->status);
+	free(table->receives);
+	free(table->received);
+	free(table->intended);
+	free(table->sent);
+}
 
-		free(buffer);
+int make_run_stats(unsigned long long interval, struct run_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->interval = interval;
+
+	stats->intervals = calloc(INTERVALS_INITIAL_CAPACITY, sizeof(struct interval_stats));
+	if (stats->intervals == NULL)
+	{
+		log_errno("Can't allocate %lu bytes for interval statistics.",
+		          INTERVALS_INITIAL_CAPACITY*sizeof(struct interval_stats));
 		return -1;
 	}
 
-	*count = 0;
-	*domains = malloc(3*(bytes_read/2 + bytes_read % 2) + 1);
-	if (*domains == NULL)
-	{
-		log_errno("Can't allocate %ld butes to store domains.", 3*(bytes_read/2 + bytes_read % 2) + 1);
+	stats->interval_capacity = INTERVALS_INITIAL_CAPACITY;
+	return 0;
+}
 
-		free(buffer);
+struct interval_stats *get_interval_stats(struct run_stats *stats, unsigned long long offset)
+{
+	size_t index = offset/stats->interval;
+	if (index >= stats->interval_capacity)
+	{
+		size_t capacity = stats->interval_capacity;
+		while (capacity <= index) capacity *= 2;
+
+		struct interval_stats *intervals = realloc(stats->intervals, capacity*sizeof(struct interval_stats));
+		if (intervals == NULL)
+		{
+			log_errno("Can't grow interval statistics to %lu bytes.", capacity*sizeof(struct interval_stats));
+			return NULL;
+		}
+
+		memset(intervals + stats->interval_capacity, 0,
+		       (capacity - stats->interval_capacity)*sizeof(struct interval_stats));
+
+		stats->intervals = intervals;
+		stats->interval_capacity = capacity;
+	}
+
+	if (index >= stats->interval_count) stats->interval_count = index + 1;
+
+	return &stats->intervals[index];
+}
+
+// Change of in-flight count at offset contributes the rest of the interval to
+// its integral, the level carried to next intervals is restored on output.
+void count_inflight(struct run_stats *stats, struct interval_stats *interval, unsigned long long offset,
+                    size_t inflight, int change)
+{
+	interval->inflight_area += (double) change*(stats->interval - offset % stats->interval);
+	if (change > 0)
+	{
+		if (inflight > interval->max_inflight) interval->max_inflight = inflight;
+		return;
+	}
+
+	if (interval->resolved == 0 || inflight < interval->min_inflight) interval->min_inflight = inflight;
+	interval->resolved++;
+}
+
+int count_busy(struct run_stats *stats, unsigned long long begin, unsigned long long end)
+{
+	struct interval_stats *interval = get_interval_stats(stats, begin);
+	if (interval == NULL) return -1;
+
+	if (end > begin) interval->busy += end - begin;
+	return 0;
+}
+
+int is_generator_limited(const struct interval_stats *interval, unsigned long long length)
+{
+	return (interval->sent > 0 && interval->lag/interval->sent > GENERATOR_LAG_LIMIT) ||
+	       (double) interval->busy/length > GENERATOR_BUSY_LIMIT || interval->drops > 0;
+}
+
+struct generator_stats
+{
+	size_t limited;
+	unsigned long long max_lag;
+	unsigned long long mean_lag;
+	double max_busy;
+	size_t drops;
+};
+
+void get_generator_stats(const struct run_stats *stats, struct generator_stats *generator)
+{
+	memset(generator, 0, sizeof(*generator));
+
+	size_t sent = 0;
+	double lag = 0;
+	size_t i;
+	for (i = 0; i < stats->interval_count; i++)
+	{
+		const struct interval_stats *interval = &stats->intervals[i];
+		double busy = (double) interval->busy/stats->interval;
+
+		if (is_generator_limited(interval, stats->interval)) generator->limited++;
+		if (interval->max_lag > generator->max_lag) generator->max_lag = interval->max_lag;
+		if (busy > generator->max_busy) generator->max_busy = busy;
+
+		sent += interval->sent;
+		lag += interval->lag;
+	}
+
+	generator->mean_lag = sent > 0? (unsigned long long) (lag/sent) : 0;
+	generator->drops = stats->drops;
+}
+
+void count_response(struct response_counters *counters, unsigned short flags, unsigned short answers)
+{
+	unsigned short rcode = flags & RCODE_MASK;
+
+	counters->rcodes[rcode]++;
+	if (flags & FLAG_TRUNCATED) counters->truncated++;
+	else if (rcode == 0)
+	{
+		if (answers == 0) counters->empty++;
+		else counters->good++;
+	}
+}
+
+void add_response_counters(struct response_counters *counters, const struct response_counters *other)
+{
+	size_t i;
+	for (i = 0; i < RCODE_COUNT; i++) counters->rcodes[i] += other->rcodes[i];
+
+	counters->truncated += other->truncated;
+	counters->empty += other->empty;
+	counters->good += other->good;
+}
+
+int merge_run_stats(struct run_stats *stats, const struct run_stats *other)
+{
+	add_response_counters(&stats->responses, &other->responses);
+	stats->malformed += other->malformed;
+	stats->unexpected += other->unexpected;
+	stats->duplicates += other->duplicates;
+	stats->late += other->late;
+	stats->lost += other->lost;
+	stats->retries += other->retries;
+
+	stats->drops += other->drops;
+
+	size_t i;
+	for (i = 0; i <= MAX_RETRIES; i++) stats->attempts[i] += other->attempts[i];
+
+	for (i = 0; i < other->interval_count; i++)
+	{
+		struct interval_stats *interval = get_interval_stats(stats, i*stats->interval);
+		if (interval == NULL) return -1;
+
+		interval->sent += other->intervals[i].sent;
+		interval->retries += other->intervals[i].retries;
+		interval->received += other->intervals[i].received;
+		interval->lost += other->intervals[i].lost;
+		add_response_counters(&interval->responses, &other->intervals[i].responses);
+
+		const struct interval_stats *part = &other->intervals[i];
+		if (part->max_inflight > interval->max_inflight) interval->max_inflight = part->max_inflight;
+		if (part->resolved > 0 && (interval->resolved == 0 || part->min_inflight < interval->min_inflight))
+		{
+			interval->min_inflight = part->min_inflight;
+		}
+
+		interval->resolved += part->resolved;
+		interval->inflight_area += part->inflight_area;
+
+		if (part->max_lag > interval->max_lag) interval->max_lag = part->max_lag;
+		interval->lag += part->lag;
+		if (part->busy > interval->busy) interval->busy = part->busy;
+		interval->drops += part->drops;
+	}
+
+	return 0;
+}
+
+struct socket_stats
+{
+	struct sockaddr_in address;
+
+	size_t sent;
+	size_t received;
+	size_t inflight;
+	size_t max_inflight;
+
+	// Kernel counter of datagrams dropped on the socket (SO_RXQ_OVFL).
+	unsigned int overflows;
+	size_t drops;
+
+	// Receive calls which returned data, less than replies with GRO.
+	size_t reads;
+};
+
+// Queries go to sockets in turn, batch consecutive queries per socket, so
+// socket of any query is known from its index without storing it.
+struct socket_pool
+{
+	size_t count;
+	size_t batch;
+	int *fds;
+	int max_fd;
+
+	struct socket_stats *stats;
+};
+
+// Makes kernel poll the device queue for up to the time (microseconds) on
+// receive instead of waiting for interrupt, 0 keeps it off.
+int set_busy_poll(int s, int busy_poll)
+{
+	if (busy_poll <= 0) return 0;
+
+#ifdef SO_BUSY_POLL
+	if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1)
+	{
+		log_errno("Can't set busy poll time %d us to UDP socket.", busy_poll);
+		return -1;
+	}
+
+	return 0;
+#else
+	log_error("Can't set busy poll time %d us: not supported on this platform.", busy_poll);
+	return -1;
+#endif
+}
+
+// Lets kernel coalesce replies of the same size from the same server into
+// one buffer, receiver splits it back by the segment size it reports.
+int set_gro(int s)
+{
+#ifdef UDP_GRO
+	int on = 1;
+	if (setsockopt(s, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+	{
+		log_errno("Can't enable GRO on UDP socket.");
+		return -1;
+	}
+
+	return 0;
+#else
+	log_error("Can't enable GRO: not supported on this platform.");
+	return -1;
+#endif
+}
+
+int open_socket_pool(size_t count, size_t batch, struct in_addr *addresses, size_t address_count, int busy_poll,
+                     int gro, struct socket_pool *pool)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->batch = batch;
+	pool->max_fd = -1;
+
+	pool->fds = malloc(count*sizeof(int));
+	pool->stats = calloc(count, sizeof(struct socket_stats));
+	if (pool->fds == NULL || pool->stats == NULL)
+	{
+		log_errno("Can't allocate pool of %lu sockets.", count);
+		return -1;
+	}
+
+	for (pool->count = 0; pool->count < count; pool->count++)
+	{
+		int s = socket(AF_INET, SOCK_DGRAM, 0);
+		if (s == -1)
+		{
+			log_errno("Can't open UDP socket.");
+			return -1;
+		}
+
+		pool->fds[pool->count] = s;
+
+		if (s >= FD_SETSIZE)
+		{
+			log_error("Socket descriptor %d exceeds select limit %d.", s, FD_SETSIZE);
+			close(s);
+			return -1;
+		}
+
+		errno = 0;
+		int sflags = fcntl(s, F_GETFL);
+		if (errno != 0)
+		{
+			log_errno("Can't get flags for UDP socket.");
+			close(s);
+			return -1;
+		}
+
+		if (fcntl(s, F_SETFL, sflags | O_NONBLOCK) == -1)
+		{
+			log_errno("Can't set O_NONBLOCK flag to UDP socket.");
+			close(s);
+			return -1;
+		}
+
+		if (set_busy_poll(s, busy_poll) != 0 || (gro && set_gro(s) != 0))
+		{
+			close(s);
+			return -1;
+		}
+
+		// Bind explicitly so every socket gets its own source port before the first send.
+		struct sockaddr_in *address = &pool->stats[pool->count].address;
+		address->sin_family = AF_INET;
+		address->sin_port = 0;
+		address->sin_addr.s_addr = htonl(INADDR_ANY);
+		if (address_count > 0) address->sin_addr = addresses[pool->count % address_count];
+
+		socklen_t length = sizeof(*address);
+		if (bind(s, (struct sockaddr *) address, sizeof(*address)) == -1 ||
+		    getsockname(s, (struct sockaddr *) address, &length) == -1)
+		{
+			char name[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &address->sin_addr, name, sizeof(name));
+
+			log_errno("Can't bind UDP socket to %s.", name);
+			close(s);
+			return -1;
+		}
+
+#ifdef SO_RXQ_OVFL
+		int on = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1)
+		{
+			log_errno("Can't enable drop counter on UDP socket.");
+			close(s);
+			return -1;
+		}
+#endif
+
+		if (s > pool->max_fd) pool->max_fd = s;
+	}
+
+	return 0;
+}
+
+void close_socket_pool(struct socket_pool *pool)
+{
+	size_t i;
+	for (i = 0; i < pool->count; i++) close(pool->fds[i]);
+
+	free(pool->fds);
+	free(pool->stats);
+
+	pool->fds = NULL;
+	pool->stats = NULL;
+	pool->count = 0;
+}
+
+size_t get_query_socket(struct socket_pool *pool, size_t index)
+{
+	return (index/pool->batch) % pool->count;
+}
+
+void set_pool_fds(struct socket_pool *pool, fd_set *fds)
+{
+	FD_ZERO(fds);
+
+	size_t i;
+	for (i = 0; i < pool->count; i++) FD_SET(pool->fds[i], fds);
+}
+
+// In-flight counters are incremented by sender before the query is sent and
+// decremented by both sender (lost or unsent queries) and receiver, so they
+// are atomic. Maximums are owned by sender and updated once the query is out.
+size_t add_inflight(size_t *inflight)
+{
+	return __atomic_add_fetch(inflight, 1, __ATOMIC_RELAXED);
+}
+
+void remove_inflight(size_t *inflight)
+{
+	__atomic_sub_fetch(inflight, 1, __ATOMIC_RELAXED);
+}
+
+void update_max_inflight(size_t *max_inflight, size_t inflight)
+{
+	if (inflight > *max_inflight) *max_inflight = inflight;
+}
+
+enum distribution
+{
+	DISTRIBUTION_ROUND_ROBIN,
+	DISTRIBUTION_WEIGHTED,
+	DISTRIBUTION_HASH,
+	// A/B comparison of two servers: every query is sent to both servers back
+	// to back in random order or servers take turns by time slices.
+	DISTRIBUTION_AB_QUERY,
+	DISTRIBUTION_AB_SLICE
+};
+
+struct target
+{
+	struct sockaddr_in address;
+	size_t weight;
+
+	size_t sent;
+	size_t received;
+	size_t inflight;
+	size_t max_inflight;
+	struct histogram latency;
+};
+
+// Weighted and hash distributions pick target by slot: every target owns
+// number of slots equal to its weight, interleaved smoothly.
+struct target_set
+{
+	size_t count;
+	enum distribution distribution;
+	struct target *targets;
+
+	size_t slot_count;
+	unsigned char *slots;
+
+	unsigned long long slice;
+};
+
+int make_target_slots(struct target_set *set)
+{
+	size_t i;
+	size_t total = 0;
+	for (i = 0; i < set->count; i++) total += set->targets[i].weight;
+
+	set->slots = malloc(total);
+	long long *current = calloc(set->count, sizeof(long long));
+	if (set->slots == NULL || current == NULL)
+	{
+		log_errno("Can't allocate %lu target slots.", total);
+		free(current);
 		return -1;
 	}
 
-	char *src_offset = buffer;
-	char *dst_offset = *domains;
+	size_t slot;
+	for (slot = 0; slot < total; slot++)
+	{
+		size_t best = 0;
+		for (i = 0; i < set->count; i++)
+		{
+			current[i] += set->targets[i].weight;
+			if (current[i] > current[best]) best = i;
+		}
+
+		current[best] -= total;
+		set->slots[slot] = (unsigned char) best;
+	}
+
+	set->slot_count = total;
+	free(current);
+	return 0;
+}
+
+unsigned long long get_name_hash(const unsigned char *name, const unsigned char *end)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	while (name < end && *name != 0)
+	{
+		size_t length = *name;
+		if (name + length >= end) break;
+
+		size_t i;
+		for (i = 0; i <= length; i++)
+		{
+			unsigned char c = name[i];
+			if (i > 0 && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+
+			hash = (hash ^ c)*0x100000001b3ULL;
+		}
+
+		name += length + 1;
+	}
+
+	return hash;
+}
+
+int assign_targets(struct target_set *set, void *queries, size_t count, unsigned char *targets)
+{
+	if ((set->distribution == DISTRIBUTION_WEIGHTED || set->distribution == DISTRIBUTION_HASH) &&
+	    make_target_slots(set) != 0) return -1;
+
+	char *offset = (char *) queries;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		size_t size;
+		unsigned char *query = (unsigned char *) get_next_query(&offset, &size);
+
+		switch (set->distribution)
+		{
+			case DISTRIBUTION_ROUND_ROBIN:
+				targets[i] = (unsigned char) (i % set->count);
+				break;
+
+			case DISTRIBUTION_WEIGHTED:
+				targets[i] = set->slots[i % set->slot_count];
+				break;
+
+			case DISTRIBUTION_HASH:
+				targets[i] = set->slots[get_name_hash(query + sizeof(struct dns_query), query + size) % set->slot_count];
+				break;
+
+			case DISTRIBUTION_AB_QUERY:
+				// Queries i and i + 1 (i even) are the same one, see make_query_pairs.
+				targets[i] = (unsigned char) ((i ^ mix_index(i/2)) & 1);
+				break;
+
+			case DISTRIBUTION_AB_SLICE:
+				// Chosen by send time.
+				targets[i] = 0;
+				break;
+		}
+	}
+
+	return 0;
+}
+
+int is_ab_distribution(enum distribution distribution)
+{
+	return distribution == DISTRIBUTION_AB_QUERY || distribution == DISTRIBUTION_AB_SLICE;
+}
+
+// Both queries of a pair get the same client and subnet variant.
+size_t get_variant_index(const struct target_set *set, size_t index)
+{
+	return (set->distribution == DISTRIBUTION_AB_QUERY)? index/2 : index;
+}
+
+void free_target_set(struct target_set *set)
+{
+	free(set->targets);
+	free(set->slots);
+
+	set->targets = NULL;
+	set->slots = NULL;
+	set->count = 0;
+}
+
+struct target *get_query_target(struct target_set *set, struct query_table *table, size_t index)
+{
+	return &set->targets[(table->targets != NULL)? table->targets[index] : 0];
+}
+
+struct domain_stats
+{
+	unsigned int queries;
+	unsigned int answered;
+	unsigned long long latency;
+	unsigned int sketch[DOMAIN_SKETCH_BUCKETS];
+};
+
+// Distinct query names. Query list repeats with period of domain list (or
+// capture), so only the first period is indexed and query of index i has
+// domain of index i % period.
+struct domain_set
+{
+	size_t period;
+	unsigned int *indexes;
+
+	size_t count;
+	unsigned long long *hashes;
+	const unsigned char **names;
+	const unsigned char **ends;
+	struct domain_stats *stats;
+};
+
+const unsigned char *get_name_end(const unsigned char *name, const unsigned char *end)
+{
+	while (name < end && *name != 0)
+	{
+		if (*name > end - name - 1) return end;
+
+		name += *name + 1;
+	}
+
+	return name < end? name + 1 : end;
+}
+
+int is_same_name(const unsigned char *name, const unsigned char *end,
+                 const unsigned char *other, const unsigned char *other_end)
+{
+	if (end - name != other_end - other) return 0;
+
+	for (; name < end; name++, other++)
+	{
+		unsigned char c = (*name >= 'A' && *name <= 'Z')? *name + 'a' - 'A' : *name;
+		unsigned char o = (*other >= 'A' && *other <= 'Z')? *other + 'a' - 'A' : *other;
+		if (c != o) return 0;
+	}
+
+	return 1;
+}
+
+int make_domain_set(void *queries, size_t count, size_t period, struct domain_set *set)
+{
+	memset(set, 0, sizeof(*set));
+	if (period > count) period = count;
+
+	size_t capacity = 1;
+	while (capacity < 2*period) capacity *= 2;
+
+	unsigned int *slots = calloc(capacity, sizeof(unsigned int));
+	set->period = period;
+	set->indexes = malloc(period*sizeof(unsigned int));
+	set->hashes = malloc(period*sizeof(unsigned long long));
+	set->names = malloc(period*sizeof(unsigned char *));
+	set->ends = malloc(period*sizeof(unsigned char *));
+	if (slots == NULL || set->indexes == NULL || set->hashes == NULL || set->names == NULL || set->ends == NULL)
+	{
+		log_errno("Can't allocate index of %lu domains.", period);
+		free(slots);
+		return -1;
+	}
+
+	char *offset = (char *) queries;
+	size_t i;
+	for (i = 0; i < period; i++)
+	{
+		size_t size;
+		unsigned char *query = (unsigned char *) get_next_query(&offset, &size);
+		const unsigned char *name = query + sizeof(struct dns_query);
+		const unsigned char *end = get_name_end(name, query + size);
+		unsigned long long hash = get_name_hash(name, end);
+
+		size_t slot = (size_t) hash & (capacity - 1);
+		while (slots[slot] != 0)
+		{
+			size_t domain = slots[slot] - 1;
+			if (set->hashes[domain] == hash && is_same_name(name, end, set->names[domain], set->ends[domain])) break;
+
+			slot = (slot + 1) & (capacity - 1);
+		}
+
+		if (slots[slot] == 0)
+		{
+			set->hashes[set->count] = hash;
+			set->names[set->count] = name;
+			set->ends[set->count] = end;
+			set->count++;
+			slots[slot] = (unsigned int) set->count;
+		}
+
+		set->indexes[i] = slots[slot] - 1;
+	}
+
+	free(slots);
+
+	set->stats = calloc(set->count, sizeof(struct domain_stats));
+	if (set->stats == NULL)
+	{
+		log_errno("Can't allocate statistics of %lu domains.", set->count);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) set->stats[set->indexes[i % period]].queries++;
+
+	return 0;
+}
+
+void free_domain_set(struct domain_set *set)
+{
+	free(set->indexes);
+	free(set->hashes);
+	free(set->names);
+	free(set->ends);
+	free(set->stats);
+
+	memset(set, 0, sizeof(*set));
+}
+
+size_t get_sketch_bucket(unsigned long long value)
+{
+	if (value < (1ULL << DOMAIN_SKETCH_MIN_BITS)) return 0;
+
+	int bits = 63 - __builtin_clzll(value);
+	size_t sub = (size_t) (value >> (bits - DOMAIN_SKETCH_SUB_BITS)) & ((1 << DOMAIN_SKETCH_SUB_BITS) - 1);
+	size_t bucket = 1 + ((size_t) (bits - DOMAIN_SKETCH_MIN_BITS) << DOMAIN_SKETCH_SUB_BITS) + sub;
+
+	return bucket < DOMAIN_SKETCH_BUCKETS? bucket : DOMAIN_SKETCH_BUCKETS - 1;
+}
+
+unsigned long long get_sketch_upper(size_t bucket)
+{
+	if (bucket == 0) return (1ULL << DOMAIN_SKETCH_MIN_BITS) - 1;
+
+	bucket--;
+	int bits = (int) (bucket >> DOMAIN_SKETCH_SUB_BITS) + DOMAIN_SKETCH_MIN_BITS;
+	unsigned long long sub = bucket & ((1 << DOMAIN_SKETCH_SUB_BITS) - 1);
+
+	return ((1ULL << bits) | ((sub + 1) << (bits - DOMAIN_SKETCH_SUB_BITS))) - 1;
+}
+
+void add_domain_latency(struct domain_set *set, size_t index, unsigned long long latency)
+{
+	struct domain_stats *stats = &set->stats[set->indexes[index % set->period]];
+
+	stats->answered++;
+	stats->latency += latency;
+	stats->sketch[get_sketch_bucket(latency)]++;
+}
+
+unsigned long long get_domain_percentile(const struct domain_stats *stats, double percentile)
+{
+	if (stats->answered == 0) return 0;
+
+	unsigned long long rank = (unsigned long long) (percentile*stats->answered/100.0 + 0.5);
+	if (rank < 1) rank = 1;
+
+	unsigned long long seen = 0;
+	size_t i;
+	for (i = 0; i < DOMAIN_SKETCH_BUCKETS; i++)
+	{
+		seen += stats->sketch[i];
+		if (seen >= rank) break;
+	}
+
+	return get_sketch_upper(i < DOMAIN_SKETCH_BUCKETS? i : DOMAIN_SKETCH_BUCKETS - 1);
+}
+
+struct domain_rank
+{
+	size_t index;
+	unsigned int lost;
+	unsigned long long mean;
+	unsigned long long p99;
+};
+
+struct domain_report
+{
+	size_t slowest_count;
+	struct domain_rank *slowest;
+	size_t lost_count;
+	struct domain_rank *lost;
+};
+
+int compare_slowest(const void *left, const void *right)
+{
+	const struct domain_rank *l = (const struct domain_rank *) left;
+	const struct domain_rank *r = (const struct domain_rank *) right;
+
+	if (l->p99 != r->p99) return l->p99 < r->p99? 1 : -1;
+	if (l->mean != r->mean) return l->mean < r->mean? 1 : -1;
+
+	return l->index < r->index? -1 : (l->index > r->index);
+}
+
+int compare_lost(const void *left, const void *right)
+{
+	const struct domain_rank *l = (const struct domain_rank *) left;
+	const struct domain_rank *r = (const struct domain_rank *) right;
+
+	if (l->lost != r->lost) return l->lost < r->lost? 1 : -1;
+
+	return l->index < r->index? -1 : (l->index > r->index);
+}
+
+// Picks top domains by p99 latency (of answered queries) and by number of
+// queries without answer. Every query is resolved by now, so lost ones are
+// the ones not answered.
+int get_domain_report(struct domain_set *set, size_t top, struct domain_report *report)
+{
+	memset(report, 0, sizeof(*report));
+
+	struct domain_rank *ranks = malloc(set->count*sizeof(struct domain_rank));
+	report->slowest = malloc(top*sizeof(struct domain_rank));
+	report->lost = malloc(top*sizeof(struct domain_rank));
+	if (ranks == NULL || report->slowest == NULL || report->lost == NULL)
+	{
+		log_errno("Can't allocate report of %lu domains.", set->count);
+		free(ranks);
+		return -1;
+	}
+
+	size_t i;
+	size_t count = 0;
+	for (i = 0; i < set->count; i++)
+	{
+		struct domain_stats *stats = &set->stats[i];
+		if (stats->answered == 0) continue;
+
+		ranks[count].index = i;
+		ranks[count].lost = stats->queries - stats->answered;
+		ranks[count].mean = stats->latency/stats->answered;
+		ranks[count].p99 = get_domain_percentile(stats, 99.0);
+		count++;
+	}
+
+	qsort(ranks, count, sizeof(struct domain_rank), compare_slowest);
+	report->slowest_count = count < top? count : top;
+	memcpy(report->slowest, ranks, report->slowest_count*sizeof(struct domain_rank));
+
+	count = 0;
+	for (i = 0; i < set->count; i++)
+	{
+		struct domain_stats *stats = &set->stats[i];
+		if (stats->answered >= stats->queries) continue;
+
+		ranks[count].index = i;
+		ranks[count].lost = stats->queries - stats->answered;
+		ranks[count].mean = stats->answered > 0? stats->latency/stats->answered : 0;
+		ranks[count].p99 = get_domain_percentile(stats, 99.0);
+		count++;
+	}
+
+	qsort(ranks, count, sizeof(struct domain_rank), compare_lost);
+	report->lost_count = count < top? count : top;
+	memcpy(report->lost, ranks, report->lost_count*sizeof(struct domain_rank));
+
+	free(ranks);
+	return 0;
+}
+
+void free_domain_report(struct domain_report *report)
+{
+	free(report->slowest);
+	free(report->lost);
+
+	memset(report, 0, sizeof(*report));
+}
+
+// Dotted name with characters which need escaping in JSON replaced by '?'.
+void get_domain_name(struct domain_set *set, size_t index, char *buffer, size_t size)
+{
+	const unsigned char *name = set->names[index];
+	const unsigned char *end = set->ends[index];
+
+	size_t length = 0;
+	while (name < end && *name != 0 && length + 2 < size)
+	{
+		size_t label = *name++;
+		for (; label > 0 && name < end && length + 2 < size; label--, name++)
+		{
+			buffer[length++] = (*name > ' ' && *name < 0x7f && *name != '"' && *name != '\\')? (char) *name : '?';
+		}
+
+		buffer[length++] = '.';
+	}
+
+	if (length == 0) buffer[length++] = '.';
+	buffer[length] = '\0';
+}
+
+// Least squares line of event count over time (count = intercept + rate*t)
+// updated online, the same fit analyser scripts get from the timestamps.
+// Welford style updates keep it stable over long runs.
+struct rate_fit
+{
+	size_t count;
+	unsigned long long first;
+	unsigned long long last;
+
+	double mean_time;
+	double mean_count;
+	double time_squares;
+	double products;
+};
+
+void add_rate_point(struct rate_fit *fit, unsigned long long timestamp)
+{
+	if (fit->count == 0) fit->first = timestamp;
+	fit->last = timestamp;
+	fit->count++;
+
+	double time = (double) (timestamp - fit->first)/NANOSECONDS;
+	double time_delta = time - fit->mean_time;
+	fit->mean_time += time_delta/fit->count;
+	fit->mean_count += (fit->count - fit->mean_count)/fit->count;
+	fit->time_squares += time_delta*(time - fit->mean_time);
+	fit->products += time_delta*(fit->count - fit->mean_count);
+}
+
+// Gets intercept and rate (per second) of the fit with time counted from origin.
+int get_rate_fit(const struct rate_fit *fit, unsigned long long origin, double *intercept, double *rate)
+{
+	if (fit->count < 2 || fit->time_squares <= 0) return -1;
+
+	*rate = fit->products/fit->time_squares;
+	*intercept = fit->mean_count - *rate*fit->mean_time;
+	*intercept -= *rate*((double) fit->first - (double) origin)/NANOSECONDS;
+
+	return 0;
+}
+
+struct sender
+{
+	struct socket_pool *pool;
+	struct target_set *targets;
+
+	char *offset;
+	int scheduled;
+	size_t sent;
+
+	unsigned long long timeout;
+	struct timer_wheel timers;
+	unsigned long long now;
+
+	size_t retries;
+	unsigned long long retry_timeout;
+	double backoff;
+	// Only with retries: query of each index to retransmit.
+	char **queries;
+	// Only with per query client id or ECS.
+	struct query_variation *variation;
+
+	struct rate_fit sends;
+	struct run_stats stats;
+	int verbose;
+};
+
+struct receiver
+{
+	struct socket_pool *pool;
+	struct target_set *targets;
+
+	void *buffer;
+	size_t size;
+	size_t received;
+
+	struct latency_histograms latencies;
+	struct rate_fit receives;
+	// Only with top domains report.
+	struct domain_set *domains;
+	struct run_stats stats;
+	int verbose;
+};
+
+struct mig_run
+{
+	struct socket_pool pool;
+	struct query_table table;
+	struct sender sender;
+	struct receiver receiver;
+
+	// Queries either answered in time or declared lost by the sender.
+	size_t resolved;
+	int failed;
+
+	// Poll sockets in a loop instead of sleeping in select.
+	int spin;
+};
+
+int get_send_delay(struct sender *sender, struct query_table *table, unsigned long long *delay)
+{
+	*delay = 0;
+	if (!sender->scheduled) return 0;
+
+	unsigned long long now;
+	if (get_timestamp(&now) != 0) return -1;
+
+	unsigned long long due = table->start + table->intended[sender->sent];
+	if (now < due) *delay = due - now;
+
+	return 0;
+}
+
+int send_message(struct sender *sender, int s, struct target *target, void *message, size_t size)
+{
+	struct sockaddr_in *server = &target->address;
+	ssize_t bytes_sent = sendto(s, message, size, 0,
+	                            (struct sockaddr *) server, sizeof(struct sockaddr_in));
+	if (bytes_sent == -1)
+	{
+		int errnum = errno;
+		if (errnum == EAGAIN) return 1;
+
+		char address[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &server->sin_addr, address, sizeof(address));
+
+		log_errno_ex(errnum, "Error on sending to %s:%hu.", address, htons(server->sin_port));
+		return -1;
+	}
+
+	if (bytes_sent != size)
+	{
+		log_error("Expected to send %lu bytes but actually sent %ld.", size, bytes_sent);
+		return -1;
+	}
+
+	if (sender->verbose) log_message("Sent %ld bytes.", bytes_sent);
+
+	return 0;
+}
+
+unsigned long long get_query_deadline(struct sender *sender, struct query_table *table, size_t index)
+{
+	unsigned long long deadline = table->sent[index] + sender->timeout;
+
+	size_t attempts = (table->attempts != NULL)? table->attempts[index] : 1;
+	if (attempts > sender->retries) return deadline;
+
+	double delay = sender->retry_timeout;
+	size_t i;
+	for (i = 1; i < attempts; i++) delay *= sender->backoff;
+
+	unsigned long long last = (attempts > 1)? table->retried[index] : table->sent[index];
+	unsigned long long retry = last + (unsigned long long) delay;
+
+	return (retry < deadline)? retry : deadline;
+}
+
+int sent_query(struct sender *sender, struct query_table *table)
+{
+	char *offset = sender->offset;
+	size_t size;
+	void *query = get_next_query(&offset, &size);
+
+	size_t index = sender->sent;
+	size_t variant = get_variant_index(sender->targets, index);
+	if (sender->variation != NULL) patch_query(sender->variation, query, &size, variant);
+
+	struct socket_pool *pool = sender->pool;
+	size_t socket_index = get_query_socket(pool, index);
+
+	if (sender->targets->distribution == DISTRIBUTION_AB_SLICE)
+	{
+		unsigned long long now;
+		if (get_timestamp(&now) != 0) return -1;
+
+		table->targets[index] = (unsigned char) (((now - table->start)/sender->targets->slice) & 1);
+	}
+
+	struct target *target = get_query_target(sender->targets, table, index);
+
+	// Query is published as sent before it goes out, otherwise a fast answer
+	// could reach receiver thread first and be taken for unexpected one. The
+	// timestamp is taken before sending too, so it never follows the answer.
+	unsigned long long sent;
+	if (get_timestamp(&sent) != 0) return -1;
+
+	sent -= table->start;
+
+	table->sent[index] = sent;
+	if (!sender->scheduled) table->intended[index] = sent;
+	if (table->attempts != NULL)
+	{
+		sender->queries[index] = sender->offset;
+		table->attempts[index] = 1;
+	}
+
+	struct socket_stats *socket_stats = &pool->stats[socket_index];
+	size_t socket_inflight = add_inflight(&socket_stats->inflight);
+	size_t target_inflight = add_inflight(&target->inflight);
+	size_t inflight = add_inflight(&table->inflight);
+	__atomic_store_n(&table->status[index], STATUS_SENT, __ATOMIC_RELEASE);
+
+	int r = send_message(sender, pool->fds[socket_index], target, query, size);
+	if (r < 0) return -1;
+
+	// Query which hasn't gone out is taken back to be sent again, unless a
+	// stray answer with the same id has already resolved it.
+	unsigned char status = STATUS_SENT;
+	if (r > 0 && __atomic_compare_exchange_n(&table->status[index], &status, 0, 0,
+	                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		remove_inflight(&socket_stats->inflight);
+		remove_inflight(&target->inflight);
+		remove_inflight(&table->inflight);
+		return 1;
+	}
+
+	socket_stats->sent++;
+	update_max_inflight(&socket_stats->max_inflight, socket_inflight);
+
+	target->sent++;
+	update_max_inflight(&target->max_inflight, target_inflight);
+
+	add_rate_point(&sender->sends, sent);
+	add_timer(&sender->timers, index, get_query_deadline(sender, table, index));
+
+	struct interval_stats *interval = get_interval_stats(&sender->stats, sent);
+	if (interval == NULL) return -1;
+
+	interval->sent++;
+	if (sent > table->intended[index])
+	{
+		unsigned long long lag = sent - table->intended[index];
+		interval->lag += lag;
+		if (lag > interval->max_lag) interval->max_lag = lag;
+	}
+
+	count_inflight(&sender->stats, interval, sent, inflight, 1);
+
+	sender->offset = offset;
+	sender->sent++;
+
+	return 0;
+}
+
+int resent_query(struct sender *sender, struct query_table *table, size_t index)
+{
+	char *offset = sender->queries[index];
+	size_t size;
+	void *query = get_next_query(&offset, &size);
+	size_t variant = get_variant_index(sender->targets, index);
+	if (sender->variation != NULL) patch_query(sender->variation, query, &size, variant);
+
+	// Attempt is recorded before it goes out like in sent_query, so a fast
+	// answer to it is attributed to it and not to the previous one.
+	unsigned long long sent;
+	if (get_timestamp(&sent) != 0) return -1;
+
+	sent -= table->start;
+
+	unsigned long long retried = table->retried[index];
+	unsigned char attempts = table->attempts[index];
+	table->retried[index] = sent;
+	__atomic_store_n(&table->attempts[index], attempts + 1, __ATOMIC_RELEASE);
+
+	struct socket_pool *pool = sender->pool;
+	int r = send_message(sender, pool->fds[get_query_socket(pool, index)],
+	                     get_query_target(sender->targets, table, index), query, size);
+	if (r < 0) return -1;
+	if (r > 0)
+	{
+		__atomic_store_n(&table->attempts[index], attempts, __ATOMIC_RELEASE);
+		table->retried[index] = retried;
+
+		add_timer(&sender->timers, index, sender->now + TIMER_TICK);
+		return 0;
+	}
+
+	add_timer(&sender->timers, index, get_query_deadline(sender, table, index));
+
+	struct interval_stats *interval = get_interval_stats(&sender->stats, sent);
+	if (interval == NULL) return -1;
+
+	sender->stats.retries++;
+	interval->retries++;
+
+	if (sender->verbose) log_message("Retransmitted query %lu (attempt %u).", index, table->attempts[index]);
+
+	return 0;
+}
+
+// Kernel attaches its cumulative drop counter of the socket to datagrams
+// once anything has been dropped, growth of the counter is counted at the
+// time of the datagram which reports it.
+int count_drops(struct receiver *receiver, struct socket_stats *socket, struct msghdr *message,
+                unsigned long long received)
+{
+#ifdef SO_RXQ_OVFL
+	struct cmsghdr *header;
+	for (header = CMSG_FIRSTHDR(message); header != NULL; header = CMSG_NXTHDR(message, header))
+	{
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SO_RXQ_OVFL) continue;
+
+		unsigned int overflows;
+		memcpy(&overflows, CMSG_DATA(header), sizeof(overflows));
+
+		unsigned int drops = overflows - socket->overflows;
+		socket->overflows = overflows;
+		if (drops == 0) continue;
+
+		struct interval_stats *interval = get_interval_stats(&receiver->stats, received);
+		if (interval == NULL) return -1;
+
+		socket->drops += drops;
+		receiver->stats.drops += drops;
+		interval->drops += drops;
+
+		if (receiver->verbose) log_message("Kernel dropped %u replies.", drops);
+	}
+#endif
+
+	return 0;
+}
+
+// With GRO several replies come in one buffer, kernel reports the size
+// of every segment but the last one, which may be shorter.
+size_t get_segment_size(struct msghdr *message)
+{
+#ifdef UDP_GRO
+	struct cmsghdr *header;
+	for (header = CMSG_FIRSTHDR(message); header != NULL; header = CMSG_NXTHDR(message, header))
+	{
+		if (header->cmsg_level != SOL_UDP || header->cmsg_type != UDP_GRO) continue;
+
+		int segment;
+		memcpy(&segment, CMSG_DATA(header), sizeof(segment));
+
+		if (segment > 0) return (size_t) segment;
+	}
+#endif
+
+	return 0;
+}
+
+int process_answer(struct receiver *receiver, struct query_table *table, size_t *resolved,
+                   void *data, size_t size, unsigned long long received)
+{
+	struct run_stats *stats = &receiver->stats;
+	struct latency_histograms *latencies = &receiver->latencies;
+	int verbose = receiver->verbose;
+
+	if (size < sizeof(struct dns_query))
+	{
+		if (verbose) log_error("Expected at least %lu bytes but got only %lu.", sizeof(struct dns_query), size);
+
+		stats->malformed++;
+		return 0;
+	}
+
+	size_t count = table->count;
+
+	struct dns_query *query = (struct dns_query *) data;
+	query->transaction_id = htons(query->transaction_id);
+	query->flags = htons(query->flags);
+	query->questions = htons(query->questions);
+	query->answers = htons(query->answers);
+	query->authorities = htons(query->authorities);
+	query->additional = htons(query->additional);
+
+	if (!(query->flags & FLAG_RESPONSE))
+	{
+		if (verbose) log_error("Received message with transaction id %hu which isn't a response.",
+		                       query->transaction_id);
+
+		stats->malformed++;
+		return 0;
+	}
+
+	if (count < USHRT_MAX && query->transaction_id >= count)
+	{
+		if (verbose) log_error("Recevied message with transaction id %hu while expected maximum is %lu.",
+		                       query->transaction_id, count);
+
+		stats->unexpected++;
+		return 0;
+	}
+
+	unsigned char answer = STATUS_ANSWERED | (query->flags & RCODE_MASK);
+	if (query->flags & FLAG_TRUNCATED) answer |= STATUS_TRUNCATED;
+
+	// Sender may declare the query lost concurrently, so answer is recorded
+	// with compare and swap and whoever comes first decides the outcome.
+	unsigned char status = 0;
+	size_t pair_index = query->transaction_id;
+	while (pair_index < count)
+	{
+		status = __atomic_load_n(&table->status[pair_index], __ATOMIC_ACQUIRE);
+		if ((status & (STATUS_SENT | STATUS_ANSWERED)) == STATUS_SENT &&
+		    table->sent[pair_index] <= received)
+		{
+			if (__atomic_compare_exchange_n(&table->status[pair_index], &status, status | answer, 0,
+			                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+
+			continue;
+		}
+
+		pair_index += USHRT_MAX;
+	}
+
+	if (pair_index < count && (status & STATUS_LOST))
+	{
+		if (verbose) log_error("Received answer for query with transaction id %hu after timeout.",
+		                       query->transaction_id);
+
+		stats->late++;
+	}
+	else if (pair_index < count)
+	{
+		// Answer can't tell which attempt it belongs to, so it is attributed
+		// to the last one sent before it has been received.
+		size_t attempt = 1;
+		if (table->attempts != NULL)
+		{
+			attempt = __atomic_load_n(&table->attempts[pair_index], __ATOMIC_ACQUIRE);
+			if (attempt > 1 && table->retried[pair_index] > received) attempt--;
+
+			table->answered_by[pair_index] = (unsigned char) attempt;
+		}
+
+		stats->attempts[attempt - 1]++;
+
+		struct socket_stats *socket_stats = &receiver->pool->stats[get_query_socket(receiver->pool, pair_index)];
+		socket_stats->received++;
+		remove_inflight(&socket_stats->inflight);
+
+		struct target *target = get_query_target(receiver->targets, table, pair_index);
+		target->received++;
+		remove_inflight(&target->inflight);
+		add_histogram_value(&target->latency, received - table->sent[pair_index]);
+
+		table->received[pair_index] = received;
+		table->receives[receiver->received] = received;
+		add_rate_point(&receiver->receives, received);
+
+		add_histogram_value(&latencies->actual, received - table->sent[pair_index]);
+		if (receiver->domains != NULL) add_domain_latency(receiver->domains, pair_index, received - table->sent[pair_index]);
+		add_histogram_value(&latencies->intended, received - table->intended[pair_index]);
+
+		count_response(&stats->responses, query->flags, query->answers);
+
+		struct interval_stats *interval = get_interval_stats(stats, received);
+		if (interval == NULL) return -1;
+
+		interval->received++;
+		count_response(&interval->responses, query->flags, query->answers);
+		count_inflight(stats, interval, received, __atomic_sub_fetch(&table->inflight, 1, __ATOMIC_RELAXED), -1);
+
+		if (verbose) log_message("Answer:\n"
+		                         "\tID.........: %hu\n"
+		                         "\tFlags......: 0x%hx\n"
+		                         "\tQueries....: %hu\n"
+		                         "\tAnswers....: %hu\n"
+		                         "\tAuthorities: %hu\n"
+		                         "\tAdditional.: %hu\n\n",
+		                         query->transaction_id,
+		                         query->flags,
+		                         query->questions,
+		                         query->answers,
+		                         query->authorities,
+		                         query->additional);
+
+		receiver->received++;
+		size_t remains = count - __atomic_add_fetch(resolved, 1, __ATOMIC_RELAXED);
+		if (verbose) log_message("Remains messages: %lu.", remains);
+	}
+	else
+	{
+		if (verbose) log_error("Received duplicate answer for query with transaction id %hu.",
+		                       query->transaction_id);
+
+		stats->duplicates++;
+	}
+
+	return 0;
+}
+
+int recv_answer(struct receiver *receiver, size_t socket, struct query_table *table, size_t *resolved)
+{
+	int s = receiver->pool->fds[socket];
+	char control[RECEIVE_CONTROL_SIZE];
+	struct iovec vector = {receiver->buffer, receiver->size};
+	struct msghdr message;
+
+	while (1)
+	{
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = &vector;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		ssize_t bytes_received = recvmsg(s, &message, 0);
+		if (bytes_received == -1)
+		{
+			int errnum = errno;
+			if (errnum == EAGAIN) break;
+
+			struct sockaddr_in local;
+			socklen_t length = sizeof(local);
+			getsockname(s, (struct sockaddr *) &local, &length);
+
+			char address[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &local.sin_addr, address, sizeof(address));
+
+			log_errno_ex(errnum, "Error on receiving at %s:%hu.", address, ntohs(local.sin_port));
+			return -1;
+		}
+
+		unsigned long long received;
+		if (get_timestamp(&received) != 0) return -1;
+
+		received -= table->start;
+
+		struct socket_stats *socket_stats = &receiver->pool->stats[socket];
+		socket_stats->reads++;
+		if (count_drops(receiver, socket_stats, &message, received) != 0) return -1;
+
+		if (receiver->verbose) log_message("Got %ld bytes.", bytes_received);
+
+		// Coalesced replies have been received together, so they share the timestamp.
+		size_t segment = get_segment_size(&message);
+		if (segment == 0) segment = bytes_received;
+
+		size_t offset = 0;
+		do
+		{
+			size_t size = (bytes_received - offset < segment)? bytes_received - offset : segment;
+			if (process_answer(receiver, table, resolved, (char *) receiver->buffer + offset, size, received) != 0) return -1;
+
+			offset += segment;
+		}
+		while (offset < bytes_received);
+	}
+
+	return 0;
+}
+
+int wait_for_socket(int s, int write, unsigned long long timeout)
+{
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(s, &fds);
+
+	struct timespec interval = {timeout/NANOSECONDS, timeout % NANOSECONDS};
+	int fd_count = pselect(s + 1, write? NULL : &fds, write? &fds : NULL, NULL, &interval, 0);
+	if (fd_count == -1)
+	{
+		if (errno == EINTR) return 0;
+
+		log_errno("Error on select.");
+		return -1;
+	}
+
+	return fd_count;
+}
+
+int recv_answers(struct receiver *receiver, fd_set *readfds, struct query_table *table, size_t *resolved)
+{
+	struct socket_pool *pool = receiver->pool;
+
+	size_t i;
+	for (i = 0; i < pool->count; i++)
+	{
+		if (FD_ISSET(pool->fds[i], readfds) && recv_answer(receiver, i, table, resolved) != 0) return -1;
+	}
+
+	return 0;
+}
+
+int expire_query(size_t index, void *context)
+{
+	struct mig_run *run = (struct mig_run *) context;
+	struct query_table *table = &run->table;
+
+	struct sender *sender = &run->sender;
+	if (table->attempts != NULL && table->attempts[index] <= sender->retries &&
+	    sender->now < table->sent[index] + sender->timeout)
+	{
+		if (__atomic_load_n(&table->status[index], __ATOMIC_ACQUIRE) & STATUS_ANSWERED) return 0;
+
+		return resent_query(sender, table, index);
+	}
+
+	unsigned char status = __atomic_load_n(&table->status[index], __ATOMIC_ACQUIRE);
+	do
+	{
+		if (status & STATUS_ANSWERED) return 0;
+	}
+	while (!__atomic_compare_exchange_n(&table->status[index], &status, status | STATUS_LOST, 0,
+	                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	struct run_stats *stats = &run->sender.stats;
+	struct interval_stats *interval = get_interval_stats(stats, table->sent[index]);
+	if (interval == NULL) return -1;
+
+	stats->lost++;
+	interval->lost++;
+
+	interval = get_interval_stats(stats, sender->now);
+	if (interval == NULL) return -1;
+
+	count_inflight(stats, interval, sender->now, __atomic_sub_fetch(&table->inflight, 1, __ATOMIC_RELAXED), -1);
+	remove_inflight(&run->pool.stats[get_query_socket(&run->pool, index)].inflight);
+	remove_inflight(&get_query_target(sender->targets, table, index)->inflight);
+	__atomic_add_fetch(&run->resolved, 1, __ATOMIC_RELAXED);
+
+	if (run->sender.verbose) log_message("Query %lu timed out.", index);
+
+	return 0;
+}
+
+int expire_queries(struct mig_run *run)
+{
+	unsigned long long now;
+	if (get_timestamp(&now) != 0) return -1;
+
+	run->sender.now = now - run->table.start;
+	return expire_timers(&run->sender.timers, run->sender.now, expire_query, run);
+}
+
+int is_resolved(struct mig_run *run)
+{
+	return __atomic_load_n(&run->resolved, __ATOMIC_RELAXED) >= run->table.count;
+}
+
+void *send_queries(void *argument)
+{
+	struct mig_run *run = (struct mig_run *) argument;
+	struct sender *sender = &run->sender;
+	struct query_table *table = &run->table;
+
+	while (sender->sent < table->count && !__atomic_load_n(&run->failed, __ATOMIC_RELAXED))
+	{
+		if (expire_queries(run) != 0) goto error;
+
+		unsigned long long delay;
+		if (get_send_delay(sender, table, &delay) != 0) goto error;
+
+		if (delay > 0)
+		{
+			if (delay > SEND_SPIN_TIME && !run->spin)
+			{
+				delay -= SEND_SPIN_TIME;
+
+				struct timespec interval = {delay/NANOSECONDS, delay % NANOSECONDS};
+				nanosleep(&interval, NULL);
+			}
+
+			continue;
+		}
+
+		int r = sent_query(sender, table);
+		if (r < 0) goto error;
+		if (r > 0)
+		{
+			int s = sender->pool->fds[get_query_socket(sender->pool, sender->sent)];
+			if (!run->spin && wait_for_socket(s, 1, TIMER_TICK) < 0) goto error;
+		}
+		else if (count_busy(&sender->stats, sender->now, table->sent[sender->sent - 1]) != 0) goto error;
+	}
+
+	while (!is_resolved(run) && !__atomic_load_n(&run->failed, __ATOMIC_RELAXED))
+	{
+		if (expire_queries(run) != 0) goto error;
+
+		struct timespec interval = {0, TIMER_TICK};
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+
+error:
+	__atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+void *receive_answers(void *argument)
+{
+	struct mig_run *run = (struct mig_run *) argument;
+	struct receiver *receiver = &run->receiver;
+
+	while (!is_resolved(run) && !__atomic_load_n(&run->failed, __ATOMIC_RELAXED))
+	{
+		fd_set readfds;
+		set_pool_fds(receiver->pool, &readfds);
+
+		int fd_count = 1;
+		if (!run->spin)
+		{
+			struct timespec timeout = {0, RECEIVE_POLL_TIME};
+			fd_count = pselect(receiver->pool->max_fd + 1, &readfds, NULL, NULL, &timeout, 0);
+			if (fd_count == -1)
+			{
+				if (errno == EINTR) continue;
+
+				log_errno("Error on select.");
+				goto error;
+			}
+		}
+
+		if (fd_count > 0)
+		{
+			unsigned long long begin;
+			unsigned long long end;
+			if (get_timestamp(&begin) != 0) goto error;
+			if (recv_answers(receiver, &readfds, &run->table, &run->resolved) != 0) goto error;
+			if (get_timestamp(&end) != 0) goto error;
+
+			if (count_busy(&receiver->stats, begin - run->table.start, end - run->table.start) != 0) goto error;
+		}
+	}
+
+	return NULL;
+
+error:
+	__atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+int run_loop(struct mig_run *run)
+{
+	struct sender *sender = &run->sender;
+	struct receiver *receiver = &run->receiver;
+	struct socket_pool *pool = &run->pool;
+
+	while (sender->sent < run->table.count || !is_resolved(run))
+	{
+		int sending = sender->sent < run->table.count;
+		int s = sending? pool->fds[get_query_socket(pool, sender->sent)] : -1;
+
+		fd_set readfds;
+		fd_set writefds;
+
+		set_pool_fds(pool, &readfds);
+
+		FD_ZERO(&writefds);
+		if (sending) FD_SET(s, &writefds);
+
+		int fd_count = 1;
+		if (!run->spin)
+		{
+			struct timespec timeout = {0, TIMER_TICK};
+			fd_count = pselect(pool->max_fd + 1, &readfds, &writefds, NULL, &timeout, 0);
+			if (fd_count == -1)
+			{
+				log_errno("Error on select. Exiting...");
+				return -1;
+			}
+		}
+
+		// Only iterations which have sent or received anything count as busy.
+		unsigned long long begin;
+		if (get_timestamp(&begin) != 0) return -1;
+
+		size_t done = sender->sent + sender->stats.retries + receiver->received;
+
+		if (fd_count > 0 && recv_answers(receiver, &readfds, &run->table, &run->resolved) != 0) return -1;
+
+		if (fd_count > 0 && sending && FD_ISSET(s, &writefds))
+		{
+			unsigned long long delay;
+			if (get_send_delay(sender, &run->table, &delay) != 0) return -1;
+
+			if (delay == 0 && sent_query(sender, &run->table) < 0) return -1;
+		}
+
+		if (expire_queries(run) != 0) return -1;
+
+		if (sender->sent + sender->stats.retries + receiver->received != done &&
+		    count_busy(&sender->stats, begin - run->table.start, sender->now) != 0) return -1;
+	}
+
+	return 0;
+}
+
+void *echo_datagrams(void *argument)
+{
+	int s = *(int *) argument;
+
+	char buffer[64];
+	while (1)
+	{
+		struct sockaddr_in address;
+		socklen_t length = sizeof(address);
+		ssize_t size = recvfrom(s, buffer, sizeof(buffer), 0, (struct sockaddr *) &address, &length);
+		if (size <= 0) break;
+
+		sendto(s, buffer, size, 0, (struct sockaddr *) &address, length);
+	}
+
+	return NULL;
+}
+
+int open_loopback_socket(int nonblocking, int busy_poll, struct sockaddr_in *address)
+{
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s == -1)
+	{
+		log_errno("Can't open UDP socket.");
+		return -1;
+	}
+
+	memset(address, 0, sizeof(*address));
+	address->sin_family = AF_INET;
+	address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	socklen_t length = sizeof(*address);
+	if (bind(s, (struct sockaddr *) address, sizeof(*address)) == -1 ||
+	    getsockname(s, (struct sockaddr *) address, &length) == -1)
+	{
+		log_errno("Can't bind UDP socket to loopback.");
+		close(s);
+		return -1;
+	}
+
+	if ((nonblocking && fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) == -1) || set_busy_poll(s, busy_poll) != 0)
+	{
+		log_errno("Can't set up loopback UDP socket.");
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+// Round trips to a trivial echo thread over loopback waiting for replies the
+// same way as the run does: nothing can be measured faster than this.
+int measure_floor(size_t count, int spin, int busy_poll, struct histogram *floor)
+{
+	struct sockaddr_in echo_address;
+	struct sockaddr_in client_address;
+	int echo = open_loopback_socket(0, 0, &echo_address);
+	if (echo == -1) return -1;
+
+	int client = open_loopback_socket(1, busy_poll, &client_address);
+	if (client == -1)
+	{
+		close(echo);
+		return -1;
+	}
+
+	pthread_t thread;
+	int r = pthread_create(&thread, NULL, echo_datagrams, &echo);
+	if (r != 0)
+	{
+		log_errno_ex(r, "Can't start echo thread.");
+		close(client);
+		close(echo);
+		return -1;
+	}
+
+	int result = -1;
+	size_t lost = 0;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		unsigned long long start;
+		unsigned long long now;
+		if (get_timestamp(&start) != 0) goto stop;
+
+		if (sendto(client, &i, sizeof(i), 0, (struct sockaddr *) &echo_address, sizeof(echo_address)) != sizeof(i))
+		{
+			log_errno("Can't send echo probe.");
+			goto stop;
+		}
+
+		while (1)
+		{
+			size_t probe;
+			ssize_t size = recv(client, &probe, sizeof(probe), 0);
+			if (get_timestamp(&now) != 0) goto stop;
+
+			if (size == sizeof(probe) && probe == i)
+			{
+				add_histogram_value(floor, now - start);
+				break;
+			}
+
+			if (size == -1 && errno != EAGAIN)
+			{
+				log_errno("Can't receive echo probe.");
+				goto stop;
+			}
+
+			if (now - start > FLOOR_TIMEOUT)
+			{
+				lost++;
+				break;
+			}
+
+			if (size == -1 && !spin && wait_for_socket(client, 0, start + FLOOR_TIMEOUT - now) < 0) goto stop;
+		}
+	}
+
+	if (lost > 0) log_error("Lost %lu of %lu echo probes.", lost, count);
+	result = 0;
+
+stop:
+	// Empty datagram stops the echo thread.
+	sendto(client, NULL, 0, 0, (struct sockaddr *) &echo_address, sizeof(echo_address));
+	pthread_join(thread, NULL);
+
+	close(client);
+	close(echo);
+
+	return result;
+}
+
+int pin_thread(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	int r = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (r != 0)
+	{
+		log_errno_ex(r, "Can't pin thread to CPU %d.", cpu);
+		return -1;
+	}
+
+	return 0;
+#else
+	log_error("Can't pin thread to CPU %d: not supported on this platform.", cpu);
+	return -1;
+#endif
+}
+
+int run_threads(struct mig_run *run, int sender_cpu, int receiver_cpu)
+{
+	pthread_t receiver;
+	int r = pthread_create(&receiver, NULL, receive_answers, run);
+	if (r != 0)
+	{
+		log_errno_ex(r, "Can't start receiver thread.");
+		return -1;
+	}
+
+	if (receiver_cpu >= 0 && pin_thread(receiver, receiver_cpu) != 0) __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+
+	pthread_t sender;
+	r = pthread_create(&sender, NULL, send_queries, run);
+	if (r != 0)
+	{
+		log_errno_ex(r, "Can't start sender thread.");
+
+		__atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+		pthread_join(receiver, NULL);
+		return -1;
+	}
+
+	if (sender_cpu >= 0 && pin_thread(sender, sender_cpu) != 0) __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+
+	pthread_join(sender, NULL);
+	pthread_join(receiver, NULL);
+
+	return __atomic_load_n(&run->failed, __ATOMIC_RELAXED)? -1 : 0;
+}
+
+void usage(void)
+{
+	printf("mig - DNS performance measurement tool\n\n"
+	       "Usage: mig <options>\n\n"
+	       "Options:\n"
+	       "\t-s, --server        - name server <IPv4 address>[:<port>][@<weight>] (required), can be repeated;\n"
+	       "\t-p, --port          - name server port for servers without explicit one (default 53);\n"
+	       "\t    --distribute    - how to split queries between servers: round-robin (default), weighted or hash (of name, weighted);\n"
+	       "\t    --ab            - compare two servers by interleaving queries to them: query (every query to both) or slice (time slices);\n"
+	       "\t    --slice         - length of A/B time slice in milliseconds (default 100);\n"
+	       "\t-c, --client        - client id (16 bytes hex string);\n"
+	       "\t-n, --queries       - number of queries (default length of domain set);\n"
+	       "\t-l, --limit         - limit query rate to the number (default - no limit);\n"
+	       "\t-d, --domains       - file with list of domains to query (ASCII lowercase separated by new line);\n"
+	       "\t-r, --replay        - replay queries of the pcap file (UDP to port 53) instead of domains, can't be combined with\n"
+	       "\t                      domains, client id, ECS or rate limit;\n"
+	       "\t-x, --speed         - speed-up factor of replay timing (default 1, any non-negative number, 0 - as fast as possible);\n"
+	       "\t    --top           - report the number of slowest and most lost domains (default 0 - no per domain statistics, maximum 1000);\n"
+	       "\t-v, --verbose       - print more details;\n"
+	       "\t-o, --output        - write statistics to specified file (default stdout);\n"
+	       "\t-A, --agent         - run as agent of coordinator (read start command from stdin, log to stderr);\n"
+	       "\t-i, --interval      - length of statistics interval in milliseconds (default 1000);\n"
+	       "\t-t, --timeout       - time in milliseconds after which query without answer is lost (default 5000);\n"
+	       "\t-R, --retries       - retransmit query without answer up to the number of times (default 0, maximum 15);\n"
+	       "\t    --retry-timeout - time in milliseconds before the first retransmission (default 1000);\n"
+	       "\t    --backoff       - factor to multiply retransmission timeout by after every retry (default 2);\n"
+	       "\t-E, --ecs           - EDNS Client Subnet prefix <network>/<bits> or pool of prefixes <network>/<bits>/<source bits>, can be repeated;\n"
+	       "\t    --subscribers   - rotate client id over the number of emulated subscribers (based on -c value);\n"
+	       "\t    --vary          - order of ECS prefixes and subscribers: sequential (default) or random;\n"
+	       "\t-S, --sockets       - number of sockets (source ports) to spread queries over (default 1, maximum 512);\n"
+	       "\t    --batch         - number of consecutive queries sent from one socket before switching to the next (default 1);\n"
+	       "\t-b, --bind          - local IPv4 address to bind sockets to, can be repeated to use several addresses in turn;\n"
+	       "\t-T, --threads       - send and receive from separate threads;\n"
+	       "\t    --sender-cpu    - pin sender thread to the CPU (implies --threads);\n"
+	       "\t    --receiver-cpu  - pin receiver thread to the CPU (implies --threads);\n"
+	       "\t    --cpu           - pin the loop to the CPU (without --threads);\n"
+	       "\t    --busy-poll     - poll sockets in a loop instead of sleeping, with SO_BUSY_POLL of the number of microseconds if it is not 0;\n"
+	       "\t    --floor         - measure latency floor by the number of round trips to loopback echo before the run;\n"
+	       "\t    --gro           - receive replies coalesced by the kernel (UDP_GRO) and split them back;\n"
+	       "\t    --tsc           - take timestamps from invariant TSC calibrated against the monotonic clock (x86-64);\n"
+	       "\t    --steady        - detect steady state by the number of consecutive settled intervals (at least 2) and summarize it only;\n"
+               "\t-h, --help          - this message.\n");
+}
+
+struct mdig_options
+{
+	struct target_set targets;
+	unsigned short port;
+
+	int got_client;
+	char client[CLIENT_ID_LENGTH];
+
+	int got_query_number;
+	size_t query_number;
+	size_t query_limit;
+
+	size_t domain_count;
+	char *domains;
+
+	int got_replay;
+	struct pcap_queries replay;
+	double speed;
+
+	FILE *output;
+	unsigned long long interval;
+	unsigned long long timeout;
+
+	size_t retries;
+	unsigned long long retry_timeout;
+	double backoff;
+
+	struct query_variation variation;
+
+	size_t sockets;
+	size_t batch;
+	size_t bind_count;
+	struct in_addr bind_addresses[MAX_BIND_ADDRESSES];
+
+	int threads;
+	int sender_cpu;
+	int receiver_cpu;
+	int cpu;
+
+	int spin;
+	int busy_poll;
+	int gro;
+	int tsc;
+	size_t floor;
+
+	size_t steady;
+
+	size_t top;
+
+	int agent;
+	int verbose;
+};
+
+#define OPTION_SENDER_CPU 256
+#define OPTION_RECEIVER_CPU 257
+#define OPTION_RETRY_TIMEOUT 258
+#define OPTION_BACKOFF 259
+#define OPTION_BATCH 260
+#define OPTION_SUBSCRIBERS 261
+#define OPTION_VARY 262
+#define OPTION_DISTRIBUTE 263
+#define OPTION_AB 264
+#define OPTION_SLICE 265
+#define OPTION_TOP 266
+#define OPTION_CPU 267
+#define OPTION_BUSY_POLL 268
+#define OPTION_FLOOR 269
+#define OPTION_GRO 270
+#define OPTION_TSC 271
+#define OPTION_STEADY 272
+
+static struct option long_options[] = {
+	{"help",    no_argument,       NULL, 'h'},
+	{"server",  required_argument, NULL, 's'},
+	{"port",    required_argument, NULL, 'p'},
+	{"client",  required_argument, NULL, 'c'},
+	{"queries", required_argument, NULL, 'n'},
+	{"limit",   required_argument, NULL, 'l'},
+	{"domains", required_argument, NULL, 'd'},
+	{"replay",  required_argument, NULL, 'r'},
+	{"speed",   required_argument, NULL, 'x'},
+	{"verbose", no_argument,       NULL, 'v'},
+	{"output",  required_argument, NULL, 'o'},
+	{"interval", required_argument, NULL, 'i'},
+	{"timeout", required_argument, NULL, 't'},
+	{"retries", required_argument, NULL, 'R'},
+	{"retry-timeout", required_argument, NULL, OPTION_RETRY_TIMEOUT},
+	{"backoff", required_argument, NULL, OPTION_BACKOFF},
+	{"ecs", required_argument, NULL, 'E'},
+	{"subscribers", required_argument, NULL, OPTION_SUBSCRIBERS},
+	{"vary", required_argument, NULL, OPTION_VARY},
+	{"distribute", required_argument, NULL, OPTION_DISTRIBUTE},
+	{"ab", required_argument, NULL, OPTION_AB},
+	{"slice", required_argument, NULL, OPTION_SLICE},
+	{"sockets", required_argument, NULL, 'S'},
+	{"batch", required_argument, NULL, OPTION_BATCH},
+	{"bind", required_argument, NULL, 'b'},
+	{"agent",   no_argument,       NULL, 'A'},
+	{"threads", no_argument,       NULL, 'T'},
+	{"sender-cpu", required_argument, NULL, OPTION_SENDER_CPU},
+	{"receiver-cpu", required_argument, NULL, OPTION_RECEIVER_CPU},
+	{"top", required_argument, NULL, OPTION_TOP},
+	{"cpu", required_argument, NULL, OPTION_CPU},
+	{"busy-poll", required_argument, NULL, OPTION_BUSY_POLL},
+	{"floor", required_argument, NULL, OPTION_FLOOR},
+	{"gro", no_argument, NULL, OPTION_GRO},
+	{"tsc", no_argument, NULL, OPTION_TSC},
+	{"steady", required_argument, NULL, OPTION_STEADY},
+	{NULL,      0,                 NULL, 0}
+};
+
+enum get_options_result
+{
+	GOR_OK,
+	GOR_HELP,
+	GOR_ERROR
+};
+
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+
+int get_port_value(char *string, unsigned short *port)
+{
+	char *endptr = NULL;
+
+	errno = 0;
+	unsigned long value = strtoul(string, &endptr, 10);
+
+	if (*endptr != '\0' || errno != 0 || value > USHRT_MAX) return -1;
+
+	*port = (unsigned short) value;
+
+	return 0;
+}
+
+int get_client_value(char *string, char *client)
+{
+	if (strlen(string) != 2*CLIENT_ID_LENGTH) return -1;
+
+	char byte[] = "00";
+	char *endptr = NULL;
+	int i;
+	for (i = 0; i < CLIENT_ID_LENGTH; i++)
+	{
+		byte[0] = string[2*i];
+		byte[1] = string[2*i + 1];
+
+		errno = 0;
+		unsigned long value = strtoul(byte, &endptr, 16);
+		if (*endptr != '\0' || errno != 0 || value > UCHAR_MAX)	return -1;
+
+		client[i] = (char) value;
+	}
+
+	return 0;
+}
+
+int get_query_number_value(char *string, size_t *number)
+{
+	char *endptr = NULL;
+
+	errno = 0;
+	unsigned long long value = strtoull(string, &endptr, 10);
+
+	if (*endptr != '\0' || errno != 0) return -1;
+
+	*number = (size_t) value;
+	return 0;
+}
+
+int add_target(struct target_set *set, char *string)
+{
+	if (set->count >= MAX_TARGETS) return -1;
+
+	char buffer[INET_ADDRSTRLEN + 32];
+	if (strlen(string) >= sizeof(buffer)) return -1;
+
+	strcpy(buffer, string);
+
+	size_t weight = 1;
+	char *at = strchr(buffer, '@');
+	if (at != NULL)
+	{
+		*at = '\0';
+		if (get_query_number_value(at + 1, &weight) != 0 || weight == 0 || weight > MAX_TARGET_WEIGHT) return -1;
+	}
+
+	unsigned short port = 0;
+	char *colon = strchr(buffer, ':');
+	if (colon != NULL)
+	{
+		*colon = '\0';
+		if (get_port_value(colon + 1, &port) != 0 || port == 0) return -1;
+	}
+
+	struct in_addr address;
+	if (inet_aton(buffer, &address) <= 0) return -1;
+
+	struct target *targets = realloc(set->targets, (set->count + 1)*sizeof(struct target));
+	if (targets == NULL) return -1;
+
+	set->targets = targets;
+
+	struct target *target = &set->targets[set->count];
+	memset(target, 0, sizeof(*target));
+	target->address.sin_family = AF_INET;
+	target->address.sin_addr = address;
+	target->address.sin_port = htons(port);
+	target->weight = weight;
+	reset_histogram(&target->latency);
+
+	set->count++;
+	return 0;
+}
+
+int get_domains(char *string, size_t *count, char **domains)
+{
+	int fd = open(string, O_RDONLY);
+	if (fd == -1)
+	{
+		log_errno("Can't open file.");
+		return -1;
+	}
+
+	struct stat stat;
+	int r = fstat(fd, &stat);
+	if (r == -1)
+	{
+		log_errno("Can't get file size.");
+
+		close(fd);
+		return -1;
+	}
+
+	if (stat.st_size > DOMAINS_FILE_LIMIT)
+	{
+		log_error("File too big (%lld > %lld)\n", stat.st_size, (long long) DOMAINS_FILE_LIMIT);
+
+		close(fd);
+		return -1;
+	}
+
+	char *buffer = malloc(stat.st_size);
+	if (buffer == NULL)
+	{
+		log_errno("Can't allocate %lld bytes for read buffer.", stat.st_size);
+
+		close(fd);
+		return -1;
+	}
+
+	ssize_t bytes_read = read(fd, buffer, stat.st_size);
+	if (bytes_read < 0)
+	{
+		log_errno("Error on reading file.");
+
+		free(buffer);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	if (bytes_read == 0)
+	{
+		log_error("File is empty\n");
+
+		free(buffer);
+		return -1;
+	}
+
+	*count = 0;
+	*domains = malloc(3*(bytes_read/2 + bytes_read % 2) + 1);
+	if (*domains == NULL)
+	{
+		log_errno("Can't allocate %ld butes to store domains.", 3*(bytes_read/2 + bytes_read % 2) + 1);
+
+		free(buffer);
+		return -1;
+	}
+
+	char *src_offset = buffer;
+	char *dst_offset = *domains;
+
+	int zone_count = 0;
+	size_t length = 0;
+	size_t line = 1;
+
+	size_t i;
+	for (i = 0; i < bytes_read; i++)
+	{
+		char *current = buffer + i;
+
+		switch (*current)
+		{
+			case '.':
+				length++;
+
+				if (zone_count == 0)
+				{
+					log_error("Invalid domain name at line %lu.", line);
+
+					free(buffer);
+					free(*domains);
+					return -1;
+				}
+
+				*dst_offset = (char) zone_count;
+				dst_offset++;
+
+				memcpy(dst_offset, src_offset, zone_count);
+				dst_offset += zone_count;
+
+				zone_count = 0;
+				src_offset = current + 1;
+				break;
+
+			case '\n':
+				if (length == 0)
+				{
+					line++;
+					break;
+				}
+
+				if (zone_count == 0)
+				{
+					log_error("Invalid domain name at line %lu.", line);
+
+					free(buffer);
+					free(*domains);
+					return -1;
+				}
+
+				*dst_offset = (char) zone_count;
+				dst_offset++;
+
+				memcpy(dst_offset, src_offset, zone_count);
+				dst_offset += zone_count;
+
+				*dst_offset = '\0';
+				dst_offset++;
+
+				(*count)++;
+
+				zone_count = 0;
+				src_offset = current + 1;
+
+				length = 0;
+				line++;
+				break;
+
+			default:
+				zone_count++;
+				if (zone_count > UCHAR_MAX)
+				{
+					log_error("Invalid domain name at line %lu.", line);
+
+					free(buffer);
+					free(*domains);
+					return -1;
+				}
+				length++;
+		}
+	}
+
+	if (length > 0)
+	{
+		if (zone_count == 0)
+		{
+			log_error("Invalid domain name at line %lu.", line);
+
+			free(buffer);
+			free(*domains);
+			return -1;
+		}
+
+		*dst_offset = (char) zone_count;
+		dst_offset++;
+
+		memcpy(dst_offset, src_offset, zone_count);
+		dst_offset += zone_count;
+
+		*dst_offset = '\0';
+		 dst_offset++;
+
+		(*count)++;
+	}
+
+	*dst_offset = '\0';
+
+	free(buffer);
+	return 0;
+}
+
+void print_domains(size_t count, char *domains)
+{
+	printf("Domains (%lu):", count);
+
+	size_t index = 0;
+	char *offset = domains;
+	char zone[256];
+	while (*offset != '\0')
+	{
+		printf("\n\t%lu:", ++index);
+		while (*offset != '\0')
+		{
+			size_t zone_count = (size_t) *(unsigned char *) offset;
+			offset++;
+
+			printf(" \\0%lo", zone_count);
+
+			memcpy(zone, offset, zone_count);
+			zone[zone_count] = '\0';
+			printf(" \"%s\"", zone);
+
+			offset += zone_count;
+		}
+
+		offset++;
+	}
+
+	printf("\n\n");
+}
+
+int open_output(char *string, FILE **output)
+{
+	*output = fopen(string, "w");
+	if (*output == NULL)
+	{
+		log_errno("");
+		return -1;
+	}
+
+	return 0;
+}
+
+enum get_options_result get_options(int argc, char *argv[], struct mdig_options *mdig_options)
+{
+	opterr = 0;
+	int option_char;
+
+	memset(&mdig_options->targets, 0, sizeof(mdig_options->targets));
+	mdig_options->targets.slice = (unsigned long long) DEFAULT_SLICE*(NANOSECONDS/1000);
+	mdig_options->port = 53;
+
+	mdig_options->got_client = 0;
+	mdig_options->got_query_number = 0;
+	mdig_options->query_limit = 0;
+	mdig_options->domain_count = 0;
+	mdig_options->domains = NULL;
+	mdig_options->got_replay = 0;
+	mdig_options->speed = 1.0;
+	mdig_options->output = stdout;
+	mdig_options->interval = DEFAULT_INTERVAL*(NANOSECONDS/1000);
+	mdig_options->timeout = (unsigned long long) DEFAULT_TIMEOUT*(NANOSECONDS/1000);
+	mdig_options->retries = 0;
+	mdig_options->retry_timeout = (unsigned long long) DEFAULT_RETRY_TIMEOUT*(NANOSECONDS/1000);
+	mdig_options->backoff = DEFAULT_BACKOFF;
+	memset(&mdig_options->variation, 0, sizeof(mdig_options->variation));
+	mdig_options->sockets = 1;
+	mdig_options->batch = 1;
+	mdig_options->bind_count = 0;
+	mdig_options->threads = 0;
+	mdig_options->sender_cpu = -1;
+	mdig_options->receiver_cpu = -1;
+	mdig_options->cpu = -1;
+	mdig_options->spin = 0;
+	mdig_options->busy_poll = 0;
+	mdig_options->gro = 0;
+	mdig_options->tsc = 0;
+	mdig_options->steady = 0;
+	mdig_options->floor = 0;
+	mdig_options->top = 0;
+	mdig_options->agent = 0;
+	mdig_options->verbose = 0;
+	while ((option_char = getopt_long(argc, argv, "hs:p:c:n:l:d:r:x:vo:i:t:R:E:S:b:AT", long_options, NULL)) != -1)
+	{
+		switch (option_char)
+		{
+			case 'h':
+				free(mdig_options->domains);
+				free_target_set(&mdig_options->targets);
+				free_query_variation(&mdig_options->variation);
+				return GOR_HELP;
+
+			case 's':
+				if (add_target(&mdig_options->targets, optarg) != 0)
+				{
+					printf("Invalid name server address or too many servers: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case 'p':
+				if (get_port_value(optarg, &mdig_options->port) != 0)
+				{
+					printf("Invalid port value: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_DISTRIBUTE:
+				if (strcmp(optarg, "round-robin") == 0) mdig_options->targets.distribution = DISTRIBUTION_ROUND_ROBIN;
+				else if (strcmp(optarg, "weighted") == 0) mdig_options->targets.distribution = DISTRIBUTION_WEIGHTED;
+				else if (strcmp(optarg, "hash") == 0) mdig_options->targets.distribution = DISTRIBUTION_HASH;
+				else
+				{
+					printf("Invalid distribution: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_AB:
+				if (strcmp(optarg, "query") == 0) mdig_options->targets.distribution = DISTRIBUTION_AB_QUERY;
+				else if (strcmp(optarg, "slice") == 0) mdig_options->targets.distribution = DISTRIBUTION_AB_SLICE;
+				else
+				{
+					printf("Invalid A/B mode: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_TOP:
+				if (get_query_number_value(optarg, &mdig_options->top) != 0 || mdig_options->top > MAX_TOP)
+				{
+					printf("Invalid number of top domains: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_SLICE:
+			{
+				size_t slice;
+				if (get_query_number_value(optarg, &slice) != 0 || slice == 0)
+				{
+					printf("Invalid A/B slice length: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->targets.slice = (unsigned long long) slice*(NANOSECONDS/1000);
+				break;
+			}
+
+			case 'c':
+				if (get_client_value(optarg, mdig_options->client) != 0)
+				{
+					printf("Invalid client id: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->got_client = 1;
+				break;
+
+			case 'n':
+				if (get_query_number_value(optarg, &mdig_options->query_number) != 0)
+				{
+					printf("Invalid query number: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->got_query_number = 1;
+				break;
+
+			case 'l':
+				if (get_query_number_value(optarg, &mdig_options->query_limit) != 0)
+				{
+					printf("Invalid query limit: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case 'd':
+				if (get_domains(optarg, &mdig_options->domain_count, &mdig_options->domains) != 0)
+				{
+					printf("Failed to read domains from: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				break;
+
+			case 'r':
+				if (mdig_options->got_replay) free_pcap_queries(&mdig_options->replay);
+				if (read_pcap_queries(optarg, &mdig_options->replay) != 0)
+				{
+					printf("Failed to read queries from: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->got_replay = 1;
+				break;
+
+			case 'x':
+			{
+				char *endptr = NULL;
+
+				errno = 0;
+				mdig_options->speed = strtod(optarg, &endptr);
+				if (*endptr != '\0' || errno != 0 || mdig_options->speed < 0)
+				{
+					printf("Invalid replay speed: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+			}
+
+			case 'o':
+				if (open_output(optarg, &mdig_options->output) != 0)
+				{
+					printf("Can't open file: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case 'i':
+			{
+				size_t interval;
+				if (get_query_number_value(optarg, &interval) != 0 || interval == 0)
+				{
+					printf("Invalid interval: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->interval = interval*(NANOSECONDS/1000);
+				break;
+			}
+
+			case 't':
+			{
+				size_t timeout;
+				if (get_query_number_value(optarg, &timeout) != 0 || timeout == 0)
+				{
+					printf("Invalid timeout: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->timeout = timeout*(NANOSECONDS/1000);
+				break;
+			}
+
+			case 'R':
+				if (get_query_number_value(optarg, &mdig_options->retries) != 0 ||
+				    mdig_options->retries > MAX_RETRIES)
+				{
+					printf("Invalid number of retries: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_RETRY_TIMEOUT:
+			{
+				size_t timeout;
+				if (get_query_number_value(optarg, &timeout) != 0 || timeout == 0)
+				{
+					printf("Invalid retry timeout: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->retry_timeout = timeout*(NANOSECONDS/1000);
+				break;
+			}
+
+			case OPTION_BACKOFF:
+			{
+				char *endptr = NULL;
+
+				errno = 0;
+				mdig_options->backoff = strtod(optarg, &endptr);
+				if (*endptr != '\0' || errno != 0 || mdig_options->backoff < 1)
+				{
+					printf("Invalid backoff factor: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+			}
+
+			case 'E':
+				if (add_ecs_prefixes(&mdig_options->variation, optarg) != 0)
+				{
+					printf("Invalid ECS prefix or pool is too big: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_SUBSCRIBERS:
+				if (get_query_number_value(optarg, &mdig_options->variation.subscribers) != 0 ||
+				    mdig_options->variation.subscribers == 0)
+				{
+					printf("Invalid number of subscribers: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_VARY:
+				if (strcmp(optarg, "random") == 0) mdig_options->variation.random = 1;
+				else if (strcmp(optarg, "sequential") == 0) mdig_options->variation.random = 0;
+				else
+				{
+					printf("Invalid variation order: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case 'S':
+				if (get_query_number_value(optarg, &mdig_options->sockets) != 0 ||
+				    mdig_options->sockets == 0 || mdig_options->sockets > MAX_SOCKETS)
+				{
+					printf("Invalid number of sockets: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_BATCH:
+				if (get_query_number_value(optarg, &mdig_options->batch) != 0 || mdig_options->batch == 0)
+				{
+					printf("Invalid batch size: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case 'b':
+				if (mdig_options->bind_count >= MAX_BIND_ADDRESSES ||
+				    inet_aton(optarg, &mdig_options->bind_addresses[mdig_options->bind_count]) <= 0)
+				{
+					printf("Invalid or too many local addresses: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->bind_count++;
+				break;
+
+			case 'A':
+				mdig_options->agent = 1;
+				set_message_stream(stderr);
+				break;
+
+			case 'T':
+				mdig_options->threads = 1;
+				break;
+
+			case OPTION_SENDER_CPU:
+			case OPTION_RECEIVER_CPU:
+			case OPTION_CPU:
+			{
+				size_t cpu;
+				if (get_query_number_value(optarg, &cpu) != 0 || cpu >= CPU_SETSIZE)
+				{
+					printf("Invalid CPU number: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				if (option_char == OPTION_CPU)
+				{
+					mdig_options->cpu = (int) cpu;
+					break;
+				}
+
+				if (option_char == OPTION_SENDER_CPU) mdig_options->sender_cpu = (int) cpu;
+				else mdig_options->receiver_cpu = (int) cpu;
+
+				mdig_options->threads = 1;
+				break;
+			}
+
+			case OPTION_BUSY_POLL:
+			{
+				size_t busy_poll;
+				if (get_query_number_value(optarg, &busy_poll) != 0 || busy_poll > MAX_BUSY_POLL)
+				{
+					printf("Invalid busy poll time: \"%s\"\n\n", optarg);
+					goto error;
+				}
+
+				mdig_options->spin = 1;
+				mdig_options->busy_poll = (int) busy_poll;
+				break;
+			}
+
+			case OPTION_FLOOR:
+				if (get_query_number_value(optarg, &mdig_options->floor) != 0)
+				{
+					printf("Invalid number of floor probes: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case OPTION_GRO:
+				mdig_options->gro = 1;
+				break;
+
+			case OPTION_TSC:
+				mdig_options->tsc = 1;
+				break;
+
+			case OPTION_STEADY:
+				if (get_query_number_value(optarg, &mdig_options->steady) != 0 ||
+				    mdig_options->steady < MIN_STEADY_WINDOW)
+				{
+					printf("Invalid steady state window: \"%s\"\n\n", optarg);
+					goto error;
+				}
+				break;
+
+			case 'v':
+				mdig_options->verbose = 1;
+				break;
+
+			case '?':
+				if (optarg)
+					printf("Error: invalid option: \"%c\": \"%s\"\n\n", (char) optopt, optarg);
+				else
+					printf("Error: invalid option: \"%c\"\n\n", (char) optopt);
+
+				goto error;
+
+			default:
+				printf("Unexpected getopt_long return value 0x%x \"%c\":\n"
+				       "\toptarg..: %s\n"
+				       "\toptind..: 0x%x\n"
+				       "\toptopt..: 0x%x \"%c\"\n"
+				       "\topterr..: 0x%x\n",
+				       option_char,
+				       (char) option_char,
+				       optarg,
+				       optind,
+				       optopt,
+				       (char) optopt,
+				       opterr);
+
+				goto error;
+		}
+	}
+
+	if (mdig_options->targets.count == 0) {
+		printf("Missing name server address\n\n");
+		goto error;
+	}
+
+	if (mdig_options->cpu >= 0 && mdig_options->threads)
+	{
+		printf("Option --cpu pins the single loop, use --sender-cpu and --receiver-cpu with threads\n\n");
+		goto error;
+	}
 
-	int zone_count = 0;
-	size_t length = 0;
-	size_t line = 1;
+	if (is_ab_distribution(mdig_options->targets.distribution) && mdig_options->targets.count != 2)
+	{
+		printf("A/B comparison needs exactly two name servers\n\n");
+		goto error;
+	}
 
 	size_t i;
-	for (i = 0; i < bytes_read; i++)
+	for (i = 0; i < mdig_options->targets.count; i++)
 	{
-		char *current = buffer + i;
+		struct sockaddr_in *address = &mdig_options->targets.targets[i].address;
+		if (address->sin_port == 0) address->sin_port = htons(mdig_options->port);
+	}
 
-		switch (*current)
+	if (mdig_options->got_replay)
+	{
+		if (mdig_options->domain_count > 0 || mdig_options->got_client || mdig_options->query_limit > 0 ||
+		    mdig_options->variation.subscribers > 0 || mdig_options->variation.ecs_count > 0)
 		{
-			case '.':
-				length++;
+			printf("Replay can't be combined with domains, client id, ECS or rate limit (use speed instead)\n\n");
+			goto error;
+		}
+	}
+	else if (mdig_options->domain_count < 1)
+	{
+		printf("Missing domains to query\n\n");
+		goto error;
+	}
 
-				if (zone_count == 0)
-				{
-					log_error("Invalid domain name at line %lu.", line);
+	return GOR_OK;
 
-					free(buffer);
-					free(*domains);
-					return -1;
-				}
+error:
+	usage();
+	free(mdig_options->domains);
+	free_target_set(&mdig_options->targets);
+	free_query_variation(&mdig_options->variation);
+	if (mdig_options->got_replay) free_pcap_queries(&mdig_options->replay);
+	if (mdig_options->output != stdout)
+	{
+		fclose(mdig_options->output);
+		mdig_options->output = stdout;
+	}
 
-				*dst_offset = (char) zone_count;
-				dst_offset++;
+	return GOR_ERROR;
+}
 
-				memcpy(dst_offset, src_offset, zone_count);
-				dst_offset += zone_count;
+#define CONFIDENCE_Z 1.96
 
-				zone_count = 0;
-				src_offset = current + 1;
-				break;
+struct paired_difference
+{
+	size_t count;
+	double a;
+	double b;
+	double sum;
+	double squares;
+};
 
-			case '\n':
-				if (length == 0)
-				{
-					line++;
-					break;
-				}
+struct ab_stats
+{
+	size_t pairs;
+	struct paired_difference latency;
+	struct paired_difference loss;
+};
 
-				if (zone_count == 0)
-				{
-					log_error("Invalid domain name at line %lu.", line);
+void add_paired_difference(struct paired_difference *difference, double a, double b)
+{
+	difference->count++;
+	difference->a += a;
+	difference->b += b;
+	difference->sum += b - a;
+	difference->squares += (b - a)*(b - a);
+}
 
-					free(buffer);
-					free(*domains);
-					return -1;
-				}
+double get_mean_difference(const struct paired_difference *difference)
+{
+	return difference->count > 0? difference->sum/difference->count : 0;
+}
 
-				*dst_offset = (char) zone_count;
-				dst_offset++;
+// Half width of normal approximation confidence interval of mean difference.
+double get_difference_margin(const struct paired_difference *difference)
+{
+	if (difference->count < 2) return 0;
 
-				memcpy(dst_offset, src_offset, zone_count);
-				dst_offset += zone_count;
+	double mean = get_mean_difference(difference);
+	double variance = (difference->squares - difference->count*mean*mean)/(difference->count - 1);
+	if (variance < 0) variance = 0;
 
-				*dst_offset = '\0';
-				dst_offset++;
+	return CONFIDENCE_Z*sqrt(variance/difference->count);
+}
 
-				(*count)++;
+int is_answered(struct query_table *table, size_t index)
+{
+	return (table->status[index] & (STATUS_ANSWERED | STATUS_LOST)) == STATUS_ANSWERED;
+}
 
-				zone_count = 0;
-				src_offset = current + 1;
+void add_ab_pair(struct ab_stats *stats, struct query_table *table, size_t a, size_t b)
+{
+	int answered_a = is_answered(table, a);
+	int answered_b = is_answered(table, b);
 
-				length = 0;
-				line++;
-				break;
+	stats->pairs++;
+	add_paired_difference(&stats->loss, !answered_a, !answered_b);
+	if (answered_a && answered_b)
+	{
+		add_paired_difference(&stats->latency, table->received[a] - table->sent[a],
+		                      table->received[b] - table->sent[b]);
+	}
+}
 
-			default:
-				zone_count++;
-				if (zone_count > UCHAR_MAX)
-				{
-					log_error("Invalid domain name at line %lu.", line);
+struct ab_slice
+{
+	size_t sent;
+	size_t answered;
+	double latency;
+};
 
-					free(buffer);
-					free(*domains);
-					return -1;
-				}
-				length++;
+void add_ab_slices(struct ab_stats *stats, struct ab_slice *slices)
+{
+	if (slices[0].sent == 0 || slices[1].sent == 0) return;
+
+	stats->pairs++;
+	add_paired_difference(&stats->loss, 1 - (double) slices[0].answered/slices[0].sent,
+	                      1 - (double) slices[1].answered/slices[1].sent);
+	if (slices[0].answered > 0 && slices[1].answered > 0)
+	{
+		add_paired_difference(&stats->latency, slices[0].latency/slices[0].answered,
+		                      slices[1].latency/slices[1].answered);
+	}
+}
+
+// Every query (or pair of adjacent time slices) is measured on both servers
+// under the same conditions, so host noise and differences between names
+// cancel out in per pair differences and their spread gives the confidence
+// interval.
+void get_ab_stats(struct query_table *table, struct target_set *set, size_t sent, struct ab_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	size_t i;
+	if (set->distribution == DISTRIBUTION_AB_QUERY)
+	{
+		for (i = 0; i + 1 < sent; i += 2)
+		{
+			if (table->targets[i] == 0) add_ab_pair(stats, table, i, i + 1);
+			else add_ab_pair(stats, table, i + 1, i);
 		}
+
+		return;
 	}
 
-	if (length > 0)
+	struct ab_slice slices[2];
+	memset(slices, 0, sizeof(slices));
+
+	// Slice pair is run of queries sent to A followed by run sent to B.
+	for (i = 0; i < sent; i++)
 	{
-		if (zone_count == 0)
+		if (i > 0 && table->targets[i] == 0 && table->targets[i - 1] == 1)
 		{
-			log_error("Invalid domain name at line %lu.", line);
+			add_ab_slices(stats, slices);
+			memset(slices, 0, sizeof(slices));
+		}
 
-			free(buffer);
-			free(*domains);
-			return -1;
+		struct ab_slice *current = &slices[table->targets[i]];
+		current->sent++;
+		if (is_answered(table, i))
+		{
+			current->answered++;
+			current->latency += table->received[i] - table->sent[i];
 		}
+	}
 
-		*dst_offset = (char) zone_count;
-		dst_offset++;
+	add_ab_slices(stats, slices);
+}
 
-		memcpy(dst_offset, src_offset, zone_count);
-		dst_offset += zone_count;
+void print_paired_difference(FILE *output, const struct paired_difference *difference, int relative)
+{
+	double a = difference->count > 0? difference->a/difference->count : 0;
+	double b = difference->count > 0? difference->b/difference->count : 0;
+	double mean = get_mean_difference(difference);
+	double margin = get_difference_margin(difference);
+
+	fprintf(output, "{\"count\": %lu, \"a\": %g, \"b\": %g, \"difference\": %g, \"interval\": [%g, %g]",
+	        difference->count, a, b, mean, mean - margin, mean + margin);
+	if (relative)
+	{
+		fprintf(output, ", \"relative\": %g, \"relative_interval\": [%g, %g]",
+		        a > 0? mean/a : 0, a > 0? (mean - margin)/a : 0, a > 0? (mean + margin)/a : 0);
+	}
 
-		*dst_offset = '\0';
-		 dst_offset++;
+	fprintf(output, "}");
+}
 
-		(*count)++;
+void print_ab_stats(FILE *output, struct target_set *set, struct ab_stats *stats)
+{
+	fprintf(output, "{\"mode\": \"%s\", \"slice\": %llu, \"pairs\": %lu, \"confidence\": 0.95,\n\t \"latency\": ",
+	        set->distribution == DISTRIBUTION_AB_QUERY? "query" : "slice",
+	        set->distribution == DISTRIBUTION_AB_SLICE? set->slice : 0, stats->pairs);
+	print_paired_difference(output, &stats->latency, 1);
+	fprintf(output, ",\n\t \"loss\": ");
+	print_paired_difference(output, &stats->loss, 0);
+	fprintf(output, "}");
+}
+
+void print_response_counters(FILE *output, const struct response_counters *counters)
+{
+	fprintf(output, "{\"good\": %lu, \"truncated\": %lu, \"empty\": %lu, \"rcodes\": {",
+	        counters->good, counters->truncated, counters->empty);
+
+	int first = 1;
+	size_t i;
+	for (i = 0; i < RCODE_COUNT; i++)
+	{
+		if (counters->rcodes[i] == 0) continue;
+
+		fprintf(output, "%s\"%s\": %lu", first? "" : ", ", rcode_names[i], counters->rcodes[i]);
+		first = 0;
 	}
 
-	*dst_offset = '\0';
+	fprintf(output, "}}");
+}
 
-	free(buffer);
-	return 0;
+void print_timestamps(FILE *output, unsigned long long start,
+                      unsigned long long *offsets, size_t used, size_t count)
+{
+	if (count > 0)
+	{
+		size_t i;
+		for (i = 0; i < count; i++)
+		{
+			fprintf(output, "\n\t\t%llu%s", (i < used)? start + offsets[i] : 0,
+			        (i + 1 < count)? "," : "\n\t");
+		}
+	}
 }
 
-void print_domains(size_t count, char *domains)
+void print_pair(FILE *output, struct query_table *table, size_t index, const char *separator)
 {
-	printf("Domains (%lu):", count);
+	unsigned long long sent = table->start + table->sent[index];
 
-	size_t index = 0;
-	char *offset = domains;
-	char zone[256];
-	while (*offset != '\0')
+	if ((table->status[index] & (STATUS_ANSWERED | STATUS_LOST)) == STATUS_ANSWERED)
 	{
-		printf("\n\t%lu:", ++index);
-		while (*offset != '\0')
-		{
-			size_t zone_count = (size_t) *(unsigned char *) offset;
-			offset++;
+		unsigned long long received = table->start + table->received[index];
+		unsigned long long intended = table->start + table->intended[index];
 
-			printf(" \\0%lo", zone_count);
+		fprintf(output, "\n\t\t[%llu, %llu, %lld, %llu, %lld, %u", sent, received, received - sent,
+		        intended, received - intended, table->status[index] & STATUS_RCODE_MASK);
+		if (table->answered_by != NULL) fprintf(output, ", %u", table->answered_by[index]);
+		fprintf(output, "]%s", separator);
+	}
+	else fprintf(output, "\n\t\t[%llu]%s", sent, separator);
+}
 
-			memcpy(zone, offset, zone_count);
-			zone[zone_count] = '\0';
-			printf(" \"%s\"", zone);
+void print_sockets(FILE *output, struct socket_pool *pool)
+{
+	size_t i;
+	for (i = 0; i < pool->count; i++)
+	{
+		struct socket_stats *stats = &pool->stats[i];
 
-			offset += zone_count;
-		}
+		char address[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &stats->address.sin_addr, address, sizeof(address));
 
-		offset++;
+		fprintf(output, "\n\t\t{\"address\": \"%s\", \"port\": %hu, \"sent\": %lu, \"received\": %lu, \"max_inflight\": %lu,"
+		        " \"drops\": %lu, \"reads\": %lu}%s",
+		        address, ntohs(stats->address.sin_port), stats->sent, stats->received, stats->max_inflight,
+		        stats->drops, stats->reads, (i + 1 < pool->count)? "," : "\n\t");
 	}
+}
 
-	printf("\n\n");
+void print_targets(FILE *output, struct target_set *set)
+{
+	size_t i;
+	for (i = 0; i < set->count; i++)
+	{
+		struct target *target = &set->targets[i];
+
+		char address[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &target->address.sin_addr, address, sizeof(address));
+
+		fprintf(output, "\n\t\t{\"address\": \"%s\", \"port\": %hu, \"weight\": %lu, \"sent\": %lu, \"received\": %lu,"
+		        " \"max_inflight\": %lu,\n\t\t \"latency\": ",
+		        address, ntohs(target->address.sin_port), target->weight, target->sent, target->received,
+		        target->max_inflight);
+		print_histogram(output, &target->latency);
+		fprintf(output, "}%s", (i + 1 < set->count)? "," : "\n\t");
+	}
 }
 
-int open_output(char *string, FILE **output)
+// Replies received in an interval and median latency of queries sent in it.
+struct steady_point
 {
-	*output = fopen(string, "w");
-	if (*output == NULL)
+	double rate;
+	unsigned long long latency;
+	int answered;
+};
+
+// Region of the run between the first and the last steady window of
+// intervals, warm-up before it and drain after it are left out.
+struct steady_state
+{
+	size_t window;
+	int found;
+
+	size_t first;
+	size_t last;
+	unsigned long long start;
+	unsigned long long end;
+
+	// Queries sent and replies received during the region.
+	size_t sends_from;
+	size_t sends_to;
+	size_t receives_from;
+	size_t receives_to;
+	size_t good;
+
+	struct rate_fit sends;
+	struct rate_fit receives;
+	struct latency_histograms latencies;
+};
+
+int is_steady_window(struct steady_point *points, size_t first, size_t window)
+{
+	double rate = 0;
+	double latency = 0;
+
+	size_t i;
+	for (i = first; i < first + window; i++)
 	{
-		log_errno("");
+		if (!points[i].answered) return 0;
+
+		rate += points[i].rate/window;
+		latency += (double) points[i].latency/window;
+	}
+
+	if (rate <= 0) return 0;
+
+	double slack = latency*STEADY_LATENCY_TOLERANCE;
+	if (slack < STEADY_LATENCY_SLACK) slack = STEADY_LATENCY_SLACK;
+
+	for (i = first; i < first + window; i++)
+	{
+		if (fabs(points[i].rate - rate) > rate*STEADY_RATE_TOLERANCE) return 0;
+		if (fabs(points[i].latency - latency) > slack) return 0;
+	}
+
+	return 1;
+}
+
+size_t find_timestamp(unsigned long long *timestamps, size_t count, unsigned long long timestamp)
+{
+	size_t low = 0;
+	size_t high = count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low)/2;
+		if (timestamps[middle] < timestamp) low = middle + 1;
+		else high = middle;
+	}
+
+	return low;
+}
+
+int get_steady_state(struct query_table *table, size_t sent, size_t received, struct run_stats *stats,
+                     struct steady_state *steady)
+{
+	size_t window = steady->window;
+	size_t count = stats->interval_count;
+
+	memset(steady, 0, sizeof(*steady));
+	steady->window = window;
+	reset_histogram(&steady->latencies.actual);
+	reset_histogram(&steady->latencies.intended);
+
+	if (count < window) return 0;
+
+	struct steady_point *points = malloc(count*sizeof(struct steady_point));
+	struct histogram *latency = malloc(sizeof(struct histogram));
+	if (points == NULL || latency == NULL)
+	{
+		log_errno("Can't allocate steady state points for %lu intervals.", count);
+		free(latency);
+		free(points);
 		return -1;
 	}
 
+	size_t i;
+	size_t index = 0;
+	for (i = 0; i < count; i++)
+	{
+		reset_histogram(latency);
+		for (; index < sent && table->sent[index] < (i + 1)*stats->interval; index++)
+		{
+			if (is_answered(table, index)) add_histogram_value(latency, table->received[index] - table->sent[index]);
+		}
+
+		points[i].rate = (double) stats->intervals[i].received;
+		points[i].answered = latency->count > 0;
+		points[i].latency = get_histogram_percentile(latency, 50.0);
+	}
+
+	for (i = 0; i + window <= count && !is_steady_window(points, i, window); i++);
+	if (i + window <= count)
+	{
+		steady->first = i;
+		for (i = count - window; i > steady->first && !is_steady_window(points, i, window); i--);
+		steady->last = i + window - 1;
+		steady->found = 1;
+	}
+
+	free(latency);
+	free(points);
+
+	if (!steady->found) return 0;
+
+	steady->start = steady->first*stats->interval;
+	steady->end = (steady->last + 1)*stats->interval;
+
+	steady->sends_from = find_timestamp(table->sent, sent, steady->start);
+	steady->sends_to = find_timestamp(table->sent, sent, steady->end);
+	steady->receives_from = find_timestamp(table->receives, received, steady->start);
+	steady->receives_to = find_timestamp(table->receives, received, steady->end);
+
+	for (i = steady->sends_from; i < steady->sends_to; i++)
+	{
+		add_rate_point(&steady->sends, table->sent[i]);
+		if (!is_answered(table, i)) continue;
+
+		add_histogram_value(&steady->latencies.actual, table->received[i] - table->sent[i]);
+		add_histogram_value(&steady->latencies.intended, table->received[i] - table->intended[i]);
+	}
+
+	for (i = steady->receives_from; i < steady->receives_to; i++) add_rate_point(&steady->receives, table->receives[i]);
+	for (i = steady->first; i <= steady->last; i++) steady->good += stats->intervals[i].responses.good;
+
 	return 0;
 }
 
-enum get_options_result get_options(int argc, char *argv[], struct mdig_options *mdig_options)
+// Fit in grinder format: list of [[left, right], [intercept, rate]] with
+// range in nanoseconds from the origin, empty if there is nothing to fit.
+void print_rate_fit(FILE *output, const struct rate_fit *fit, unsigned long long origin)
+{
+	double intercept;
+	double rate;
+	if (get_rate_fit(fit, origin, &intercept, &rate) != 0)
+	{
+		fprintf(output, "[]");
+		return;
+	}
+
+	fprintf(output, "[[[%llu, %llu], [%f, %f]]]", fit->first - origin, fit->last - origin, intercept, rate);
+}
+
+void print_domain_ranks(FILE *output, struct domain_set *set, struct domain_rank *ranks, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		struct domain_stats *stats = &set->stats[ranks[i].index];
+
+		char name[DOMAIN_NAME_SIZE];
+		get_domain_name(set, ranks[i].index, name, sizeof(name));
+
+		fprintf(output, "\n\t\t{\"name\": \"%s\", \"queries\": %u, \"answered\": %u, \"lost\": %u, \"mean\": %llu, \"p99\": %llu}%s",
+		        name, stats->queries, stats->answered, ranks[i].lost, ranks[i].mean, ranks[i].p99,
+		        (i + 1 < count)? "," : "\n\t");
+	}
+}
+
+void log_domain_ranks(const char *title, struct domain_set *set, struct domain_rank *ranks, size_t count)
 {
-	opterr = 0;
-	int option_char;
+	size_t size = (count + 1)*(DOMAIN_NAME_SIZE + 128);
+	char *text = malloc(size);
+	if (text == NULL) return;
 
-	mdig_options->server.sin_family = AF_INET;
-	mdig_options->server.sin_port = htons(53);
+	size_t length = snprintf(text, size, "%s (p99 / mean ns, lost of queries):", title);
 
-	int got_address = 0;
-	mdig_options->got_client = 0;
-	mdig_options->got_query_number = 0;
-	mdig_options->query_limit = 0;
-	mdig_options->domain_count = 0;
-	mdig_options->domains = NULL;
-	mdig_options->output = stdout;
-	mdig_options->verbose = 0;
-	while ((option_char = getopt_long(argc, argv, "hs:p:c:n:l:d:vo:", long_options, NULL)) != -1)
+	size_t i;
+	for (i = 0; i < count; i++)
 	{
-		switch (option_char)
-		{
-			case 'h':
-				free(mdig_options->domains);
-				return GOR_HELP;
-
-			case 's':
-				if (inet_aton(optarg, &mdig_options->server.sin_addr) <= 0)
-				{
-					printf("Invalid name server address: \"%s\"\n\n", optarg);
-					goto error;
-				}
-
-				got_address = 1;
-				break;
+		char name[DOMAIN_NAME_SIZE];
+		get_domain_name(set, ranks[i].index, name, sizeof(name));
 
-			case 'p':
-				if (get_port_value(optarg, &mdig_options->server.sin_port) != 0)
-				{
-					printf("Invalid port value: \"%s\"\n\n", optarg);
-					goto error;
-				}
+		length += snprintf(text + length, size - length, "\n\t%s: %llu / %llu, %u of %u%s",
+		                   name, ranks[i].p99, ranks[i].mean, ranks[i].lost, set->stats[ranks[i].index].queries,
+		                   (i + 1 < count)? ";" : ".");
+	}
 
-				mdig_options->server.sin_port = htons(mdig_options->server.sin_port);
-				break;
+	log_message("%s\n", text);
+	free(text);
+}
 
-			case 'c':
-				if (get_client_value(optarg, mdig_options->client) != 0)
-				{
-					printf("Invalid client id: \"%s\"\n\n", optarg);
-					goto error;
-				}
+void log_domain_report(struct domain_set *set, struct domain_report *report)
+{
+	log_domain_ranks("Slowest domains", set, report->slowest, report->slowest_count);
+	if (report->lost_count > 0) log_domain_ranks("Most lost domains", set, report->lost, report->lost_count);
+}
 
-				mdig_options->got_client = 1;
-				break;
+void write_output(FILE *output, struct query_table *table, size_t sent, size_t received,
+                  struct latency_histograms *latencies, struct rate_fit *sends, struct rate_fit *receives,
+                  struct run_stats *stats, struct socket_pool *pool, struct target_set *targets, struct ab_stats *ab,
+                  struct domain_set *domains, struct domain_report *report, struct histogram *floor,
+                  struct steady_state *steady)
+{
+	size_t i;
 
-			case 'n':
-				if (get_query_number_value(optarg, &mdig_options->query_number) != 0)
-				{
-					printf("Invalid query number: \"%s\"\n\n", optarg);
-					goto error;
-				}
+	fprintf(output, "{\"clock\": {\"monotonic\": %llu, \"realtime\": %llu},\n \"sends\":\n\t[",
+	        table->start, table->start_realtime);
+	print_timestamps(output, table->start, table->sent, sent, sent);
 
-				mdig_options->got_query_number = 1;
-				break;
+	fprintf(output, "],\n \"receives\":\n\t[");
+	print_timestamps(output, table->start, table->receives, received, sent);
 
-			case 'l':
-				if (get_query_number_value(optarg, &mdig_options->query_limit) != 0)
-				{
-					printf("Invalid query limit: \"%s\"\n\n", optarg);
-					goto error;
-				}
-				break;
+	fprintf(output, "],\n \"pairs\":\n\t[");
+	for (i = 0; i < sent; i++) print_pair(output, table, i, (i + 1 < sent)? "," : "\n\t");
 
-			case 'd':
-				if (get_domains(optarg, &mdig_options->domain_count, &mdig_options->domains) != 0)
-				{
-					printf("Failed to read domains from: \"%s\"\n\n", optarg);
-					goto error;
-				}
+	unsigned long long origin = sent > 0? table->sent[0] : 0;
+	fprintf(output, "],\n \"fits\":\n\t{\"sends\": ");
+	print_rate_fit(output, sends, origin);
+	fprintf(output, ",\n\t \"receives\": ");
+	print_rate_fit(output, receives, origin);
 
-				break;
+	fprintf(output, "},\n \"latency\":\n\t{\"actual\":\n\t\t");
+	print_histogram(output, &latencies->actual);
+	fprintf(output, ",\n\t \"intended\":\n\t\t");
+	print_histogram(output, &latencies->intended);
+	if (floor != NULL)
+	{
+		fprintf(output, ",\n\t \"floor\":\n\t\t");
+		print_histogram(output, floor);
+	}
 
-			case 'o':
-				if (open_output(optarg, &mdig_options->output) != 0)
-				{
-					printf("Can't open file: \"%s\"\n\n", optarg);
-					goto error;
-				}
-				break;
+	fprintf(output, "\n\t},\n \"responses\":\n\t{\"malformed\": %lu, \"unexpected\": %lu, \"duplicates\": %lu,"
+	        " \"late\": %lu, \"lost\": %lu,\n\t \"total\": ",
+	        stats->malformed, stats->unexpected, stats->duplicates, stats->late, stats->lost);
+	print_response_counters(output, &stats->responses);
 
-			case 'v':
-				mdig_options->verbose = 1;
-				break;
+	fprintf(output, "\n\t},\n \"load\":\n\t{\"unique\": %lu, \"offered\": %lu, \"attempts\": [",
+	        sent, sent + stats->retries);
+	for (i = 0; i <= table->retries; i++) fprintf(output, "%s%lu", i > 0? ", " : "", stats->attempts[i]);
 
-			case '?':
-				if (optarg)
-					printf("Error: invalid option: \"%c\": \"%s\"\n\n", (char) optopt, optarg);
-				else
-					printf("Error: invalid option: \"%c\"\n\n", (char) optopt);
+	fprintf(output, "]},\n \"sockets\":\n\t[");
+	print_sockets(output, pool);
 
-				goto error;
+	fprintf(output, "],\n \"targets\":\n\t[");
+	print_targets(output, targets);
 
-			default:
-				printf("Unexpected getopt_long return value 0x%x \"%c\":\n"
-				       "\toptarg..: %s\n"
-				       "\toptind..: 0x%x\n"
-				       "\toptopt..: 0x%x \"%c\"\n"
-				       "\topterr..: 0x%x\n",
-				       option_char,
-				       (char) option_char,
-				       optarg,
-				       optind,
-				       optopt,
-				       (char) optopt,
-				       opterr);
+	struct generator_stats generator;
+	get_generator_stats(stats, &generator);
+	fprintf(output, "],\n \"generator\":\n\t{\"limited\": %s, \"limited_intervals\": %lu, \"max_lag\": %llu,"
+	        " \"mean_lag\": %llu, \"max_busy\": %.3f, \"drops\": %lu",
+	        generator.limited > 0? "true" : "false", generator.limited, generator.max_lag, generator.mean_lag,
+	        generator.max_busy, generator.drops);
 
-				goto error;
+	if (steady != NULL)
+	{
+		fprintf(output, "},\n \"steady\":\n\t{\"found\": %s, \"window\": %lu",
+		        steady->found? "true" : "false", steady->window);
+		if (steady->found)
+		{
+			// Fits of the region count from its first send like its slice of sends
+			// and receives does, so they can be drawn over the slice as they are.
+			unsigned long long steady_origin = (steady->sends_from < sent)? table->sent[steady->sends_from] : origin;
+			double duration = (double) (steady->end - steady->start)/NANOSECONDS;
+			fprintf(output, ", \"intervals\": [%lu, %lu], \"start\": %llu, \"end\": %llu,"
+			        " \"points\": [%lu, %lu], \"receive_points\": [%lu, %lu],"
+			        "\n\t \"throughput\": %.2f, \"goodput\": %.2f,\n\t \"fits\": {\"sends\": ",
+			        steady->first, steady->last, table->start + steady->start, table->start + steady->end,
+			        steady->sends_from, steady->sends_to, steady->receives_from, steady->receives_to,
+			        (steady->receives_to - steady->receives_from)/duration, steady->good/duration);
+			print_rate_fit(output, &steady->sends, steady_origin);
+			fprintf(output, ", \"receives\": ");
+			print_rate_fit(output, &steady->receives, steady_origin);
+			fprintf(output, "},\n\t \"latency\":\n\t\t{\"actual\": ");
+			print_histogram(output, &steady->latencies.actual);
+			fprintf(output, ",\n\t\t \"intended\": ");
+			print_histogram(output, &steady->latencies.intended);
+			fprintf(output, "}");
 		}
 	}
 
-	if (!got_address) {
-		printf("Missing name server address\n\n");
-		goto error;
+	if (report != NULL)
+	{
+		fprintf(output, "},\n \"domains\":\n\t{\"count\": %lu,\n\t \"slowest\":\n\t\t[", domains->count);
+		print_domain_ranks(output, domains, report->slowest, report->slowest_count);
+		fprintf(output, "],\n\t \"lost\":\n\t\t[");
+		print_domain_ranks(output, domains, report->lost, report->lost_count);
+		fprintf(output, "]");
 	}
 
-	if (mdig_options->domain_count < 1)
+	if (ab != NULL)
 	{
-		printf("Missing domains to query\n\n");
-		goto error;
+		fprintf(output, "},\n \"ab\":\n\t");
+		print_ab_stats(output, targets, ab);
+		fprintf(output, ",\n \"intervals\":");
 	}
+	else fprintf(output, "},\n \"intervals\":");
 
-	return GOR_OK;
-
-error:
-	usage();
-	free(mdig_options->domains);
-	if (mdig_options->output != stdout)
+	fprintf(output, "\n\t{\"start\": %llu, \"length\": %llu,\n\t \"values\":\n\t\t[",
+	        table->start, stats->interval);
+	size_t level = 0;
+	for (i = 0; i < stats->interval_count; i++)
 	{
-		fclose(mdig_options->output);
-		mdig_options->output = stdout;
+		struct interval_stats *interval = &stats->intervals[i];
+		fprintf(output, "\n\t\t\t{\"sent\": %lu, \"retries\": %lu, \"received\": %lu, \"lost\": %lu, \"responses\": ",
+		        interval->sent, interval->retries, interval->received, interval->lost);
+		print_response_counters(output, &interval->responses);
+
+		// In-flight count at interval start holds until the first event in it.
+		size_t min_inflight = (interval->resolved > 0 && interval->min_inflight < level)? interval->min_inflight : level;
+		size_t max_inflight = (interval->max_inflight > level)? interval->max_inflight : level;
+		double mean_inflight = level + interval->inflight_area/stats->interval;
+		fprintf(output, ",\n\t\t\t \"inflight\": {\"min\": %lu, \"max\": %lu, \"mean\": %.2f},",
+		        min_inflight, max_inflight, mean_inflight > 0? mean_inflight : 0);
+
+		fprintf(output, "\n\t\t\t \"generator\": {\"max_lag\": %llu, \"mean_lag\": %llu, \"busy\": %.3f, \"drops\": %lu,"
+		        " \"limited\": %s}}%s",
+		        interval->max_lag, interval->sent > 0? interval->lag/interval->sent : 0,
+		        (double) interval->busy/stats->interval, interval->drops,
+		        is_generator_limited(interval, stats->interval)? "true" : "false",
+		        i + 1 < stats->interval_count? "," : "\n\t\t");
+
+		level = level + interval->sent - interval->resolved;
 	}
 
-	return GOR_ERROR;
+	fprintf(output, "]\n\t}\n}\n");
 }
 
 int main(int argc, char *argv[])
@@ -753,9 +4003,10 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (mdig_options.verbose) print_domains(mdig_options.domain_count, mdig_options.domains);
+	if (mdig_options.verbose && mdig_options.domains) print_domains(mdig_options.domain_count, mdig_options.domains);
 
-	size_t count = mdig_options.got_query_number? mdig_options.query_number : mdig_options.domain_count;
+	size_t count = mdig_options.got_replay? mdig_options.replay.count : mdig_options.domain_count;
+	if (mdig_options.got_query_number) count = mdig_options.query_number;
 	char *client = mdig_options.got_client? mdig_options.client : NULL;
 
 	unsigned long long write_interval = 0;
@@ -765,459 +4016,344 @@ int main(int argc, char *argv[])
 		if (NANOSECONDS % mdig_options.query_limit >= NANOSECONDS/2) write_interval++;
 	}
 
-	void *queries = make_queries(mdig_options.domains, count, client);
-	if (queries == NULL)
-	{
-		log_errno("Can't allocate buffer for DNS queries.");
+	int result = 1;
 
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
-		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
-		}
+	struct mig_run run;
+	memset(&run, 0, sizeof(run));
 
-		return 1;
-	}
+	struct query_table *table = &run.table;
+	struct sender *sender = &run.sender;
+	struct receiver *receiver = &run.receiver;
 
-	struct timespec *sends = malloc(count*sizeof(struct timespec));
-	if (sends == NULL)
-	{
-		log_errno("Can't allocate send timestamp buffer of %lu bytes.", count*sizeof(struct timespec));
+	struct domain_set domains;
+	struct domain_report report;
+	memset(&domains, 0, sizeof(domains));
+	memset(&report, 0, sizeof(report));
 
-		free(queries);
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
-		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
-		}
+	void *queries = NULL;
+	if (make_query_table(count, mdig_options.retries, table) != 0) goto cleanup;
 
-		return 1;
+	int scheduled = 0;
+	if (mdig_options.got_replay)
+	{
+		queries = make_replay_queries(&mdig_options.replay, count, mdig_options.speed, table->intended);
+		scheduled = mdig_options.speed > 0;
 	}
-
-	struct timespec *receives = malloc(count*sizeof(struct timespec));
-	if (receives == NULL)
+	else
 	{
-		log_errno("Can't allocate receive timestamp buffer of %lu bytes.", count*sizeof(struct timespec));
-
-		free(sends);
-		free(queries);
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
+		if (mdig_options.variation.subscribers > 0 && client == NULL)
 		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
+			memset(mdig_options.variation.base_client, 0, CLIENT_ID_LENGTH);
+			client = mdig_options.variation.base_client;
 		}
+		else if (client != NULL) memcpy(mdig_options.variation.base_client, client, CLIENT_ID_LENGTH);
 
-		return 1;
+		mdig_options.variation.client = client != NULL;
+		queries = make_queries(mdig_options.domains, count, client, mdig_options.variation.ecs_count > 0);
+		if (write_interval > 0)
+		{
+			size_t i;
+			for (i = 0; i < count; i++) table->intended[i] = i*write_interval;
+
+			scheduled = 1;
+		}
 	}
 
-	struct pair_timespec *pairs = malloc(count*sizeof(struct pair_timespec));
-	if (pairs == NULL)
+	if (queries != NULL && mdig_options.targets.distribution == DISTRIBUTION_AB_QUERY)
 	{
-		log_errno("Can't allocate processing timestamp buffer of %lu bytes.",
-		          count*sizeof(struct pair_timespec));
-
-		free(receives);
-		free(sends);
+		void *pairs = make_query_pairs(queries, count, mdig_options.got_replay && scheduled? table->intended : NULL);
 		free(queries);
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
-		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
-		}
-
-		return 1;
+		queries = pairs;
 	}
 
-	size_t i;
-	for (i = 0; i < count; i++)
+	if (queries == NULL)
 	{
-		receives[i].tv_sec = 0;
-		receives[i].tv_nsec = 0;
-		pairs[i].answer = 0;
+		log_errno("Can't allocate buffer for DNS queries.");
+		goto cleanup;
 	}
 
-	log_message("Starting...");
-	int s = socket(AF_INET, SOCK_DGRAM, 0);
-	if (s == -1)
+	if (mdig_options.targets.count > 1)
 	{
-		log_errno("Can't open UDP socket. Exiting...");
-
-		free(pairs);
-		free(receives);
-		free(sends);
-		free(queries);
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
+		table->targets = malloc(count*sizeof(unsigned char));
+		if (table->targets == NULL)
 		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
+			log_errno("Can't allocate target table of %lu bytes.", count*sizeof(unsigned char));
+			goto cleanup;
 		}
 
-		return 1;
+		if (assign_targets(&mdig_options.targets, queries, count, table->targets) != 0) goto cleanup;
 	}
 
-	errno = 0;
-	int sflags = fcntl(s, F_GETFL);
-	if (errno != 0)
+	if (mdig_options.top > 0)
 	{
-		log_errno("Can't get flags for UDP socket. Exiting...");
-
-		close(s);
-		free(pairs);
-		free(receives);
-		free(sends);
-		free(queries);
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
-		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
-		}
+		size_t period = mdig_options.got_replay? mdig_options.replay.count : mdig_options.domain_count;
+		if (mdig_options.targets.distribution == DISTRIBUTION_AB_QUERY) period *= 2;
+		if (make_domain_set(queries, count, period, &domains) != 0) goto cleanup;
 
-		return 1;
+		receiver->domains = &domains;
 	}
 
-	if (fcntl(s, F_SETFL, sflags | O_NONBLOCK) == -1)
-	{
-		log_errno("Can't set O_NONBLOCK flag to UDP socket. Exiting...");
-
-		close(s);
-		free(pairs);
-		free(receives);
-		free(sends);
-		free(queries);
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
-		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
-		}
+	if (make_run_stats(mdig_options.interval, &sender->stats) != 0) goto cleanup;
+	if (make_run_stats(mdig_options.interval, &receiver->stats) != 0) goto cleanup;
+	if (make_timer_wheel(count, TIMER_TICK, &sender->timers) != 0) goto cleanup;
 
-		return 1;
-	}
+	log_message("Starting...");
+	if (mdig_options.tsc && enable_tsc_clock() != 0) goto cleanup;
 
-	fd_set readfds;
-	fd_set writefds;
+	if (open_socket_pool(mdig_options.sockets, mdig_options.batch, mdig_options.bind_addresses,
+	                     mdig_options.bind_count, mdig_options.busy_poll,
+	                     mdig_options.gro, &run.pool) != 0) goto cleanup;
 
-	FD_ZERO(&readfds);
-	FD_SET(s, &readfds);
+	run.spin = mdig_options.spin;
+	if (mdig_options.cpu >= 0 && pin_thread(pthread_self(), mdig_options.cpu) != 0) goto cleanup;
 
-	FD_ZERO(&writefds);
-	FD_SET(s, &writefds);
+	struct histogram floor;
+	reset_histogram(&floor);
+	if (mdig_options.floor > 0)
+	{
+		if (measure_floor(mdig_options.floor, run.spin, mdig_options.busy_poll, &floor) != 0) goto cleanup;
+
+		log_message("Floor (loopback echo round trip, ns):\n"
+		            "\tMin....: %llu;\n"
+		            "\tp50....: %llu;\n"
+		            "\tp99....: %llu;\n"
+		            "\tMax....: %llu.\n",
+		            floor.min, get_histogram_percentile(&floor, 50.0), get_histogram_percentile(&floor, 99.0), floor.max);
+	}
 
-	void *iobuffer = malloc(RECEIVE_BUFFER_SIZE);
-	if (iobuffer == NULL)
+	receiver->buffer = malloc(RECEIVE_BUFFER_SIZE);
+	if (receiver->buffer == NULL)
 	{
 		log_errno("Can't allocate I/O buffer of %lu size.", (size_t) RECEIVE_BUFFER_SIZE);
-
-		close(s);
-		free(pairs);
-		free(receives);
-		free(sends);
-		free(queries);
-		free(mdig_options.domains);
-		if (mdig_options.output != stdout)
-		{
-			fclose(mdig_options.output);
-			mdig_options.output = stdout;
-		}
-
-		return 1;
+		goto cleanup;
 	}
 
-	char *offset = (char *) queries;
-	size_t messages_sent = 0;
-	size_t messages_received = 0;
-	unsigned long long last_sent = 0;
-	while (messages_sent < count)
-	{
-		struct timespec timeout = {1, 0};
-		int fd_count = pselect(s + 1, &readfds, &writefds, NULL, &timeout, 0);
-		if (fd_count == -1)
-		{
-			log_errno("Error on select. Exiting...");
-
-			close(s);
-			free(pairs);
-			free(receives);
-			free(sends);
-			free(queries);
-			free(mdig_options.domains);
-			if (mdig_options.output != stdout)
-			{
-				fclose(mdig_options.output);
-				mdig_options.output = stdout;
-			}
-
-			return 1;
-		}
-
-		if (fd_count > 0)
-		{
-			if (FD_ISSET(s, &readfds))
-			{
-				if (recv_answer(s, &mdig_options.server, iobuffer, RECEIVE_BUFFER_SIZE,
-				                &messages_received, count, receives, pairs, mdig_options.verbose) == -1)
-				{
-					close(s);
-					free(pairs);
-					free(receives);
-					free(sends);
-					free(queries);
-					free(mdig_options.domains);
-					if (mdig_options.output != stdout)
-					{
-						fclose(mdig_options.output);
-						mdig_options.output = stdout;
-					}
-
-					return 1;
-				}
-
-			}
-			else FD_SET(s, &readfds);
-
-			if (FD_ISSET(s, &writefds))
-			{
-				int do_send_query = write_interval <= 0 || messages_sent <= 0;
-				if (!do_send_query)
-				{
-					struct timespec now;
-					if (clock_gettime(CLOCK_SOURCE, &now) == -1)
-					{
-						log_errno("Error on getting timestamp. Exiting...");
-
-						close(s);
-						free(pairs);
-						free(receives);
-						free(sends);
-						free(queries);
-						free(mdig_options.domains);
-						if (mdig_options.output != stdout)
-						{
-							fclose(mdig_options.output);
-							mdig_options.output = stdout;
-						}
-
-						return 1;
-					}
-
-					unsigned long long passed = now.tv_sec;
-					passed *= NANOSECONDS;
-					passed += now.tv_nsec;
-					passed -= last_sent;
-
-					do_send_query = passed >= write_interval;
-				}
+	sender->pool = &run.pool;
+	sender->targets = &mdig_options.targets;
+	sender->offset = (char *) queries;
+	sender->scheduled = scheduled;
+	sender->timeout = mdig_options.timeout;
+	sender->retries = mdig_options.retries;
+	sender->retry_timeout = mdig_options.retry_timeout;
+	sender->backoff = mdig_options.backoff;
+	sender->verbose = mdig_options.verbose;
+	if (mdig_options.variation.subscribers > 0 || mdig_options.variation.ecs_count > 0)
+	{
+		sender->variation = &mdig_options.variation;
+	}
 
-				if (do_send_query)
-				{
-					size_t size;
-					void *q = get_next_query(&offset, &size);
-
-					if (sent_query(s, &mdig_options.server, q, size,
-					               &messages_sent, sends, pairs, mdig_options.verbose) == -1)
-					{
-						close(s);
-						free(pairs);
-						free(receives);
-						free(sends);
-						free(queries);
-						free(mdig_options.domains);
-						if (mdig_options.output != stdout)
-						{
-							fclose(mdig_options.output);
-							mdig_options.output = stdout;
-						}
-
-						return 1;
-					}
-
-					if (write_interval > 0)
-					{
-						struct timespec *last_sentspec = &pairs[messages_sent - 1].sent;
-						last_sent = last_sentspec->tv_sec;
-						last_sent *= NANOSECONDS;
-						last_sent += last_sentspec->tv_nsec;
-					}
-				}
-			}
-			else FD_SET(s, &writefds);
-		}
-		else
+	if (sender->retries > 0)
+	{
+		sender->queries = malloc(count*sizeof(char *));
+		if (sender->queries == NULL)
 		{
-			FD_SET(s, &readfds);
-			FD_SET(s, &writefds);
+			log_errno("Can't allocate retry queries of %lu bytes.", count*sizeof(char *));
+			goto cleanup;
 		}
 	}
 
-	size_t attempts = RECV_TIMEOUT;
-	while (messages_received < count && attempts > 0)
-	{
-		struct timeval timeout = {1, 0};
-		int fd_count = select(s + 1, &readfds, NULL, NULL, &timeout);
+	receiver->pool = &run.pool;
+	receiver->targets = &mdig_options.targets;
+	receiver->size = RECEIVE_BUFFER_SIZE;
+	receiver->verbose = mdig_options.verbose;
+	reset_histogram(&receiver->latencies.actual);
+	reset_histogram(&receiver->latencies.intended);
 
-		if (fd_count == -1)
-		{
-			log_errno("Error on select. Exiting...");
+	if (mdig_options.agent && wait_for_start() != 0) goto cleanup;
 
-			close(s);
-			free(pairs);
-			free(receives);
-			free(sends);
-			free(queries);
-			free(mdig_options.domains);
-			if (mdig_options.output != stdout)
-			{
-				fclose(mdig_options.output);
-				mdig_options.output = stdout;
-			}
+	if (get_realtime(&table->start_realtime) != 0 || get_timestamp(&table->start) != 0) goto cleanup;
 
-			return 1;
-		}
+	if (mdig_options.threads)
+	{
+		if (run_threads(&run, mdig_options.sender_cpu, mdig_options.receiver_cpu) != 0) goto cleanup;
+	}
+	else if (run_loop(&run) != 0) goto cleanup;
 
-		if (fd_count > 0)
-		{
-			if (FD_ISSET(s, &readfds))
-			{
-				if (recv_answer(s, &mdig_options.server, iobuffer, RECEIVE_BUFFER_SIZE,
-				                &messages_received, count, receives, pairs, mdig_options.verbose) == -1)
-				{
-					close(s);
-					free(pairs);
-					free(receives);
-					free(sends);
-					free(queries);
-					free(mdig_options.domains);
-					if (mdig_options.output != stdout)
-					{
-						fclose(mdig_options.output);
-						mdig_options.output = stdout;
-					}
-
-					return 1;
-				}
+	if (merge_run_stats(&receiver->stats, &sender->stats) != 0) goto cleanup;
 
-				attempts = RECV_TIMEOUT;
-			}
-			else FD_SET(s, &readfds);
-		}
-		else
-		{
-			attempts--;
-			FD_SET(s, &readfds);
-		}
-	}
+	long long drift;
+	if (check_clock_drift(&drift) != 0) goto cleanup;
+	if (is_tsc_clock()) log_message("TSC clock drift: %lld ns.\n", drift);
 
-	close(s);
+	struct run_stats *stats = &receiver->stats;
+	struct latency_histograms *latencies = &receiver->latencies;
+	size_t messages_sent = sender->sent;
+	size_t messages_received = receiver->received;
 
 	log_message("Messages:\n"
 	            "\tSent....: %ld;\n"
 	            "\tReceived: %ld;\n"
-	            "\tLost....: %ld.\n\n", count, messages_received, count - messages_received);
+	            "\tLost....: %ld (late %lu).\n\n", messages_sent, messages_received, stats->lost, stats->late);
+
+	log_message("Responses:\n"
+	            "\tGood......: %lu;\n"
+	            "\tNOERROR...: %lu;\n"
+	            "\tSERVFAIL..: %lu;\n"
+	            "\tNXDOMAIN..: %lu;\n"
+	            "\tREFUSED...: %lu;\n"
+	            "\tTruncated.: %lu;\n"
+	            "\tEmpty.....: %lu;\n"
+	            "\tMalformed.: %lu;\n"
+	            "\tUnexpected: %lu;\n"
+	            "\tDuplicates: %lu.\n\n",
+	            stats->responses.good,
+	            stats->responses.rcodes[0], stats->responses.rcodes[2],
+	            stats->responses.rcodes[3], stats->responses.rcodes[5],
+	            stats->responses.truncated, stats->responses.empty,
+	            stats->malformed, stats->unexpected, stats->duplicates);
+
+	if (sender->retries > 0)
+	{
+		log_message("Load:\n"
+		            "\tUnique..: %lu;\n"
+		            "\tOffered.: %lu (%lu retries).\n\n",
+		            messages_sent, messages_sent + stats->retries, stats->retries);
+	}
 
-	fprintf(mdig_options.output, "{\"sends\":\n\t[");
-	if (count > 0)
+	struct steady_state steady;
+	steady.window = mdig_options.steady;
+	steady.found = 0;
+	if (steady.window > 0)
 	{
-		unsigned long long timestamp;
-		for (i = 0; i < count - 1; i++)
-		{
-			timestamp = sends[i].tv_sec;
-			timestamp *= NANOSECONDS;
-			timestamp += sends[i].tv_nsec;
+		if (get_steady_state(table, messages_sent, messages_received, stats, &steady) != 0) goto cleanup;
 
-			fprintf(mdig_options.output,
-			        "\n\t\t%llu,", timestamp);
+		if (steady.found)
+		{
+			log_message("Steady state: intervals %lu to %lu of %lu (%.3f s to %.3f s), figures below are over it.\n",
+			            steady.first, steady.last, stats->interval_count,
+			            (double) steady.start/NANOSECONDS, (double) steady.end/NANOSECONDS);
 		}
+		else log_message("Steady state hasn't been found, figures below are over the whole run.\n");
+	}
 
-		timestamp = sends[i].tv_sec;
-		timestamp *= NANOSECONDS;
-		timestamp += sends[i].tv_nsec;
-
-		fprintf(mdig_options.output,
-		        "\n\t\t%llu\n\t", timestamp);
+	struct rate_fit *send_fit = &sender->sends;
+	struct rate_fit *receive_fit = &receiver->receives;
+	size_t sends_before = 0;
+	size_t receives_before = 0;
+	struct latency_histograms *summary = latencies;
+	if (steady.found)
+	{
+		double duration = (double) (steady.end - steady.start)/NANOSECONDS;
+		log_message("Throughput: %.2f QpS (goodput %.2f QpS).\n",
+		            (steady.receives_to - steady.receives_from)/duration, steady.good/duration);
+
+		send_fit = &steady.sends;
+		receive_fit = &steady.receives;
+		sends_before = steady.sends_from;
+		receives_before = steady.receives_from;
+		summary = &steady.latencies;
+	}
+	else if (messages_sent > 0 && messages_received > 0 && table->receives[messages_received - 1] > table->sent[0])
+	{
+		unsigned long long duration = table->receives[messages_received - 1] - table->sent[0];
+		log_message("Throughput: %.2f QpS (goodput %.2f QpS).\n",
+		            (double) messages_received*NANOSECONDS/duration,
+		            (double) stats->responses.good*NANOSECONDS/duration);
 	}
 
-	fprintf(mdig_options.output, "],\n \"receives\":\n\t[");
-	if (count > 0)
+	// Delay is the time distance between sent and received count lines.
+	double send_intercept;
+	double send_rate;
+	double receive_intercept;
+	double receive_rate;
+	if (messages_sent > 0 && get_rate_fit(send_fit, table->sent[0], &send_intercept, &send_rate) == 0)
 	{
-		unsigned long long timestamp;
-		for (i = 0; i < count - 1; i++)
+		if (get_rate_fit(receive_fit, table->sent[0], &receive_intercept, &receive_rate) == 0)
 		{
-			timestamp = receives[i].tv_sec;
-			timestamp *= NANOSECONDS;
-			timestamp += receives[i].tv_nsec;
-
-			fprintf(mdig_options.output,
-			        "\n\t\t%llu,", timestamp);
+			log_message("Fitted rates:\n"
+			            "\tSending..: %.2f QpS;\n"
+			            "\tReceiving: %.2f QpS (delay %.3f ms).\n\n",
+			            send_rate, receive_rate,
+			            (send_intercept + sends_before - receive_intercept - receives_before)/receive_rate*1e3);
 		}
+		else log_message("Fitted rates:\n\tSending..: %.2f QpS.\n\n", send_rate);
+	}
 
-		timestamp = receives[i].tv_sec;
-		timestamp *= NANOSECONDS;
-		timestamp += receives[i].tv_nsec;
+	log_message("Latency (ns, from actual send / from intended send):\n"
+	            "\tp50....: %llu / %llu;\n"
+	            "\tp99....: %llu / %llu;\n"
+	            "\tp99.9..: %llu / %llu;\n"
+	            "\tMax....: %llu / %llu.\n\n",
+	            get_histogram_percentile(&summary->actual, 50.0),
+	            get_histogram_percentile(&summary->intended, 50.0),
+	            get_histogram_percentile(&summary->actual, 99.0),
+	            get_histogram_percentile(&summary->intended, 99.0),
+	            get_histogram_percentile(&summary->actual, 99.9),
+	            get_histogram_percentile(&summary->intended, 99.9),
+	            summary->actual.max, summary->intended.max);
 
-		fprintf(mdig_options.output,
-		        "\n\t\t%llu\n\t", timestamp);
+	size_t i;
+	size_t reads = 0;
+	for (i = 0; i < run.pool.count; i++) reads += run.pool.stats[i].reads;
+
+	struct generator_stats generator;
+	get_generator_stats(stats, &generator);
+	log_message("Generator:\n"
+	            "\tLag.....: %llu ns mean, %llu ns max;\n"
+	            "\tBusy....: %.1f%% max;\n"
+	            "\tDrops...: %lu;\n"
+	            "\tReads...: %lu (%.2f replies per read);\n"
+	            "\tLimited.: %lu of %lu intervals.\n\n",
+	            generator.mean_lag, generator.max_lag, 100*generator.max_busy, generator.drops,
+	            reads, reads > 0? (double) messages_received/reads : 0.0,
+	            generator.limited, stats->interval_count);
+	if (generator.limited > 0)
+	{
+		log_error("Warning: the tool itself has been the bottleneck in %lu intervals, "
+		          "results there show its limits rather than limits of the server.", generator.limited);
 	}
 
-	fprintf(mdig_options.output, "],\n \"pairs\":\n\t[");
-	if (count > 0)
+	struct ab_stats ab;
+	int got_ab = is_ab_distribution(mdig_options.targets.distribution);
+	if (got_ab)
 	{
-		unsigned long long sent;
-		for (i = 0; i < count - 1; i++)
-		{
-			sent = pairs[i].sent.tv_sec;
-			sent *= NANOSECONDS;
-			sent += pairs[i].sent.tv_nsec;
-
-			if (pairs[i].answer > 0)
-			{
-				unsigned long long received = pairs[i].received.tv_sec;
-				received *= NANOSECONDS;
-				received += pairs[i].received.tv_nsec;
-
-				fprintf(mdig_options.output,
-				        "\n\t\t[%llu, %llu, %lld],", sent, received, received - sent);
-			}
-			else
-			{
-				fprintf(mdig_options.output,
-				        "\n\t\t[%llu],", sent);
-			}
-		}
-
-		sent = pairs[i].sent.tv_sec;
-		sent *= NANOSECONDS;
-		sent += pairs[i].sent.tv_nsec;
+		get_ab_stats(table, &mdig_options.targets, messages_sent, &ab);
+
+		double a = ab.latency.count > 0? ab.latency.a/ab.latency.count : 0;
+		double difference = get_mean_difference(&ab.latency);
+		log_message("A/B (B - A, 95%% confidence):\n"
+		            "\tPairs..: %lu;\n"
+		            "\tLatency: %+.0f ns +- %.0f (%+.2f%%);\n"
+		            "\tLoss...: %+.4f%% +- %.4f.\n\n",
+		            ab.pairs, difference, get_difference_margin(&ab.latency), a > 0? 100*difference/a : 0,
+		            100*get_mean_difference(&ab.loss), 100*get_difference_margin(&ab.loss));
+	}
 
-		if (pairs[i].answer > 0)
-		{
-			unsigned long long received = pairs[i].received.tv_sec;
-			received *= NANOSECONDS;
-			received += pairs[i].received.tv_nsec;
+	if (mdig_options.top > 0)
+	{
+		if (get_domain_report(&domains, mdig_options.top, &report) != 0) goto cleanup;
 
-			fprintf(mdig_options.output,
-			        "\n\t\t[%llu, %llu, %lld]\n\t", sent, received, received - sent);
-		}
-		else
-		{
-			fprintf(mdig_options.output,
-			        "\n\t\t[%llu]\n\t", sent);
-		}
+		log_domain_report(&domains, &report);
 	}
 
-	fprintf(mdig_options.output, "]\n}\n");
+	write_output(mdig_options.output, table, messages_sent, messages_received, latencies,
+	             &sender->sends, &receiver->receives, stats, &run.pool, &mdig_options.targets, got_ab? &ab : NULL,
+	             &domains, mdig_options.top > 0? &report : NULL, mdig_options.floor > 0? &floor : NULL,
+	             mdig_options.steady > 0? &steady : NULL);
+
+	log_message("Exiting...");
+	result = 0;
+
+cleanup:
+	close_socket_pool(&run.pool);
+	free(receiver->buffer);
+	free(sender->stats.intervals);
+	free(receiver->stats.intervals);
+	free(sender->queries);
+	free_timer_wheel(&sender->timers);
+	free_query_table(table);
+	free(queries);
+	free(mdig_options.domains);
+	free_target_set(&mdig_options.targets);
+	free_query_variation(&mdig_options.variation);
+	free_domain_set(&domains);
+	free_domain_report(&report);
+	if (mdig_options.got_replay) free_pcap_queries(&mdig_options.replay);
 	if (mdig_options.output != stdout)
 	{
 		fclose(mdig_options.output);
 		mdig_options.output = stdout;
 	}
 
-	log_message("Exiting...");
-	return 0;
+	return result;
 }
-
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcap.h"
+#include "logger.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_SWAPPED 0xd4c3b2a1
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_MAGIC_NSEC_SWAPPED 0x4d3cb2a1
+
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+#define PCAP_SNAPLEN_LIMIT (256*1024)
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_RAW_BSD 12
+#define LINKTYPE_RAW_BSD_OTHER 14
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+
+#define IPPROTO_UDP_NUMBER 17
+#define UDP_HEADER_SIZE 8
+#define DNS_HEADER_SIZE 12
+#define DNS_FLAG_RESPONSE 0x80
+
+#define BUFFER_INITIAL_SIZE (1024*1024)
+#define TIMESTAMPS_INITIAL_COUNT 4096
+
+#define NANOSECONDS 1000000000ULL
+
+static unsigned int get_uint32(const unsigned char *data, int swapped)
+{
+	if (swapped) return (unsigned int) data[3] << 24 | data[2] << 16 | data[1] << 8 | data[0];
+
+	return (unsigned int) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static unsigned short get_uint16(const unsigned char *data)
+{
+	return data[0] << 8 | data[1];
+}
+
+static int get_network_protocol(unsigned int linktype, const unsigned char **packet, size_t *length)
+{
+	unsigned short ethertype;
+	const unsigned char *data = *packet;
+
+	switch (linktype)
+	{
+		case LINKTYPE_NULL:
+		case LINKTYPE_LOOP:
+			if (*length < 5) return -1;
+			*packet += 4;
+			*length -= 4;
+
+			return ((data[4] >> 4) == 6)? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+
+		case LINKTYPE_RAW:
+		case LINKTYPE_RAW_BSD:
+		case LINKTYPE_RAW_BSD_OTHER:
+			if (*length < 1) return -1;
+			return ((data[0] >> 4) == 6)? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+
+		case LINKTYPE_ETHERNET:
+			if (*length < 14) return -1;
+			ethertype = get_uint16(data + 12);
+			*packet += 14;
+			*length -= 14;
+
+			while (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ)
+			{
+				if (*length < 4) return -1;
+				ethertype = get_uint16(*packet + 2);
+				*packet += 4;
+				*length -= 4;
+			}
+
+			return ethertype;
+
+		case LINKTYPE_LINUX_SLL:
+			if (*length < 16) return -1;
+			*packet += 16;
+			*length -= 16;
+
+			return get_uint16(data + 14);
+
+		case LINKTYPE_LINUX_SLL2:
+			if (*length < 20) return -1;
+			*packet += 20;
+			*length -= 20;
+
+			return get_uint16(data);
+	}
+
+	return -1;
+}
+
+static int get_udp_payload(unsigned int linktype, const unsigned char *packet, size_t length,
+                           const unsigned char **payload, size_t *payload_length)
+{
+	int protocol = get_network_protocol(linktype, &packet, &length);
+	if (protocol == ETHERTYPE_IPV4)
+	{
+		if (length < 20 || (packet[0] >> 4) != 4) return -1;
+
+		size_t header_length = (packet[0] & 0x0f)*4;
+		size_t total_length = get_uint16(packet + 2);
+		if (header_length < 20 || total_length < header_length || total_length > length) return -1;
+		if (packet[9] != IPPROTO_UDP_NUMBER) return -1;
+
+		// Skip fragments: only first fragment has UDP header and it's incomplete anyway.
+		if (get_uint16(packet + 6) & 0x3fff) return -1;
+
+		packet += header_length;
+		length = total_length - header_length;
+	}
+	else if (protocol == ETHERTYPE_IPV6)
+	{
+		if (length < 40 || (packet[0] >> 4) != 6) return -1;
+		if (packet[6] != IPPROTO_UDP_NUMBER) return -1;
+
+		size_t payload_size = get_uint16(packet + 4);
+		if (payload_size > length - 40) return -1;
+
+		packet += 40;
+		length = payload_size;
+	}
+	else return -1;
+
+	if (length < UDP_HEADER_SIZE) return -1;
+	if (get_uint16(packet + 2) != PCAP_DNS_PORT) return -1;
+
+	size_t udp_length = get_uint16(packet + 4);
+	if (udp_length < UDP_HEADER_SIZE || udp_length > length) return -1;
+
+	*payload = packet + UDP_HEADER_SIZE;
+	*payload_length = udp_length - UDP_HEADER_SIZE;
+
+	return 0;
+}
+
+static int append_query(struct pcap_queries *queries, size_t *capacity, size_t *timestamps_capacity,
+                        const unsigned char *payload, size_t length, unsigned long long timestamp)
+{
+	size_t needed = queries->size + sizeof(size_t) + length;
+	if (needed > *capacity)
+	{
+		size_t new_capacity = *capacity;
+		while (new_capacity < needed) new_capacity *= 2;
+
+		char *buffer = realloc(queries->buffer, new_capacity);
+		if (buffer == NULL)
+		{
+			log_errno("Can't grow replay buffer to %lu bytes.", new_capacity);
+			return -1;
+		}
+
+		queries->buffer = buffer;
+		*capacity = new_capacity;
+	}
+
+	if (queries->count >= *timestamps_capacity)
+	{
+		size_t new_capacity = 2*(*timestamps_capacity);
+		unsigned long long *timestamps = realloc(queries->timestamps, new_capacity*sizeof(unsigned long long));
+		if (timestamps == NULL)
+		{
+			log_errno("Can't grow replay timestamps to %lu bytes.", new_capacity*sizeof(unsigned long long));
+			return -1;
+		}
+
+		queries->timestamps = timestamps;
+		*timestamps_capacity = new_capacity;
+	}
+
+	memcpy(queries->buffer + queries->size, &length, sizeof(size_t));
+	memcpy(queries->buffer + queries->size + sizeof(size_t), payload, length);
+	queries->size = needed;
+
+	queries->timestamps[queries->count] = timestamp;
+	queries->count++;
+
+	return 0;
+}
+
+int read_pcap_queries(const char *name, struct pcap_queries *queries)
+{
+	memset(queries, 0, sizeof(*queries));
+
+	FILE *f = fopen(name, "rb");
+	if (f == NULL)
+	{
+		log_errno("Can't open capture file %s.", name);
+		return -1;
+	}
+
+	unsigned char header[PCAP_HEADER_SIZE];
+	if (fread(header, 1, sizeof(header), f) != sizeof(header))
+	{
+		log_error("Can't read capture file header of %s.", name);
+		fclose(f);
+		return -1;
+	}
+
+	int swapped;
+	unsigned long long fraction;
+	switch (get_uint32(header, 0))
+	{
+		case PCAP_MAGIC: swapped = 0; fraction = 1000; break;
+		case PCAP_MAGIC_SWAPPED: swapped = 1; fraction = 1000; break;
+		case PCAP_MAGIC_NSEC: swapped = 0; fraction = 1; break;
+		case PCAP_MAGIC_NSEC_SWAPPED: swapped = 1; fraction = 1; break;
+
+		default:
+			log_error("File %s isn't a pcap capture (pcapng isn't supported).", name);
+			fclose(f);
+			return -1;
+	}
+
+	unsigned int linktype = get_uint32(header + 20, swapped) & 0x0fffffff;
+
+	size_t capacity = BUFFER_INITIAL_SIZE;
+	size_t timestamps_capacity = TIMESTAMPS_INITIAL_COUNT;
+	queries->buffer = malloc(capacity);
+	queries->timestamps = malloc(timestamps_capacity*sizeof(unsigned long long));
+	unsigned char *packet = malloc(PCAP_SNAPLEN_LIMIT);
+	if (queries->buffer == NULL || queries->timestamps == NULL || packet == NULL)
+	{
+		log_errno("Can't allocate buffers to read capture.");
+		free(packet);
+		free_pcap_queries(queries);
+		fclose(f);
+		return -1;
+	}
+
+	size_t packets = 0;
+	unsigned long long first = 0;
+	unsigned long long last = 0;
+	size_t reordered = 0;
+	unsigned char record[PCAP_RECORD_HEADER_SIZE];
+	while (fread(record, 1, sizeof(record), f) == sizeof(record))
+	{
+		unsigned long long timestamp = get_uint32(record, swapped);
+		timestamp = timestamp*NANOSECONDS + get_uint32(record + 4, swapped)*fraction;
+		size_t length = get_uint32(record + 8, swapped);
+		if (length > PCAP_SNAPLEN_LIMIT)
+		{
+			log_error("Packet %lu in %s is too big (%lu bytes).", packets + 1, name, length);
+			goto error;
+		}
+
+		if (fread(packet, 1, length, f) != length)
+		{
+			log_error("Capture %s is truncated at packet %lu.", name, packets + 1);
+			break;
+		}
+
+		packets++;
+
+		const unsigned char *payload;
+		size_t payload_length;
+		if (get_udp_payload(linktype, packet, length, &payload, &payload_length) != 0) continue;
+		if (payload_length < DNS_HEADER_SIZE || (payload[2] & DNS_FLAG_RESPONSE)) continue;
+
+		// Captures merged from several interfaces may go back in time. Queries
+		// keep the order of the file and one which is earlier than the previous
+		// is sent together with it, so the schedule (and send times of the run
+		// searched by time) never decrease.
+		if (queries->count == 0) first = timestamp;
+
+		unsigned long long offset = timestamp > first? timestamp - first : 0;
+		if (offset < last)
+		{
+			offset = last;
+			reordered++;
+		}
+
+		last = offset;
+		if (append_query(queries, &capacity, &timestamps_capacity, payload, payload_length, offset) != 0) goto error;
+	}
+
+	free(packet);
+	fclose(f);
+
+	if (queries->count == 0)
+	{
+		log_error("No DNS queries found in %s (%lu packets).", name, packets);
+		free_pcap_queries(queries);
+		return -1;
+	}
+
+	log_message("Read %lu queries out of %lu packets from %s.", queries->count, packets, name);
+	if (reordered > 0)
+	{
+		log_message("Moved %lu queries captured out of order to the time of the previous one.", reordered);
+	}
+	return 0;
+
+error:
+	free(packet);
+	free_pcap_queries(queries);
+	fclose(f);
+	return -1;
+}
+
+void free_pcap_queries(struct pcap_queries *queries)
+{
+	free(queries->timestamps);
+	free(queries->buffer);
+
+	queries->timestamps = NULL;
+	queries->buffer = NULL;
+	queries->count = 0;
+	queries->size = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __PCAP_H__
+#define __PCAP_H__
+
+#include <stddef.h>
+
+#define PCAP_DNS_PORT 53
+
+struct pcap_queries
+{
+	size_t count;
+	size_t size;
+
+	// Sequence of size_t length followed by DNS payload (like make_queries).
+	char *buffer;
+	// Capture time of each query in nanoseconds relative to the first one,
+	// never less than the time of the previous query.
+	unsigned long long *timestamps;
+};
+
+int read_pcap_queries(const char *name, struct pcap_queries *queries);
+void free_pcap_queries(struct pcap_queries *queries);
+
+#endif // __PCAP_H__
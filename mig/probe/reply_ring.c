@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "reply_ring.h"
+#include "logger.h"
+
+int make_reply_ring(size_t count, struct reply_ring *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+
+	size_t size = 1;
+	while (size < count) size <<= 1;
+
+	void *slots;
+	int errnum = posix_memalign(&slots, REPLY_CACHE_LINE, size*sizeof(struct reply_slot));
+	if (errnum != 0)
+	{
+		log_errno_ex(errnum, "Can't allocate reply ring of %lu slots.", size);
+		return -1;
+	}
+
+	ring->mask = size - 1;
+	ring->slots = (struct reply_slot *) slots;
+
+	size_t i;
+	for (i = 0; i < size; i++)
+	{
+		ring->slots[i].sequence = i;
+		ring->slots[i].size = 0;
+	}
+
+	return 0;
+}
+
+void free_reply_ring(struct reply_ring *ring)
+{
+	free(ring->slots);
+
+	ring->slots = NULL;
+	ring->mask = 0;
+}
+
+struct reply_slot *reserve_reply_slot(struct reply_ring *ring)
+{
+	unsigned long long position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (1)
+	{
+		struct reply_slot *slot = &ring->slots[position & ring->mask];
+		unsigned long long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		long long difference = (long long) (sequence - position);
+
+		// Slot is free for this lap: claim the position, failed claim reloads it.
+		if (difference == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->tail, &position, position + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return slot;
+		}
+		else if (difference < 0) return NULL;
+		else position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+}
+
+void commit_reply_slot(struct reply_slot *slot)
+{
+	__atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+int push_reply(struct reply_ring *ring, unsigned int address, unsigned short port, const void *data, size_t size)
+{
+	if (size > REPLY_DATA_SIZE) return -1;
+
+	struct reply_slot *slot = reserve_reply_slot(ring);
+	if (slot == NULL) return -1;
+
+	slot->address = address;
+	slot->port = port;
+	slot->size = (unsigned short) size;
+	memcpy(slot->data, data, size);
+
+	commit_reply_slot(slot);
+	return 0;
+}
+
+struct reply_slot *get_reply_slot(struct reply_ring *ring, size_t offset)
+{
+	unsigned long long position = ring->head + offset;
+	struct reply_slot *slot = &ring->slots[position & ring->mask];
+
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) return NULL;
+
+	return slot;
+}
+
+void release_reply_slots(struct reply_ring *ring, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		struct reply_slot *slot = &ring->slots[ring->head & ring->mask];
+		__atomic_store_n(&slot->sequence, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+		ring->head++;
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef __REPLY_RING_H__
+#define __REPLY_RING_H__
+
+#include <stddef.h>
+
+// Bounded ring of fixed size reply slots with per slot sequence numbers
+// (Vyukov's queue): any number of threads may reserve and commit slots,
+// one thread consumes them in order, no locks on either side. A reserved
+// slot has to be committed, with zero size if it isn't used after all.
+// Client is kept as IPv4 address and port in network order instead of
+// sockaddr, so slot header fits together with the sequence into 16 bytes
+// and the rest holds any classic (512 bytes) DNS message. Slots are kept
+// small as every reply touches a new one and bigger ones fall out of cache.
+#define REPLY_SLOT_SIZE 576
+#define REPLY_HEADER_SIZE 16
+#define REPLY_DATA_SIZE (REPLY_SLOT_SIZE - REPLY_HEADER_SIZE)
+#define REPLY_CACHE_LINE 64
+
+struct reply_slot
+{
+	unsigned long long sequence;
+	unsigned int address;
+	unsigned short port;
+	unsigned short size;
+
+	char data[REPLY_DATA_SIZE];
+} __attribute__((aligned(REPLY_CACHE_LINE)));
+
+struct reply_ring
+{
+	size_t mask;
+	struct reply_slot *slots;
+
+	// Producers and consumer positions on their own cache lines.
+	unsigned long long tail __attribute__((aligned(REPLY_CACHE_LINE)));
+	unsigned long long head __attribute__((aligned(REPLY_CACHE_LINE)));
+};
+
+// Count is rounded up to a power of two.
+int make_reply_ring(size_t count, struct reply_ring *ring);
+void free_reply_ring(struct reply_ring *ring);
+
+// Producer side, returns NULL when the ring is full.
+struct reply_slot *reserve_reply_slot(struct reply_ring *ring);
+void commit_reply_slot(struct reply_slot *slot);
+int push_reply(struct reply_ring *ring, unsigned int address, unsigned short port, const void *data, size_t size);
+
+// Consumer side: committed slot at the offset from the head (NULL when it
+// isn't committed yet) and release of the given number of slots at the head.
+struct reply_slot *get_reply_slot(struct reply_ring *ring, size_t offset);
+void release_reply_slots(struct reply_ring *ring, size_t count);
+
+#endif // __REPLY_RING_H__
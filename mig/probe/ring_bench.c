@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "logger.h"
+#include "clock.h"
+#include "message_queue.h"
+#include "reply_ring.h"
+
+// Throughput of the byte packed message queue against the reply ring: both
+// single threaded in batches, then ring with producer and consumer threads.
+#define DEFAULT_COUNT 10000000
+#define MESSAGE_SIZE 64
+#define BATCH 64
+#define RING_SLOTS 4096
+#define QUEUE_SIZE (RING_SLOTS*REPLY_SLOT_SIZE)
+#define MAX_PRODUCERS 4
+// Threads waiting for each other give up the CPU after this many attempts,
+// so the benchmark works on machines with fewer cores than threads too.
+#define SPIN_LIMIT 1000
+
+#define NANOSECONDS 1000000000ULL
+
+struct producer
+{
+	struct reply_ring *ring;
+	unsigned long long first;
+	unsigned long long count;
+};
+
+static void report(const char *name, unsigned long long count, unsigned long long begin, unsigned long long end)
+{
+	double seconds = (double) (end - begin)/NANOSECONDS;
+	printf("%-28s %10.2f M/s %8.1f ns/message\n", name, count/seconds/1e6, (double) (end - begin)/count);
+}
+
+static int bench_queue(unsigned long long count)
+{
+	struct message_queue queue;
+	if (make_message_queue(QUEUE_SIZE, &queue) != 0) return -1;
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+
+	char message[MESSAGE_SIZE];
+	memset(message, 0, sizeof(message));
+
+	unsigned long long sum = 0;
+	unsigned long long begin;
+	unsigned long long end;
+	if (get_timestamp(&begin) != 0) return -1;
+
+	unsigned long long i;
+	for (i = 0; i < count; i += BATCH)
+	{
+		unsigned long long j;
+		for (j = i; j < i + BATCH && j < count; j++)
+		{
+			memcpy(message, &j, sizeof(j));
+			if (push_message(&queue, (struct sockaddr *) &address, sizeof(address), message, sizeof(message)) != 0)
+			{
+				log_error("Message queue overflow.");
+				free(queue.buffer);
+				return -1;
+			}
+		}
+
+		while (!IS_QUEUE_EMPTY(queue))
+		{
+			struct sockaddr *client;
+			socklen_t client_length;
+			void *data;
+			size_t size;
+			void *head;
+
+			get_message(&queue, &head, &client, &client_length, &data, &size);
+
+			unsigned long long value;
+			memcpy(&value, data, sizeof(value));
+			sum += value;
+
+			queue.head = head;
+		}
+	}
+
+	if (get_timestamp(&end) != 0) return -1;
+
+	free(queue.buffer);
+	if (sum != count*(count - 1)/2)
+	{
+		log_error("Message queue lost messages.");
+		return -1;
+	}
+
+	report("message_queue (1 thread)", count, begin, end);
+	return 0;
+}
+
+static unsigned long long consume(struct reply_ring *ring, unsigned long long count)
+{
+	unsigned long long sum = 0;
+	unsigned long long i;
+	for (i = 0; i < count; i++)
+	{
+		struct reply_slot *slot;
+		int spins = 0;
+		while ((slot = get_reply_slot(ring, 0)) == NULL)
+		{
+			if (++spins % SPIN_LIMIT == 0) sched_yield();
+		}
+
+		unsigned long long value;
+		memcpy(&value, slot->data, sizeof(value));
+		sum += value;
+
+		release_reply_slots(ring, 1);
+	}
+
+	return sum;
+}
+
+static void *produce(void *context)
+{
+	struct producer *producer = (struct producer *) context;
+
+	char message[MESSAGE_SIZE];
+	memset(message, 0, sizeof(message));
+
+	unsigned long long i;
+	for (i = producer->first; i < producer->first + producer->count; i++)
+	{
+		memcpy(message, &i, sizeof(i));
+
+		int spins = 0;
+		while (push_reply(producer->ring, 0, 0, message, sizeof(message)) != 0)
+		{
+			if (++spins % SPIN_LIMIT == 0) sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static int bench_ring(unsigned long long count)
+{
+	struct reply_ring ring;
+	if (make_reply_ring(RING_SLOTS, &ring) != 0) return -1;
+
+	struct producer producer = {&ring, 0, 0};
+	unsigned long long sum = 0;
+	unsigned long long begin;
+	unsigned long long end;
+	if (get_timestamp(&begin) != 0) return -1;
+
+	unsigned long long i;
+	for (i = 0; i < count; i += BATCH)
+	{
+		producer.first = i;
+		producer.count = (i + BATCH < count)? BATCH : count - i;
+		produce(&producer);
+		sum += consume(&ring, producer.count);
+	}
+
+	if (get_timestamp(&end) != 0) return -1;
+
+	free_reply_ring(&ring);
+	if (sum != count*(count - 1)/2)
+	{
+		log_error("Reply ring lost messages.");
+		return -1;
+	}
+
+	report("reply_ring (1 thread)", count, begin, end);
+	return 0;
+}
+
+static int bench_threads(unsigned long long count, size_t producers)
+{
+	struct reply_ring ring;
+	if (make_reply_ring(RING_SLOTS, &ring) != 0) return -1;
+
+	pthread_t threads[MAX_PRODUCERS];
+	struct producer contexts[MAX_PRODUCERS];
+
+	unsigned long long begin;
+	unsigned long long end;
+	if (get_timestamp(&begin) != 0) return -1;
+
+	size_t i;
+	for (i = 0; i < producers; i++)
+	{
+		contexts[i].ring = &ring;
+		contexts[i].first = i*(count/producers);
+		contexts[i].count = (i + 1 < producers)? count/producers : count - i*(count/producers);
+
+		int errnum = pthread_create(&threads[i], NULL, produce, &contexts[i]);
+		if (errnum != 0)
+		{
+			log_errno_ex(errnum, "Can't start producer thread.");
+			return -1;
+		}
+	}
+
+	unsigned long long sum = consume(&ring, count);
+	for (i = 0; i < producers; i++) pthread_join(threads[i], NULL);
+
+	if (get_timestamp(&end) != 0) return -1;
+
+	free_reply_ring(&ring);
+	if (sum != count*(count - 1)/2)
+	{
+		log_error("Reply ring lost messages.");
+		return -1;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "reply_ring (%lu to 1 threads)", producers);
+	report(name, count, begin, end);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long count = DEFAULT_COUNT;
+	if (argc > 1 && (sscanf(argv[1], "%llu", &count) != 1 || count == 0))
+	{
+		printf("Usage: ring_bench [messages]\n");
+		return 1;
+	}
+
+	printf("%llu messages of %d bytes:\n", count, MESSAGE_SIZE);
+	if (bench_queue(count) != 0 || bench_ring(count) != 0) return 1;
+	if (bench_threads(count, 1) != 0 || bench_threads(count, 2) != 0) return 1;
+
+	return 0;
+}
@@ -6,19 +6,17 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <signal.h>
 
 #include "logger.h"
-#include "message_queue.h"
-
-#ifdef CLOCK_MONOTONIC_RAW
-	#define CLOCK_SOURCE CLOCK_MONOTONIC_RAW
-#else
-	#define CLOCK_SOURCE CLOCK_MONOTONIC
-#endif
+#include "reply_ring.h"
+#include "clock.h"
+#include "zone.h"
+#include "upstream.h"
 
 #ifdef SIGINFO
 	#define SIGDUMPTIMESTAMPS SIGINFO
@@ -26,14 +24,23 @@
 	#define SIGDUMPTIMESTAMPS SIGUSR1
 #endif
 
-#define NANOSECONDS 1000000000
-
-#define RECEIVE_BUFFER_SIZE 65535
 #define SEND_BUFFER_SIZE 65535
-#define SEND_QUEUE_SIZE 100*1024*1024
+#define SEND_QUEUE_SLOTS (32*1024)
+
+// Kernel limits of one segmented send: number of segments and UDP payload over IPv4.
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_SIZE 65507
 
 #define TIMESTAMPS_MAXLENGTH 10000000
 
+// Nanoseconds between logs of upstream counters while the server is busy.
+#define UPSTREAM_REPORT_INTERVAL 1000000000ULL
+
+// The same A record to every A query: pointer to the question name, class IN,
+// TTL of one hour and address 1.2.3.4.
+#define ANSWER_RECORD "\xc0\x0c\x00\x01\x00\x01\x00\x00\x0e\x10\x00\x04\x01\x02\x03\x04"
+#define ANSWER_RECORD_SIZE 16
+
 #ifndef STDIN_FILENO
 	#define STDIN_FILENO 0
 #endif
@@ -75,115 +82,175 @@ struct dns_query
 	unsigned short additional;
 };
 
-void make_refused_answer(void *query, size_t query_size, void *answer, size_t *answer_size)
+// Answers are made in place: the query is received straight into its reply
+// slot, header flags are patched, answer records are spliced in after the
+// question and whatever follows the question (OPT record of EDNS queries)
+// is moved behind them. Capacity is the size of the slot.
+void make_refused_answer(void *message, size_t query_size, size_t *answer_size)
 {
-	memcpy(answer, query, query_size);
 	*answer_size = query_size;
 
-	struct dns_query *header = (struct dns_query *) answer;
+	struct dns_query *header = (struct dns_query *) message;
 	header->flags = (0x7079 & header->flags) | 0x0580;
 }
 
-int make_answer(void *query, size_t query_size, void *answer, size_t *answer_size)
+// Header only reply to queries which can't be parsed or didn't fit into the
+// slot, sections of such query can't be echoed back.
+void make_format_error_answer(void *message, size_t *answer_size)
 {
-	if (query_size < sizeof(struct dns_query))
-	{
-		log_error("Expected query size at least of DNS query header size (%lu) but got only %lu.",
-		          sizeof(struct dns_query), query_size);
-		return -1;
-	}
+	*answer_size = sizeof(struct dns_query);
+
+	struct dns_query *header = (struct dns_query *) message;
+	header->flags = (0x7079 & header->flags) | 0x0180;
+	header->questions = 0;
+	header->answers = 0;
+	header->authorities = 0;
+	header->additional = 0;
+}
 
-	struct dns_query *header = (struct dns_query *) query;
+// Without zone every A query gets the same record and other types are refused.
+void make_answer(void *message, size_t query_size, size_t capacity, const struct zone *zone, size_t *answer_size)
+{
+	struct dns_query *header = (struct dns_query *) message;
 
 	unsigned short flags = header->flags;
 	if (flags & 0x1f00)
 	{
-		make_refused_answer(query, query_size, answer, answer_size);
-		return 0;
+		make_refused_answer(message, query_size, answer_size);
+		return;
 	}
 
 	if (header->questions != 0x100)
 	{
-		make_refused_answer(query, query_size, answer, answer_size);
-		return 0;
+		make_refused_answer(message, query_size, answer_size);
+		return;
 	}
 
 	if (header->answers != 0)
 	{
-		make_refused_answer(query, query_size, answer, answer_size);
-		return 0;
+		make_refused_answer(message, query_size, answer_size);
+		return;
 	}
 
 	if (header->authorities != 0)
 	{
-		make_refused_answer(query, query_size, answer, answer_size);
-		return 0;
+		make_refused_answer(message, query_size, answer_size);
+		return;
 	}
 
-	char *src = (char *) query;
+	char *question = (char *) message + sizeof(struct dns_query);
 
-	size_t name_size = strlen(src + sizeof(struct dns_query)) + 1;
+	size_t name_size = get_name_size((unsigned char *) question, query_size - sizeof(struct dns_query));
 	size_t question_size = name_size + 2*sizeof(unsigned short);
-	size_t before_answer_size =  sizeof(struct dns_query) + question_size;
-	if (query_size < before_answer_size)
+	size_t before_answer_size = sizeof(struct dns_query) + question_size;
+	if (name_size == 0 || query_size < before_answer_size)
 	{
-		log_error("Expected query size at least of DNS query header size and question section size (%lu) "
-		          "but got only %lu.",
-		          before_answer_size, query_size);
-		return -1;
+		make_format_error_answer(message, answer_size);
+		return;
 	}
 
-	unsigned short *query_type = (unsigned short *) (src + sizeof(struct dns_query) + name_size);
-	if (*query_type != 0x100)
+	unsigned short query_type;
+	unsigned short query_class;
+	memcpy(&query_type, question + name_size, sizeof(query_type));
+	memcpy(&query_class, question + name_size + sizeof(query_type), sizeof(query_class));
+
+	struct zone_answer answer = {1, ANSWER_RECORD, ANSWER_RECORD_SIZE};
+	if (zone == NULL)
 	{
-		make_refused_answer(query, query_size, answer, answer_size);
-		return 0;
+		if (query_type != 0x100)
+		{
+			make_refused_answer(message, query_size, answer_size);
+			return;
+		}
 	}
+	else
+	{
+		if (query_class != 0x100)
+		{
+			make_refused_answer(message, query_size, answer_size);
+			return;
+		}
 
-	char *dest = (char *) answer;
-
-	memcpy(dest, src, before_answer_size);
-	header = (struct dns_query *) dest;
-	header->flags = (0x7079 & header->flags) | 0x0084;
-	header->answers = htons(1);
-
-	dest += before_answer_size;
-	src += before_answer_size;
+		if (find_answer(zone, (unsigned char *) question, name_size, query_type, &answer) == ZONE_NXDOMAIN)
+		{
+			header->flags = (0x7079 & header->flags) | 0x0384;
+			*answer_size = query_size;
+			return;
+		}
+	}
 
-	memcpy(dest, "\xc0\x0c\x00\x01\x00\x01\x00\x00\x0e\x10\x00\x04\x01\x02\x03\x04", 16);
-	dest += 16;
+	// Answer bigger than the slot is truncated to nothing, the client may retry over TCP.
+	if (query_size + answer.size > capacity)
+	{
+		header->flags = (0x7079 & header->flags) | 0x0086;
+		*answer_size = query_size;
+		return;
+	}
 
-	if (query_size > before_answer_size) memcpy(dest, src, query_size - before_answer_size);
+	header->flags = (0x7079 & header->flags) | 0x0084;
+	header->answers = htons(answer.count);
 
-	*answer_size = query_size + 16;
+	char *records = (char *) message + before_answer_size;
+	if (query_size > before_answer_size) memmove(records + answer.size, records, query_size - before_answer_size);
+	memcpy(records, answer.data, answer.size);
 
-	return 0;
+	*answer_size = query_size + answer.size;
 }
 
 void usage(void)
 {
 	printf("server - dummy DNS performance measurement server\n"
-	       "         only responds to A query with the same A record)\n\n"
+	       "         only responds to A query with the same A record or from zone file)\n\n"
 	       "Usage: server <options>\n\n"
 	       "Options:\n"
-	       "\t-a, --address - IPv4 address to listen on (required);\n"
-	       "\t-p, --port    - port (default 53);\n"
-	       "\t-o, --output  - report send and receive timestamps to given file (limited to 10.000.000 items);\n"
-	       "\t-h, --help    - this message.\n");
+	       "\t-a, --address   - IPv4 address to listen on (required);\n"
+	       "\t-p, --port      - port (default 53);\n"
+	       "\t-o, --output    - report send and receive timestamps to given file (limited to 10.000.000 items);\n"
+	       "\t-z, --zone      - answer from records of given zone file (NXDOMAIN for missing names);\n"
+	       "\t-d, --delay     - hold replies for delays of given distribution in milliseconds: fixed:<delay>,\n"
+	       "\t                  uniform:<min>:<max>, lognormal:<median>:<sigma> or empirical:<file with delays>;\n"
+	       "\t-l, --loss      - drop given percent of replies;\n"
+	       "\t-u, --duplicate - send given percent of replies twice;\n"
+	       "\t-r, --reorder   - hold given percent of replies for one more delay (1 ms without delay) to reorder them;\n"
+	       "\t-R, --rate      - serve replies at given rate per second, later ones wait in the queue (default 0 - no limit);\n"
+	       "\t-q, --queue     - number of replies which may wait for service (default - no limit but pool size);\n"
+	       "\t-P, --pool      - number of replies held at once (default - enough for the rate and the longest delay,\n"
+	       "\t                  at least 65536), later ones wait in the reply ring;\n"
+	       "\t-f, --overflow  - what to do with replies beyond the queue: drop (default) or servfail;\n"
+	       "\t-g, --gso       - send consecutive replies to the same client in one call (UDP_SEGMENT),\n"
+	       "\t                  can't be used with upstream emulation (above options);\n"
+	       "\t-t, --tsc       - take timestamps from invariant TSC calibrated against the monotonic clock (x86-64);\n"
+	       "\t-h, --help      - this message.\n");
 }
 
 struct server_options
 {
 	struct sockaddr_in address;
 	const char *output;
+	const char *zone;
+	struct upstream_options upstream;
+	size_t pool;
+	int gso;
+	int tsc;
 };
 
 static struct option long_options[] = {
-	{"help",    no_argument,       NULL, 'h'},
-	{"address", required_argument, NULL, 'a'},
-	{"port",    required_argument, NULL, 'p'},
-	{"output",  required_argument, NULL, 'o'},
-	{NULL,	    0,		       NULL, 0}
+	{"help",      no_argument,       NULL, 'h'},
+	{"address",   required_argument, NULL, 'a'},
+	{"port",      required_argument, NULL, 'p'},
+	{"output",    required_argument, NULL, 'o'},
+	{"zone",      required_argument, NULL, 'z'},
+	{"delay",     required_argument, NULL, 'd'},
+	{"loss",      required_argument, NULL, 'l'},
+	{"duplicate", required_argument, NULL, 'u'},
+	{"reorder",   required_argument, NULL, 'r'},
+	{"rate",      required_argument, NULL, 'R'},
+	{"queue",     required_argument, NULL, 'q'},
+	{"overflow",  required_argument, NULL, 'f'},
+	{"pool",      required_argument, NULL, 'P'},
+	{"gso",       no_argument,       NULL, 'g'},
+	{"tsc",       no_argument,       NULL, 't'},
+	{NULL,	      0,		 NULL, 0}
 };
 
 enum get_options_result
@@ -212,6 +279,35 @@ int get_port_value(char *string, unsigned short *port)
 	return 0;
 }
 
+int get_count_value(char *string, size_t *value)
+{
+	char *endptr = NULL;
+
+	errno = 0;
+	unsigned long count = strtoul(string, &endptr, 10);
+
+	if (endptr == string || *endptr != '\0' || errno != 0 || *string == '-') return -1;
+
+	*value = (size_t) count;
+
+	return 0;
+}
+
+// Percent to probability.
+int get_percent_value(char *string, double *value)
+{
+	char *endptr = NULL;
+
+	errno = 0;
+	double percent = strtod(string, &endptr);
+
+	if (endptr == string || *endptr != '\0' || errno != 0 || percent < 0 || percent > 100) return -1;
+
+	*value = percent/100;
+
+	return 0;
+}
+
 enum get_options_result get_options(int argc, char *argv[], struct server_options *server_options)
 {
 	opterr = 0;
@@ -220,9 +316,17 @@ enum get_options_result get_options(int argc, char *argv[], struct server_option
 	server_options->address.sin_family = AF_INET;
 	server_options->address.sin_port = htons(53);
 	server_options->output = NULL;
+	server_options->zone = NULL;
+	memset(&server_options->upstream, 0, sizeof(server_options->upstream));
+	server_options->upstream.overflow = OVERFLOW_DROP;
+	server_options->pool = 0;
+	server_options->gso = 0;
+	server_options->tsc = 0;
 
 	int got_address = 0;
-	while ((option_char = getopt_long(argc, argv, "ha:p:o:", long_options, NULL)) != -1)
+	int got_queue = 0;
+	size_t count;
+	while ((option_char = getopt_long(argc, argv, "ha:p:o:z:d:l:u:r:R:q:f:P:gt", long_options, NULL)) != -1)
 	{
 		switch (option_char)
 		{
@@ -253,6 +357,100 @@ enum get_options_result get_options(int argc, char *argv[], struct server_option
 				server_options->output = optarg;
 				break;
 
+			case 'z':
+				server_options->zone = optarg;
+				break;
+
+			case 'd':
+				free_delay(&server_options->upstream.delay);
+				if (parse_delay(optarg, &server_options->upstream.delay) != 0)
+				{
+					printf("Invalid delay: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				break;
+
+			case 'l':
+				if (get_percent_value(optarg, &server_options->upstream.drop) != 0)
+				{
+					printf("Invalid loss percent: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				break;
+
+			case 'u':
+				if (get_percent_value(optarg, &server_options->upstream.duplicate) != 0)
+				{
+					printf("Invalid duplicate percent: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				break;
+
+			case 'r':
+				if (get_percent_value(optarg, &server_options->upstream.reorder) != 0)
+				{
+					printf("Invalid reorder percent: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				break;
+
+			case 'R':
+				if (get_count_value(optarg, &count) != 0)
+				{
+					printf("Invalid rate: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				server_options->upstream.rate = count;
+				break;
+
+			case 'q':
+				if (get_count_value(optarg, &server_options->upstream.queue) != 0)
+				{
+					printf("Invalid queue limit: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				got_queue = 1;
+				break;
+
+			case 'f':
+				if (strcmp(optarg, "drop") == 0) server_options->upstream.overflow = OVERFLOW_DROP;
+				else if (strcmp(optarg, "servfail") == 0) server_options->upstream.overflow = OVERFLOW_SERVFAIL;
+				else
+				{
+					printf("Invalid overflow action: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				break;
+
+			case 'P':
+				if (get_count_value(optarg, &server_options->pool) != 0 || server_options->pool == 0)
+				{
+					printf("Invalid pool size: \"%s\"\n\n", optarg);
+					return GOR_ERROR;
+				}
+
+				break;
+
+			case 'g':
+#ifdef UDP_SEGMENT
+				server_options->gso = 1;
+				break;
+#else
+				printf("GSO isn't supported on this platform\n\n");
+				return GOR_ERROR;
+#endif
+
+			case 't':
+				server_options->tsc = 1;
+				break;
+
 			case '?':
 				if (optarg)
 					printf("Error: invalid option: \"%c\": \"%s\"\n\n", (char) optopt, optarg);
@@ -284,18 +482,41 @@ enum get_options_result get_options(int argc, char *argv[], struct server_option
 		return GOR_ERROR;
 	}
 
+	if (server_options->gso && is_upstream_enabled(&server_options->upstream))
+	{
+		printf("GSO can't be used with upstream emulation\n\n");
+		return GOR_ERROR;
+	}
+
+	// Without the limit the queue is bounded by the pool only.
+	if (server_options->pool == 0) server_options->pool = get_pool_size(&server_options->upstream);
+	if (!got_queue) server_options->upstream.queue = server_options->pool;
+
 	return GOR_OK;
 }
 
-int recv_all(int s, void *recv_buffer, void *send_buffer, struct message_queue *queue,
-             size_t *messages_received, struct timespec *receives, size_t *index)
+int recv_all(int s, struct reply_ring *ring, struct reply_slot **pending, const struct zone *zone,
+             size_t *messages_received, unsigned long long *receives, size_t *index)
 {
 	while (1)
 	{
-		struct sockaddr_storage client;
-		socklen_t clinet_length = sizeof(client);
-		ssize_t bytes_received = recvfrom(s, recv_buffer, RECEIVE_BUFFER_SIZE, 0,
-		                                  (struct sockaddr *) &client, &clinet_length);
+		// Slot stays reserved between calls until a query fills it, full ring
+		// leaves queries in the socket until replies go out.
+		if (*pending == NULL) *pending = reserve_reply_slot(ring);
+		if (*pending == NULL) break;
+
+		struct reply_slot *slot = *pending;
+
+		struct sockaddr_in client;
+		struct iovec vector = {slot->data, REPLY_DATA_SIZE};
+		struct msghdr header;
+		memset(&header, 0, sizeof(header));
+		header.msg_name = &client;
+		header.msg_namelen = sizeof(client);
+		header.msg_iov = &vector;
+		header.msg_iovlen = 1;
+
+		ssize_t bytes_received = recvmsg(s, &header, 0);
 		if (bytes_received == -1)
 		{
 			if (errno == EAGAIN) break;
@@ -304,25 +525,25 @@ int recv_all(int s, void *recv_buffer, void *send_buffer, struct message_queue *
 			return -1;
 		}
 
-		size_t bytes_to_send;
-		if (make_answer(recv_buffer, bytes_received, send_buffer, &bytes_to_send) != 0) return -1;
-
-		if (push_message(queue,
-		                 (struct sockaddr *) &client, clinet_length,
-		                 send_buffer, bytes_to_send) != 0)
+		// Query is answered in the slot it came to, too short one leaves the
+		// slot empty and it is skipped on send.
+		size_t bytes_to_send = 0;
+		if (header.msg_flags & MSG_TRUNC) make_format_error_answer(slot->data, &bytes_to_send);
+		else if (bytes_received >= sizeof(struct dns_query))
 		{
-			log_error("Failed to queue message to send.");
-			return -1;
+			make_answer(slot->data, bytes_received, REPLY_DATA_SIZE, zone, &bytes_to_send);
 		}
 
+		slot->address = client.sin_addr.s_addr;
+		slot->port = client.sin_port;
+		slot->size = (unsigned short) bytes_to_send;
+		commit_reply_slot(slot);
+		*pending = NULL;
+
 		(*messages_received)++;
 		if (receives && *index < TIMESTAMPS_MAXLENGTH)
 		{
-			if (clock_gettime(CLOCK_SOURCE, receives + *index) == -1)
-			{
-				log_errno("Error on getting timestamp.");
-				return -1;
-			}
+			if (get_timestamp(receives + *index) != 0) return -1;
 
 			(*index)++;
 		}
@@ -331,23 +552,30 @@ int recv_all(int s, void *recv_buffer, void *send_buffer, struct message_queue *
 	return 0;
 }
 
-int send_all(int s, struct message_queue *queue, struct timespec *sends, size_t *index)
+void get_slot_client(const struct reply_slot *slot, struct sockaddr_in *client)
 {
-	while (!IS_QUEUE_EMPTY(*queue))
-	{
-		struct sockaddr *client;
-		socklen_t client_length;
-		void *message;
-		size_t message_length;
-		void *head;
+	memset(client, 0, sizeof(*client));
+	client->sin_family = AF_INET;
+	client->sin_addr.s_addr = slot->address;
+	client->sin_port = slot->port;
+}
 
-		if (get_message(queue, &head, &client, &client_length, &message, &message_length) != 0)
+int send_all(int s, struct reply_ring *ring, unsigned long long *sends, size_t *index)
+{
+	struct reply_slot *slot;
+	while ((slot = get_reply_slot(ring, 0)) != NULL)
+	{
+		// Slot reserved for a query which hasn't come or can't be answered.
+		if (slot->size == 0)
 		{
-			log_error("Failed to get message to send.");
-			return -1;
+			release_reply_slots(ring, 1);
+			continue;
 		}
 
-		ssize_t bytes_sent = sendto(s, message, message_length, 0, client, client_length);
+		struct sockaddr_in client;
+		get_slot_client(slot, &client);
+
+		ssize_t bytes_sent = sendto(s, slot->data, slot->size, 0, (struct sockaddr *) &client, sizeof(client));
 		if (bytes_sent < 0)
 		{
 			if (errno == EAGAIN) break;
@@ -356,28 +584,204 @@ int send_all(int s, struct message_queue *queue, struct timespec *sends, size_t
 			return -1;
 		}
 
-		if (bytes_sent < message_length)
+		if (bytes_sent < slot->size)
 		{
-			log_error("Expected to send %lu bytes but sent only %ld.", message_length, bytes_sent);
+			log_error("Expected to send %hu bytes but sent only %ld.", slot->size, bytes_sent);
 			return -1;
 		}
 
-		queue->head = head;
+		release_reply_slots(ring, 1);
 		if (sends && *index < TIMESTAMPS_MAXLENGTH)
 		{
-			if (clock_gettime(CLOCK_SOURCE, sends + *index) == -1)
+			if (get_timestamp(sends + *index) != 0) return -1;
+
+			(*index)++;
+		}
+	}
+
+	return 0;
+}
+
+// Replies of the same size to the same client leave in one call, kernel
+// (or the device) cuts the buffer into datagrams of the segment size. Only
+// the last reply of a batch may be shorter.
+int send_segments(int s, struct reply_ring *ring, char *buffer,
+                  unsigned long long *sends, size_t *index, size_t *calls)
+{
+	struct reply_slot *slot;
+	while ((slot = get_reply_slot(ring, 0)) != NULL)
+	{
+		if (slot->size == 0)
+		{
+			release_reply_slots(ring, 1);
+			continue;
+		}
+
+		char *data = slot->data;
+		size_t segment = slot->size;
+		size_t size = segment;
+		size_t count = 1;
+
+		struct reply_slot *next;
+		while (count < GSO_MAX_SEGMENTS && size == count*segment && (next = get_reply_slot(ring, count)) != NULL)
+		{
+			if (next->address != slot->address || next->port != slot->port) break;
+			if (next->size == 0 || next->size > segment || size + next->size > GSO_MAX_SIZE) break;
+
+			if (count == 1)
 			{
-				log_errno("Error on getting timestamp.");
-				return -1;
+				memcpy(buffer, slot->data, segment);
+				data = buffer;
 			}
 
-			(*index)++;
+			memcpy(buffer + size, next->data, next->size);
+			size += next->size;
+			count++;
+		}
+
+		struct sockaddr_in client;
+		get_slot_client(slot, &client);
+
+		struct iovec vector = {data, size};
+		struct msghdr header;
+		memset(&header, 0, sizeof(header));
+		header.msg_name = &client;
+		header.msg_namelen = sizeof(client);
+		header.msg_iov = &vector;
+		header.msg_iovlen = 1;
+
+#ifdef UDP_SEGMENT
+		char control[CMSG_SPACE(sizeof(unsigned short))];
+		if (count > 1)
+		{
+			memset(control, 0, sizeof(control));
+			header.msg_control = control;
+			header.msg_controllen = sizeof(control);
+
+			struct cmsghdr *option = CMSG_FIRSTHDR(&header);
+			option->cmsg_level = SOL_UDP;
+			option->cmsg_type = UDP_SEGMENT;
+			option->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+
+			unsigned short segment_size = (unsigned short) segment;
+			memcpy(CMSG_DATA(option), &segment_size, sizeof(segment_size));
+		}
+#endif
+
+		ssize_t bytes_sent = sendmsg(s, &header, 0);
+		if (bytes_sent < 0)
+		{
+			if (errno == EAGAIN) break;
+
+			log_errno("Error on sending %lu message(s) of %lu bytes.", count, size);
+			return -1;
+		}
+
+		if (bytes_sent < size)
+		{
+			log_error("Expected to send %lu bytes but sent only %ld.", size, bytes_sent);
+			return -1;
+		}
+
+		release_reply_slots(ring, count);
+		(*calls)++;
+		if (sends && *index < TIMESTAMPS_MAXLENGTH)
+		{
+			if (get_timestamp(sends + *index) != 0) return -1;
+
+			size_t i;
+			for (i = 1; i < count && *index + i < TIMESTAMPS_MAXLENGTH; i++) sends[*index + i] = sends[*index];
+
+			*index += i;
 		}
 	}
 
 	return 0;
 }
 
+struct upstream_sender
+{
+	int s;
+	unsigned long long *sends;
+	size_t *index;
+};
+
+int send_upstream_reply(const struct reply_slot *reply, void *context)
+{
+	struct upstream_sender *sender = (struct upstream_sender *) context;
+
+	struct sockaddr_in client;
+	get_slot_client(reply, &client);
+
+	ssize_t bytes_sent = sendto(sender->s, reply->data, reply->size, 0, (struct sockaddr *) &client, sizeof(client));
+	if (bytes_sent < 0)
+	{
+		if (errno == EAGAIN) return 1;
+
+		log_errno("Error on sending.");
+		return -1;
+	}
+
+	if (bytes_sent < reply->size)
+	{
+		log_error("Expected to send %hu bytes but sent only %ld.", reply->size, bytes_sent);
+		return -1;
+	}
+
+	if (sender->sends && *sender->index < TIMESTAMPS_MAXLENGTH)
+	{
+		if (get_timestamp(sender->sends + *sender->index) != 0) return -1;
+
+		(*sender->index)++;
+	}
+
+	return 0;
+}
+
+// With upstream emulation replies move from the ring to the upstream as
+// they come and leave the upstream when they are due.
+int pass_upstream(int s, struct reply_ring *ring, struct upstream *upstream, unsigned long long now,
+                  unsigned long long *sends, size_t *index)
+{
+	struct reply_slot *slot;
+	while ((slot = get_reply_slot(ring, 0)) != NULL)
+	{
+		if (slot->size != 0 && defer_reply(upstream, slot, now) != 0) break;
+
+		release_reply_slots(ring, 1);
+	}
+
+	struct upstream_sender sender = {s, sends, index};
+	return send_due_replies(upstream, now, send_upstream_reply, &sender);
+}
+
+// Counters are logged and reset when the server gets idle and every
+// UPSTREAM_REPORT_INTERVAL while it is busy, a saturated upstream may never
+// get idle.
+void log_upstream(struct upstream *upstream, size_t messages_received, unsigned long long now)
+{
+	log_message("Got %lu message(s), dropped %lu, duplicated %lu, reordered %lu.",
+	            messages_received, upstream->dropped, upstream->duplicated, upstream->reordered);
+	if (upstream->service_time > 0)
+	{
+		log_message("Queue depth %lu, up to %lu, %lu overflowed (%s).", get_queue_depth(upstream, now),
+		            upstream->max_depth, upstream->overflowed, get_overflow_name(upstream->options.overflow));
+	}
+
+	if (upstream->stalls > 0)
+	{
+		log_error("Warning: pool of %lu slots has been full %lu time(s), replies waited in the ring (see -P).",
+		          upstream->capacity, upstream->stalls);
+	}
+
+	upstream->dropped = 0;
+	upstream->duplicated = 0;
+	upstream->reordered = 0;
+	upstream->overflowed = 0;
+	upstream->max_depth = 0;
+	upstream->stalls = 0;
+}
+
 volatile sig_atomic_t do_dump_timestamps = 0;
 
 void catch_info(int sig)
@@ -387,8 +791,8 @@ void catch_info(int sig)
 }
 
 int dump_timestamps(const char *name,
-                    struct timespec *receives, size_t receives_count,
-                    struct timespec *sends, size_t sends_count)
+                    unsigned long long *receives, size_t receives_count,
+                    unsigned long long *sends, size_t sends_count)
 {
 	FILE *f = fopen(name, "w");
 	if (f == NULL)
@@ -402,41 +806,17 @@ int dump_timestamps(const char *name,
 	fprintf(f, "{\"receives\":\n\t[");
 	if (receives_count > 0)
 	{
-		unsigned long long timestamp;
-		for (i = 0; i < receives_count - 1; i++)
-		{
-			timestamp = receives[i].tv_sec;
-			timestamp *= NANOSECONDS;
-			timestamp += receives[i].tv_nsec;
+		for (i = 0; i < receives_count - 1; i++) fprintf(f, "\n\t\t%llu,", receives[i]);
 
-			fprintf(f, "\n\t\t%llu,", timestamp);
-		}
-
-		timestamp = receives[i].tv_sec;
-		timestamp *= NANOSECONDS;
-		timestamp += receives[i].tv_nsec;
-
-		fprintf(f, "\n\t\t%llu\n\t", timestamp);
+		fprintf(f, "\n\t\t%llu\n\t", receives[i]);
 	}
 
 	fprintf(f, "],\n \"sends\":\n\t[");
 	if (sends_count > 0)
 	{
-		unsigned long long timestamp;
-		for (i = 0; i < sends_count - 1; i++)
-		{
-			timestamp = sends[i].tv_sec;
-			timestamp *= NANOSECONDS;
-			timestamp += sends[i].tv_nsec;
+		for (i = 0; i < sends_count - 1; i++) fprintf(f, "\n\t\t%llu,", sends[i]);
 
-			fprintf(f, "\n\t\t%llu,", timestamp);
-		}
-
-		timestamp = sends[i].tv_sec;
-		timestamp *= NANOSECONDS;
-		timestamp += sends[i].tv_nsec;
-
-		fprintf(f, "\n\t\t%llu\n\t", timestamp);
+		fprintf(f, "\n\t\t%llu\n\t", sends[i]);
 	}
 
 	fprintf(f, "]\n}\n");
@@ -444,25 +824,36 @@ int dump_timestamps(const char *name,
 	fclose(f);
 
 	log_message("Dumped %lu receive events and %lu send events.", receives_count, sends_count);
+
+	long long drift;
+	if (check_clock_drift(&drift) != 0) return -1;
+	if (is_tsc_clock()) log_message("TSC clock drift: %lld ns.", drift);
+
 	return 0;
 }
 
-void serve(int s, void *recv_buffer, void *send_buffer, struct message_queue *queue,
-           const char * name, struct timespec *receives, struct timespec * sends)
+void serve(int s, void *send_buffer, struct reply_ring *ring, const struct zone *zone, struct upstream *upstream, int gso,
+           const char * name, unsigned long long *receives, unsigned long long * sends)
 {
 	fd_set readfds;
 	fd_set writefds;
 	fd_set *pwritefds = &writefds;
 
+	// Upstream sends on its ticks instead of waiting for the socket.
+	if (upstream != NULL) pwritefds = NULL;
+
 	FD_ZERO(&readfds);
 	FD_SET(s, &readfds);
 	FD_SET(STDIN_FILENO, &readfds);
 
-	FD_ZERO(pwritefds);
+	FD_ZERO(&writefds);
 
+	struct reply_slot *pending = NULL;
 	size_t messages_received = 0;
+	size_t send_calls = 0;
 	size_t receives_position = 0;
 	size_t sends_position = 0;
+	unsigned long long last_report = 0;
 	while (1)
 	{
 		if (do_dump_timestamps)
@@ -474,13 +865,19 @@ void serve(int s, void *recv_buffer, void *send_buffer, struct message_queue *qu
 			sends_position = 0;
 		}
 
-		if (!IS_QUEUE_EMPTY(*queue))
+		if (upstream == NULL && get_reply_slot(ring, 0) != NULL)
 		{
 			pwritefds = &writefds;
 			FD_SET(s, pwritefds);
 		}
 
 		struct timespec timeout = {1, 0};
+		if (upstream != NULL && upstream->timers.count > 0)
+		{
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = UPSTREAM_TICK;
+		}
+
 		int fd_count = pselect((s > STDIN_FILENO)? s + 1 : STDIN_FILENO + 1,
 		                       &readfds, pwritefds, NULL, &timeout, 0);
 		if (fd_count == -1) {
@@ -497,8 +894,8 @@ void serve(int s, void *recv_buffer, void *send_buffer, struct message_queue *qu
 		{
 			if (FD_ISSET(s, &readfds))
  			{
-				if (recv_all(s, recv_buffer, send_buffer, queue,
-				    &messages_received, receives, &receives_position) != 0) return;
+				if (recv_all(s, ring, &pending, zone,
+				             &messages_received, receives, &receives_position) != 0) return;
 			}
 			else FD_SET(s, &readfds);
 
@@ -512,10 +909,15 @@ void serve(int s, void *recv_buffer, void *send_buffer, struct message_queue *qu
 			{
 				if (FD_ISSET(s, pwritefds))
 				{
-					if (send_all(s, queue,
-					             sends, &sends_position) != 0) return;
+					if (gso)
+					{
+						if (send_segments(s, ring, send_buffer,
+						                  sends, &sends_position, &send_calls) != 0) return;
+					}
+					else if (send_all(s, ring,
+					                  sends, &sends_position) != 0) return;
 
-					if (IS_QUEUE_EMPTY(*queue))
+					if (get_reply_slot(ring, 0) == NULL)
 					{
 						FD_CLR(s, pwritefds);
 						pwritefds = NULL;
@@ -530,10 +932,40 @@ void serve(int s, void *recv_buffer, void *send_buffer, struct message_queue *qu
 			FD_SET(STDIN_FILENO, &readfds);
 			if (pwritefds) FD_SET(s, pwritefds);
 
-			if (messages_received > 0)
+			if (messages_received > 0 && (upstream == NULL || upstream->timers.count == 0))
+			{
+				if (gso) log_message("Got %lu message(s), sent in %lu call(s).", messages_received, send_calls);
+				else if (upstream != NULL)
+				{
+					unsigned long long now;
+					if (get_timestamp(&now) != 0) return;
+
+					log_upstream(upstream, messages_received, now);
+					last_report = now;
+				}
+				else log_message("Got %lu message(s).", messages_received);
+
+				messages_received = 0;
+				send_calls = 0;
+			}
+		}
+
+		if (upstream != NULL)
+		{
+			unsigned long long now;
+			if (get_timestamp(&now) != 0) return;
+
+			if (pass_upstream(s, ring, upstream, now, sends, &sends_position) != 0) return;
+
+			if (now - last_report >= UPSTREAM_REPORT_INTERVAL)
 			{
-				log_message("Got %lu message(s).", messages_received);
+				if (messages_received > 0 || upstream->dropped > 0 || upstream->overflowed > 0 || upstream->stalls > 0)
+				{
+					log_upstream(upstream, messages_received, now);
+				}
+
 				messages_received = 0;
+				last_report = now;
 			}
 		}
 	}
@@ -552,6 +984,12 @@ int main(int argc, char *argv[])
 
 	log_message("Starting...");
 
+	if (server_options.tsc && enable_tsc_clock() != 0)
+	{
+		log_error("Can't enable TSC clock. Exiting...");
+		return 1;
+	}
+
 	errno = 0;
 	int sflags = fcntl(STDIN_FILENO, F_GETFL);
 	if (errno != 0)
@@ -609,64 +1047,50 @@ int main(int argc, char *argv[])
 	}
 	log_message("Bound to %s:%hu.", address, htons(server_options.address.sin_port));
 
-	void *recv_buffer = malloc(RECEIVE_BUFFER_SIZE);
-	if (recv_buffer == NULL)
-	{
-		log_errno("Can't allocate %lu bytes for receiver buffer. Exiting...", (size_t) RECEIVE_BUFFER_SIZE);
-
-		close(s);
-		return 1;
-	}
-	log_message("Allocated %lu bytes for receiver buffer.", (size_t) RECEIVE_BUFFER_SIZE);
-
 	void *send_buffer = malloc(SEND_BUFFER_SIZE);
 	if (send_buffer == NULL)
 	{
 		log_errno("Can't allocate %lu bytes for sender buffer. Exiting...", (size_t) SEND_BUFFER_SIZE);
 
-		free(recv_buffer);
 		close(s);
 		return 1;
 	}
 	log_message("Allocated %lu bytes for sender buffer.", (size_t) SEND_BUFFER_SIZE);
 
-	struct message_queue queue;
-	if (make_message_queue(SEND_QUEUE_SIZE, &queue) != 0)
+	struct reply_ring ring;
+	if (make_reply_ring(SEND_QUEUE_SLOTS, &ring) != 0)
 	{
-		log_error("Can't make message queue of %lu bytes. Exiting...", (size_t) SEND_QUEUE_SIZE);
+		log_error("Can't make reply ring of %lu slots. Exiting...", (size_t) SEND_QUEUE_SLOTS);
 
 		free(send_buffer);
-		free(recv_buffer);
 		close(s);
 		return 1;
 	}
-	log_message("Created message queue of %lu bytes.", (size_t) SEND_QUEUE_SIZE);
+	log_message("Created reply ring of %lu slots of %lu bytes.", (size_t) SEND_QUEUE_SLOTS, sizeof(struct reply_slot));
 
-	struct timespec *receives = NULL;
-	struct timespec *sends = NULL;
+	unsigned long long *receives = NULL;
+	unsigned long long *sends = NULL;
 	if (server_options.output != NULL)
 	{
-		receives = (struct timespec *) malloc(TIMESTAMPS_MAXLENGTH*sizeof(struct timespec));
+		receives = (unsigned long long *) malloc(TIMESTAMPS_MAXLENGTH*sizeof(unsigned long long));
 		if (receives == NULL)
 		{
 			log_errno("Can't allocate %lu bytes for receive timestamps. Exiting...",
-			          TIMESTAMPS_MAXLENGTH*sizeof(struct timespec));
+			          TIMESTAMPS_MAXLENGTH*sizeof(unsigned long long));
 
 			free(send_buffer);
-			free(recv_buffer);
 			close(s);
 			return 1;
 		}
 
-		sends = (struct timespec *) malloc(TIMESTAMPS_MAXLENGTH*sizeof(struct timespec));
+		sends = (unsigned long long *) malloc(TIMESTAMPS_MAXLENGTH*sizeof(unsigned long long));
 		if (sends == NULL)
 		{
 			log_errno("Can't allocate %lu bytes for send timestamps. Exiting...",
-			          TIMESTAMPS_MAXLENGTH*sizeof(struct timespec));
+			          TIMESTAMPS_MAXLENGTH*sizeof(unsigned long long));
 
 			free(receives);
 			free(send_buffer);
-			free(recv_buffer);
 			close(s);
 			return 1;
 		}
@@ -674,17 +1098,67 @@ int main(int argc, char *argv[])
 		signal(SIGDUMPTIMESTAMPS, catch_info);
 	}
 
+	struct zone zone;
+	memset(&zone, 0, sizeof(zone));
+	if (server_options.zone != NULL && load_zone(server_options.zone, &zone) != 0)
+	{
+		log_error("Can't load zone file %s. Exiting...", server_options.zone);
+
+		free(sends);
+		free(receives);
+		free_reply_ring(&ring);
+		free(send_buffer);
+		close(s);
+		return 1;
+	}
+
+	struct upstream upstream;
+	memset(&upstream, 0, sizeof(upstream));
+
+	int emulate_upstream = is_upstream_enabled(&server_options.upstream);
+	if (emulate_upstream)
+	{
+		unsigned long long now;
+		if (get_timestamp(&now) != 0 ||
+		    make_upstream(&server_options.upstream, server_options.pool, now, &upstream) != 0)
+		{
+			log_error("Can't make upstream of %lu slots. Exiting...", server_options.pool);
+
+			free_zone(&zone);
+			free(sends);
+			free(receives);
+			free_reply_ring(&ring);
+			free(send_buffer);
+			close(s);
+			return 1;
+		}
+
+		log_message("Emulating upstream with %lu slots: delay %s, loss %.2f%%, duplicate %.2f%%, reorder %.2f%%.",
+		            server_options.pool, get_delay_name(server_options.upstream.delay.kind),
+		            100*server_options.upstream.drop, 100*server_options.upstream.duplicate,
+		            100*server_options.upstream.reorder);
+		if (server_options.upstream.rate > 0)
+		{
+			log_message("Serving %.0f replies per second, up to %lu waiting, %s on overflow.",
+			            server_options.upstream.rate, server_options.upstream.queue,
+			            get_overflow_name(server_options.upstream.overflow));
+		}
+	}
+
 	log_message("Serving...");
 
-	serve(s, recv_buffer, send_buffer, &queue, server_options.output, receives, sends);
+	serve(s, send_buffer, &ring, (server_options.zone != NULL)? &zone : NULL, emulate_upstream? &upstream : NULL,
+	      server_options.gso, server_options.output, receives, sends);
 
 	log_message("Exiting...");
 
+	free_upstream(&upstream);
+	free_delay(&server_options.upstream.delay);
+	free_zone(&zone);
 	free(sends);
 	free(receives);
-	free(queue.buffer);
+	free_reply_ring(&ring);
 	free(send_buffer);
-	free(recv_buffer);
 	close(s);
 	return 0;
 }
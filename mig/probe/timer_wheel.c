@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+#include "logger.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1ULL << (TIMER_WHEEL_LEVELS*TIMER_WHEEL_SLOT_BITS)) - 1)
+
+static void insert_timer(struct timer_wheel *wheel, size_t id)
+{
+	unsigned long long deadline = wheel->deadlines[id];
+	unsigned long long delta = deadline - wheel->current;
+
+	int level = 0;
+	while (level + 1 < TIMER_WHEEL_LEVELS && delta >> ((level + 1)*TIMER_WHEEL_SLOT_BITS) != 0) level++;
+
+	size_t *slot = &wheel->slots[level][(deadline >> (level*TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK];
+	wheel->next[id] = *slot;
+	*slot = id;
+}
+
+static void cascade_timers(struct timer_wheel *wheel, int level)
+{
+	size_t *slot = &wheel->slots[level][(wheel->current >> (level*TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK];
+	size_t id = *slot;
+	*slot = TIMER_NONE;
+
+	while (id != TIMER_NONE)
+	{
+		size_t next = wheel->next[id];
+		insert_timer(wheel, id);
+		id = next;
+	}
+}
+
+int make_timer_wheel(size_t capacity, unsigned long long tick, struct timer_wheel *wheel)
+{
+	memset(wheel, 0, sizeof(*wheel));
+
+	wheel->tick = tick;
+	wheel->capacity = capacity;
+	wheel->next = malloc(capacity*sizeof(size_t));
+	wheel->deadlines = malloc(capacity*sizeof(unsigned long long));
+	if (capacity > 0 && (wheel->next == NULL || wheel->deadlines == NULL))
+	{
+		log_errno("Can't allocate timer wheel for %lu timers.", capacity);
+		free_timer_wheel(wheel);
+		return -1;
+	}
+
+	memset(wheel->slots, 0xff, sizeof(wheel->slots));
+	return 0;
+}
+
+void free_timer_wheel(struct timer_wheel *wheel)
+{
+	free(wheel->next);
+	free(wheel->deadlines);
+
+	wheel->next = NULL;
+	wheel->deadlines = NULL;
+	wheel->capacity = 0;
+	wheel->count = 0;
+}
+
+void add_timer(struct timer_wheel *wheel, size_t id, unsigned long long deadline)
+{
+	unsigned long long tick = (deadline + wheel->tick - 1)/wheel->tick;
+	if (tick < wheel->current) tick = wheel->current;
+	if (tick - wheel->current > MAX_DELTA) tick = wheel->current + MAX_DELTA;
+
+	wheel->deadlines[id] = tick;
+	insert_timer(wheel, id);
+	wheel->count++;
+}
+
+int set_timer_wheel_time(struct timer_wheel *wheel, unsigned long long now)
+{
+	if (wheel->count > 0)
+	{
+		log_error("Can't move timer wheel with %lu timers armed.", wheel->count);
+		return -1;
+	}
+
+	wheel->current = now/wheel->tick;
+	return 0;
+}
+
+int expire_timers(struct timer_wheel *wheel, unsigned long long now, timer_callback callback, void *context)
+{
+	unsigned long long target = now/wheel->tick;
+
+	while (wheel->current <= target)
+	{
+		if (wheel->count == 0)
+		{
+			wheel->current = target + 1;
+			break;
+		}
+
+		if ((wheel->current & SLOT_MASK) == 0)
+		{
+			int level = 1;
+			while (level + 1 < TIMER_WHEEL_LEVELS &&
+			       (wheel->current & ((1ULL << ((level + 1)*TIMER_WHEEL_SLOT_BITS)) - 1)) == 0) level++;
+
+			for (; level > 0; level--) cascade_timers(wheel, level);
+		}
+
+		size_t *slot = &wheel->slots[0][wheel->current & SLOT_MASK];
+		size_t id = *slot;
+		*slot = TIMER_NONE;
+
+		// Advance first so timers armed from callback never land in the slot being expired.
+		wheel->current++;
+
+		while (id != TIMER_NONE)
+		{
+			size_t next = wheel->next[id];
+			wheel->count--;
+
+			if (callback(id, context) != 0) return -1;
+			id = next;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stddef.h>
+
+// Hierarchical timer wheel: TIMER_WHEEL_LEVELS levels of 2^TIMER_WHEEL_SLOT_BITS
+// slots, level N slot spans 2^(N*TIMER_WHEEL_SLOT_BITS) ticks. Timers are
+// identified by index below wheel capacity (query or reply slot number), each
+// index can be armed at most once at a time. There is no cancel: owner checks
+// whether the timer is still relevant when it fires.
+#define TIMER_WHEEL_SLOT_BITS 8
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+#define TIMER_NONE ((size_t) -1)
+
+typedef int (*timer_callback)(size_t id, void *context);
+
+struct timer_wheel
+{
+	unsigned long long tick;
+	unsigned long long current;
+
+	size_t count;
+	size_t capacity;
+	size_t *next;
+	unsigned long long *deadlines;
+
+	size_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+int make_timer_wheel(size_t capacity, unsigned long long tick, struct timer_wheel *wheel);
+void free_timer_wheel(struct timer_wheel *wheel);
+void add_timer(struct timer_wheel *wheel, size_t id, unsigned long long deadline);
+
+// Moves an empty wheel to the tick of the time, so deadlines far from zero
+// (monotonic clock) fit in its span. Fails if any timer is armed.
+int set_timer_wheel_time(struct timer_wheel *wheel, unsigned long long now);
+int expire_timers(struct timer_wheel *wheel, unsigned long long now, timer_callback callback, void *context);
+
+#endif // __TIMER_WHEEL_H__
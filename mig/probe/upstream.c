@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "upstream.h"
+#include "zone.h"
+#include "logger.h"
+
+#define MILLISECONDS 1000000.0
+#define EMPIRICAL_INITIAL_COUNT 1024
+#define EMPIRICAL_LINE_SIZE 256
+
+// Replies held back to reorder them without delay distribution wait this long.
+#define REORDER_DELAY 1000000ULL
+
+// Lognormal delays are taken as bounded this many sigmas above the median.
+#define LOGNORMAL_MAX_SIGMAS 4
+
+#define RANDOM_SEED 1
+
+#define NANOSECONDS 1000000000.0
+#define DNS_HEADER_SIZE 12
+#define DNS_RCODE_SERVFAIL 2
+
+struct send_context
+{
+	struct upstream *upstream;
+	send_callback send;
+	void *context;
+	int blocked;
+};
+
+// Splitmix64, runs with the same options draw the same sequence of decisions.
+static unsigned long long get_random(struct upstream *upstream)
+{
+	unsigned long long value = (upstream->random += 0x9e3779b97f4a7c15ULL);
+	value = (value ^ (value >> 30))*0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27))*0x94d049bb133111ebULL;
+
+	return value ^ (value >> 31);
+}
+
+// Uniform in [0, 1).
+static double get_uniform(struct upstream *upstream)
+{
+	return (get_random(upstream) >> 11)*(1.0/9007199254740992.0);
+}
+
+static int get_chance(struct upstream *upstream, double probability)
+{
+	return probability > 0 && get_uniform(upstream) < probability;
+}
+
+static unsigned long long get_delay(struct upstream *upstream)
+{
+	const struct delay_distribution *delay = &upstream->options.delay;
+
+	double value = 0;
+	double normal;
+	switch (delay->kind)
+	{
+		case DELAY_NONE:
+			return 0;
+
+		case DELAY_FIXED:
+			value = delay->first;
+			break;
+
+		case DELAY_UNIFORM:
+			value = delay->first + (delay->second - delay->first)*get_uniform(upstream);
+			break;
+
+		case DELAY_LOGNORMAL:
+			// Box-Muller, the first uniform is taken from (0, 1] for the logarithm.
+			normal = sqrt(-2*log(1 - get_uniform(upstream)))*cos(2*M_PI*get_uniform(upstream));
+			value = delay->first*exp(delay->second*normal);
+			break;
+
+		case DELAY_EMPIRICAL:
+			return delay->values[get_random(upstream) % delay->count];
+	}
+
+	return (unsigned long long) value;
+}
+
+static int parse_milliseconds(const char *text, char **end, double *value)
+{
+	*value = strtod(text, end);
+	if (*end == text || *value < 0 || *value*MILLISECONDS > 1e15) return -1;
+
+	*value *= MILLISECONDS;
+	return 0;
+}
+
+static int read_empirical_delay(const char *name, struct delay_distribution *delay)
+{
+	FILE *f = fopen(name, "r");
+	if (f == NULL)
+	{
+		log_errno("Can't open delay file %s.", name);
+		return -1;
+	}
+
+	size_t capacity = EMPIRICAL_INITIAL_COUNT;
+	delay->values = malloc(capacity*sizeof(unsigned long long));
+	if (delay->values == NULL)
+	{
+		log_errno("Can't allocate %lu delays.", capacity);
+		fclose(f);
+		return -1;
+	}
+
+	char line[EMPIRICAL_LINE_SIZE];
+	size_t line_number = 0;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		line_number++;
+
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '\n' || *p == '\r' || *p == '\0' || *p == '#') continue;
+
+		char *end;
+		double value;
+		if (parse_milliseconds(p, &end, &value) != 0 || strspn(end, " \t\r\n") != strlen(end))
+		{
+			log_error("Invalid delay at line %lu of %s.", line_number, name);
+			goto error;
+		}
+
+		if (delay->count == capacity)
+		{
+			capacity *= 2;
+			unsigned long long *values = realloc(delay->values, capacity*sizeof(unsigned long long));
+			if (values == NULL)
+			{
+				log_errno("Can't grow delays to %lu.", capacity);
+				goto error;
+			}
+
+			delay->values = values;
+		}
+
+		delay->values[delay->count++] = (unsigned long long) value;
+	}
+
+	if (delay->count == 0)
+	{
+		log_error("No delays found in %s.", name);
+		goto error;
+	}
+
+	fclose(f);
+	log_message("Read %lu delays from %s.", delay->count, name);
+	return 0;
+
+error:
+	free_delay(delay);
+	fclose(f);
+	return -1;
+}
+
+int parse_delay(const char *text, struct delay_distribution *delay)
+{
+	memset(delay, 0, sizeof(*delay));
+
+	const char *colon = strchr(text, ':');
+	if (colon == NULL) return -1;
+
+	size_t length = colon - text;
+	char *end;
+	if (length == 9 && strncmp(text, "empirical", length) == 0)
+	{
+		delay->kind = DELAY_EMPIRICAL;
+		return read_empirical_delay(colon + 1, delay);
+	}
+
+	if (parse_milliseconds(colon + 1, &end, &delay->first) != 0) return -1;
+
+	if (length == 5 && strncmp(text, "fixed", length) == 0)
+	{
+		delay->kind = DELAY_FIXED;
+		return (*end == '\0')? 0 : -1;
+	}
+
+	if (*end != ':') return -1;
+
+	if (length == 7 && strncmp(text, "uniform", length) == 0)
+	{
+		delay->kind = DELAY_UNIFORM;
+		if (parse_milliseconds(end + 1, &end, &delay->second) != 0) return -1;
+
+		return (*end == '\0' && delay->first <= delay->second)? 0 : -1;
+	}
+
+	if (length == 9 && strncmp(text, "lognormal", length) == 0)
+	{
+		delay->kind = DELAY_LOGNORMAL;
+
+		const char *sigma = end + 1;
+		delay->second = strtod(sigma, &end);
+
+		return (end != sigma && *end == '\0' && delay->second >= 0)? 0 : -1;
+	}
+
+	return -1;
+}
+
+void free_delay(struct delay_distribution *delay)
+{
+	free(delay->values);
+
+	delay->values = NULL;
+	delay->count = 0;
+}
+
+const char *get_delay_name(enum delay_kind kind)
+{
+	switch (kind)
+	{
+		case DELAY_NONE: return "none";
+		case DELAY_FIXED: return "fixed";
+		case DELAY_UNIFORM: return "uniform";
+		case DELAY_LOGNORMAL: return "lognormal";
+		case DELAY_EMPIRICAL: return "empirical";
+	}
+
+	return "unknown";
+}
+
+const char *get_overflow_name(enum overflow_action action)
+{
+	return (action == OVERFLOW_SERVFAIL)? "servfail" : "drop";
+}
+
+static double get_max_delay(const struct delay_distribution *delay)
+{
+	double value = 0;
+	size_t i;
+	switch (delay->kind)
+	{
+		case DELAY_NONE:
+			return 0;
+
+		case DELAY_FIXED:
+			return delay->first;
+
+		case DELAY_UNIFORM:
+			return delay->second;
+
+		case DELAY_LOGNORMAL:
+			return delay->first*exp(LOGNORMAL_MAX_SIGMAS*delay->second);
+
+		case DELAY_EMPIRICAL:
+			for (i = 0; i < delay->count; i++)
+			{
+				if (delay->values[i] > value) value = delay->values[i];
+			}
+
+			return value;
+	}
+
+	return 0;
+}
+
+size_t get_pool_size(const struct upstream_options *options)
+{
+	if (options->rate <= 0) return UPSTREAM_POOL_SLOTS;
+
+	double hold = get_max_delay(&options->delay);
+	if (options->reorder > 0) hold += (options->delay.kind == DELAY_NONE)? REORDER_DELAY : hold;
+
+	double size = options->queue + 1 + options->rate*hold/NANOSECONDS;
+	if (size < UPSTREAM_POOL_SLOTS) return UPSTREAM_POOL_SLOTS;
+
+	return (size < UPSTREAM_MAX_POOL_SLOTS)? (size_t) ceil(size) : UPSTREAM_MAX_POOL_SLOTS;
+}
+
+int is_upstream_enabled(const struct upstream_options *options)
+{
+	return options->delay.kind != DELAY_NONE || options->drop > 0 || options->duplicate > 0 || options->reorder > 0 ||
+	       options->rate > 0;
+}
+
+int make_upstream(const struct upstream_options *options, size_t capacity, unsigned long long now,
+                  struct upstream *upstream)
+{
+	memset(upstream, 0, sizeof(*upstream));
+
+	upstream->options = *options;
+	upstream->random = RANDOM_SEED;
+	upstream->capacity = capacity;
+	upstream->service_time = (options->rate > 0)? NANOSECONDS/options->rate : 0;
+
+	if (make_timer_wheel(capacity, UPSTREAM_TICK, &upstream->timers) != 0) return -1;
+
+	void *slots;
+	int errnum = posix_memalign(&slots, REPLY_CACHE_LINE, capacity*sizeof(struct reply_slot));
+	if (errnum != 0)
+	{
+		log_errno_ex(errnum, "Can't allocate upstream pool of %lu slots.", capacity);
+		free_timer_wheel(&upstream->timers);
+		return -1;
+	}
+	upstream->slots = (struct reply_slot *) slots;
+
+	upstream->copies = malloc(capacity);
+	upstream->free_slots = malloc(capacity*sizeof(size_t));
+	if (upstream->copies == NULL || upstream->free_slots == NULL)
+	{
+		log_errno("Can't allocate upstream pool index of %lu slots.", capacity);
+		free_upstream(upstream);
+		return -1;
+	}
+
+	// Lower slots are taken first.
+	size_t i;
+	for (i = 0; i < capacity; i++) upstream->free_slots[i] = capacity - 1 - i;
+	upstream->free_count = capacity;
+
+	// Wheel starts at the current tick, otherwise the first deadlines are past its span.
+	if (set_timer_wheel_time(&upstream->timers, now) != 0)
+	{
+		free_upstream(upstream);
+		return -1;
+	}
+
+	return 0;
+}
+
+void free_upstream(struct upstream *upstream)
+{
+	free_timer_wheel(&upstream->timers);
+	free(upstream->slots);
+	free(upstream->copies);
+	free(upstream->free_slots);
+
+	upstream->slots = NULL;
+	upstream->copies = NULL;
+	upstream->free_slots = NULL;
+	upstream->capacity = 0;
+	upstream->free_count = 0;
+}
+
+size_t get_queue_depth(const struct upstream *upstream, unsigned long long now)
+{
+	if (upstream->service_time == 0 || upstream->busy_until <= now) return 0;
+
+	return (size_t) ceil((upstream->busy_until - now)/upstream->service_time);
+}
+
+// Header and question of the reply with SERVFAIL, just the header if the
+// question can't be found.
+static void make_servfail(struct reply_slot *slot)
+{
+	unsigned char *data = (unsigned char *) slot->data;
+	size_t size = DNS_HEADER_SIZE;
+	if (data[4] == 0 && data[5] == 1)
+	{
+		size_t name_size = get_name_size(data + DNS_HEADER_SIZE, slot->size - DNS_HEADER_SIZE);
+		if (name_size > 0 && DNS_HEADER_SIZE + name_size + 4 <= slot->size) size += name_size + 4;
+	}
+
+	data[2] = (data[2] & 0x79) | 0x80;
+	data[3] = (data[3] & 0x70) | DNS_RCODE_SERVFAIL;
+	if (size == DNS_HEADER_SIZE) data[5] = 0;
+	memset(data + 6, 0, 6);
+
+	slot->size = (unsigned short) size;
+}
+
+int defer_reply(struct upstream *upstream, const struct reply_slot *reply, unsigned long long now)
+{
+	// Checked ahead of any decision, so nothing is drawn again for the reply
+	// offered once more when a slot is free.
+	if (upstream->free_count == 0)
+	{
+		if (!upstream->stalled) upstream->stalls++;
+
+		upstream->stalled = 1;
+		return -1;
+	}
+
+	upstream->stalled = 0;
+	if (get_chance(upstream, upstream->options.drop))
+	{
+		upstream->dropped++;
+		return 0;
+	}
+
+	// Reply which would find more than queue limit waiting overflows.
+	size_t depth = get_queue_depth(upstream, now);
+	int overflow = upstream->service_time > 0 && depth > upstream->options.queue;
+	if (overflow && upstream->options.overflow == OVERFLOW_DROP)
+	{
+		upstream->overflowed++;
+		return 0;
+	}
+
+	size_t id = upstream->free_slots[--upstream->free_count];
+	struct reply_slot *slot = &upstream->slots[id];
+	slot->address = reply->address;
+	slot->port = reply->port;
+	slot->size = reply->size;
+	memcpy(slot->data, reply->data, reply->size);
+
+	// Overflowing reply is failed right away, the others leave after service.
+	unsigned long long start = now;
+	if (overflow)
+	{
+		make_servfail(slot);
+		upstream->overflowed++;
+	}
+	else if (upstream->service_time > 0)
+	{
+		upstream->busy_until = ((upstream->busy_until > now)? upstream->busy_until : now) + upstream->service_time;
+		start = (unsigned long long) upstream->busy_until;
+
+		if (depth + 1 > upstream->max_depth) upstream->max_depth = depth + 1;
+	}
+
+	upstream->copies[id] = 1;
+	if (get_chance(upstream, upstream->options.duplicate))
+	{
+		upstream->copies[id]++;
+		upstream->duplicated++;
+	}
+
+	unsigned long long deadline = start + get_delay(upstream);
+	if (get_chance(upstream, upstream->options.reorder))
+	{
+		deadline += (upstream->options.delay.kind == DELAY_NONE)? REORDER_DELAY : get_delay(upstream);
+		upstream->reordered++;
+	}
+
+	add_timer(&upstream->timers, id, deadline);
+	return 0;
+}
+
+// Once the socket is full the rest of due replies wait for the next tick
+// without trying.
+static int send_reply(size_t id, void *context)
+{
+	struct send_context *sender = (struct send_context *) context;
+	struct upstream *upstream = sender->upstream;
+
+	while (!sender->blocked && upstream->copies[id] > 0)
+	{
+		int result = sender->send(&upstream->slots[id], sender->context);
+		if (result < 0) return -1;
+
+		if (result > 0) sender->blocked = 1;
+		else upstream->copies[id]--;
+	}
+
+	if (upstream->copies[id] > 0) add_timer(&upstream->timers, id, 0);
+	else upstream->free_slots[upstream->free_count++] = id;
+
+	return 0;
+}
+
+int send_due_replies(struct upstream *upstream, unsigned long long now, send_callback send, void *context)
+{
+	struct send_context sender = {upstream, send, context, 0};
+
+	return expire_timers(&upstream->timers, now, send_reply, &sender);
+}
@@ -0,0 +1,119 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stddef.h>
+
+#include "reply_ring.h"
+#include "timer_wheel.h"
+
+// Emulation of a distant upstream in the stub server: replies taken off the
+// reply ring are dropped, wait for service of a server with limited rate and
+// queue, are duplicated, held for a delay drawn from the distribution and
+// optionally held once more to reorder them. Held replies are copied to
+// slots of a pool and scheduled on a timer wheel by the slot number, so
+// deferring a reply costs no timer of its own.
+#define UPSTREAM_TICK 100000ULL
+#define UPSTREAM_POOL_SLOTS (64*1024)
+#define UPSTREAM_MAX_POOL_SLOTS (1024*1024)
+
+enum delay_kind
+{
+	DELAY_NONE,
+	DELAY_FIXED,
+	DELAY_UNIFORM,
+	DELAY_LOGNORMAL,
+	DELAY_EMPIRICAL
+};
+
+// Fixed delay, minimum and maximum of uniform one, median and sigma (of the
+// logarithm) of lognormal one or list of delays to pick from at random.
+// Delays are in nanoseconds.
+struct delay_distribution
+{
+	enum delay_kind kind;
+	double first;
+	double second;
+
+	size_t count;
+	unsigned long long *values;
+};
+
+enum overflow_action
+{
+	OVERFLOW_DROP,
+	OVERFLOW_SERVFAIL
+};
+
+// Probabilities are from 0 to 1, rate is replies per second (0 for no limit)
+// and queue is the number of replies which may wait for service.
+struct upstream_options
+{
+	struct delay_distribution delay;
+	double drop;
+	double duplicate;
+	double reorder;
+
+	double rate;
+	size_t queue;
+	enum overflow_action overflow;
+};
+
+struct upstream
+{
+	struct upstream_options options;
+	unsigned long long random;
+
+	struct timer_wheel timers;
+
+	size_t capacity;
+	struct reply_slot *slots;
+	unsigned char *copies;
+	size_t free_count;
+	size_t *free_slots;
+
+	// Service is a single FIFO server, it is busy until all accepted
+	// replies have been served (nanoseconds, fractional at high rates).
+	double service_time;
+	double busy_until;
+
+	size_t dropped;
+	size_t duplicated;
+	size_t reordered;
+	size_t overflowed;
+	size_t max_depth;
+
+	// Times a reply found the pool full and had to wait in the ring.
+	size_t stalls;
+	int stalled;
+};
+
+// Delay is "fixed:<ms>", "uniform:<min ms>:<max ms>", "lognormal:<median ms>:<sigma>"
+// or "empirical:<file>" with one delay in milliseconds per line.
+int parse_delay(const char *text, struct delay_distribution *delay);
+void free_delay(struct delay_distribution *delay);
+const char *get_delay_name(enum delay_kind kind);
+int is_upstream_enabled(const struct upstream_options *options);
+const char *get_overflow_name(enum overflow_action action);
+
+// Pool which holds replies accepted at the service rate for their longest
+// delay on top of the queue (not less than UPSTREAM_POOL_SLOTS and not more
+// than UPSTREAM_MAX_POOL_SLOTS), just UPSTREAM_POOL_SLOTS without the rate.
+size_t get_pool_size(const struct upstream_options *options);
+
+int make_upstream(const struct upstream_options *options, size_t capacity, unsigned long long now,
+                  struct upstream *upstream);
+void free_upstream(struct upstream *upstream);
+
+// Takes the reply over (the slot can be released after that), returns -1 if
+// the pool is full and the reply has to wait.
+int defer_reply(struct upstream *upstream, const struct reply_slot *reply, unsigned long long now);
+
+// Replies in service or waiting for it at the moment.
+size_t get_queue_depth(const struct upstream *upstream, unsigned long long now);
+
+// Callback returns 0 when the reply has been sent, 1 when the socket is full
+// (the reply is retried on the next tick) and -1 on error.
+typedef int (*send_callback)(const struct reply_slot *reply, void *context);
+int send_due_replies(struct upstream *upstream, unsigned long long now, send_callback send, void *context);
+
+#endif // __UPSTREAM_H__
@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "zone.h"
+#include "logger.h"
+
+#define ZONE_LINE_SIZE 4096
+#define ZONE_MAX_FIELDS 64
+#define ZONE_MAX_RDATA 1024
+#define ZONE_DEFAULT_TTL 3600
+#define ZONE_INITIAL_RECORDS 1024
+#define ZONE_INITIAL_SIZE (64*1024)
+#define ZONE_MIN_TABLE_SIZE 16
+
+#define DNS_CLASS_IN 1
+#define DNS_TYPE_CNAME 5
+#define DNS_RECORD_HEADER_SIZE 12
+
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME 16777619U
+
+struct zone_type
+{
+	const char *name;
+	unsigned short type;
+};
+
+static const struct zone_type zone_types[] = {
+	{"A",     1},
+	{"NS",    2},
+	{"CNAME", 5},
+	{"PTR",   12},
+	{"MX",    15},
+	{"TXT",   16},
+	{"AAAA",  28},
+	{NULL,    0}
+};
+
+// Parsed record, name and data are offsets in the text buffer.
+struct zone_record
+{
+	unsigned int name;
+	unsigned short name_size;
+	unsigned short type;
+	unsigned int ttl;
+	unsigned int rdata;
+	unsigned short rdata_size;
+};
+
+struct zone_buffer
+{
+	size_t size;
+	size_t capacity;
+	char *data;
+};
+
+static unsigned char to_lower(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z')? c + ('a' - 'A') : c;
+}
+
+static unsigned int hash_name(const unsigned char *prefix, size_t prefix_size, const unsigned char *name, size_t size)
+{
+	unsigned int hash = FNV_OFFSET;
+
+	size_t i;
+	for (i = 0; i < prefix_size; i++) hash = (hash ^ to_lower(prefix[i]))*FNV_PRIME;
+	for (i = 0; i < size; i++) hash = (hash ^ to_lower(name[i]))*FNV_PRIME;
+
+	return hash;
+}
+
+// Entry of the name made of the prefix (wildcard label) and the name, -1 if
+// there is no such name.
+static int find_entry(const struct zone *zone, const unsigned char *prefix, size_t prefix_size,
+                      const unsigned char *name, size_t size)
+{
+	unsigned int hash = hash_name(prefix, prefix_size, name, size);
+
+	size_t position;
+	for (position = hash & zone->mask; zone->table[position] != 0; position = (position + 1) & zone->mask)
+	{
+		const struct zone_entry *entry = &zone->entries[zone->table[position] - 1];
+		if (entry->hash != hash || entry->name_size != prefix_size + size) continue;
+
+		const unsigned char *entry_name = (const unsigned char *) zone->data + entry->name;
+		if (prefix_size > 0 && memcmp(entry_name, prefix, prefix_size) != 0) continue;
+
+		size_t i;
+		for (i = 0; i < size && entry_name[prefix_size + i] == to_lower(name[i]); i++);
+		if (i == size) return zone->table[position] - 1;
+	}
+
+	return -1;
+}
+
+static void insert_entry(struct zone *zone, size_t index)
+{
+	size_t position = zone->entries[index].hash & zone->mask;
+	while (zone->table[position] != 0) position = (position + 1) & zone->mask;
+
+	zone->table[position] = index + 1;
+}
+
+static int reserve_buffer(struct zone_buffer *buffer, size_t size)
+{
+	if (buffer->size + size <= buffer->capacity) return 0;
+
+	size_t capacity = (buffer->capacity > 0)? buffer->capacity : ZONE_INITIAL_SIZE;
+	while (capacity < buffer->size + size) capacity *= 2;
+
+	char *data = realloc(buffer->data, capacity);
+	if (data == NULL)
+	{
+		log_errno("Can't grow zone buffer to %lu bytes.", capacity);
+		return -1;
+	}
+
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+static int append_buffer(struct zone_buffer *buffer, const void *data, size_t size, unsigned int *offset)
+{
+	if (reserve_buffer(buffer, size) != 0) return -1;
+
+	if (offset) *offset = (unsigned int) buffer->size;
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+
+	return 0;
+}
+
+size_t get_name_size(const unsigned char *name, size_t size)
+{
+	if (size > DNS_MAX_NAME_SIZE) size = DNS_MAX_NAME_SIZE;
+
+	size_t offset = 0;
+	while (offset < size)
+	{
+		unsigned char length = name[offset];
+		if (length == 0) return offset + 1;
+		if (length > DNS_MAX_LABEL_SIZE) return 0;
+
+		offset += length + 1;
+	}
+
+	return 0;
+}
+
+// Text name to lower case wire format, "." is the root.
+static int parse_name(const char *text, unsigned char *name, size_t *size)
+{
+	size_t position = 0;
+	if (strcmp(text, ".") != 0)
+	{
+		const char *label = text;
+		while (*label != '\0')
+		{
+			const char *end = strchr(label, '.');
+			size_t length = (end == NULL)? strlen(label) : (size_t) (end - label);
+			if (length == 0 || length > DNS_MAX_LABEL_SIZE || position + length + 2 > DNS_MAX_NAME_SIZE) return -1;
+
+			name[position++] = (unsigned char) length;
+
+			size_t i;
+			for (i = 0; i < length; i++) name[position++] = to_lower(label[i]);
+
+			label += length;
+			if (*label == '.') label++;
+		}
+	}
+
+	name[position++] = 0;
+	*size = position;
+
+	return 0;
+}
+
+// Splits the line into whitespace separated fields, quoted fields may have
+// spaces. Returns -1 if there are too many of them.
+static int split_fields(char *line, char **fields, size_t *count)
+{
+	*count = 0;
+
+	char *p = line;
+	while (1)
+	{
+		while (isspace((unsigned char) *p)) p++;
+		if (*p == '\0' || *p == ';') break;
+		if (*count == ZONE_MAX_FIELDS) return -1;
+
+		if (*p == '"')
+		{
+			fields[(*count)++] = ++p;
+			while (*p != '\0' && *p != '"') p++;
+		}
+		else
+		{
+			fields[(*count)++] = p;
+			while (*p != '\0' && !isspace((unsigned char) *p)) p++;
+		}
+
+		if (*p == '\0') break;
+		*p++ = '\0';
+	}
+
+	return 0;
+}
+
+static int parse_number(const char *text, unsigned long maximum, unsigned long *value)
+{
+	if (!isdigit((unsigned char) *text)) return -1;
+
+	char *end = NULL;
+	*value = strtoul(text, &end, 10);
+
+	return (*end != '\0' || *value > maximum)? -1 : 0;
+}
+
+static int parse_rdata(unsigned short type, char **fields, size_t count, unsigned char *rdata, size_t *size)
+{
+	unsigned long preference;
+	size_t name_size;
+	size_t i;
+
+	switch (type)
+	{
+		case 1:
+			if (count != 1 || inet_pton(AF_INET, fields[0], rdata) != 1) return -1;
+			*size = 4;
+			return 0;
+
+		case 28:
+			if (count != 1 || inet_pton(AF_INET6, fields[0], rdata) != 1) return -1;
+			*size = 16;
+			return 0;
+
+		case 2:
+		case 5:
+		case 12:
+			if (count != 1) return -1;
+			return parse_name(fields[0], rdata, size);
+
+		case 15:
+			if (count != 2 || parse_number(fields[0], 0xffff, &preference) != 0) return -1;
+			if (parse_name(fields[1], rdata + 2, &name_size) != 0) return -1;
+
+			rdata[0] = (unsigned char) (preference >> 8);
+			rdata[1] = (unsigned char) preference;
+			*size = name_size + 2;
+			return 0;
+
+		case 16:
+			if (count == 0) return -1;
+
+			*size = 0;
+			for (i = 0; i < count; i++)
+			{
+				size_t length = strlen(fields[i]);
+				if (length > 255 || *size + length + 1 > ZONE_MAX_RDATA) return -1;
+
+				rdata[(*size)++] = (unsigned char) length;
+				memcpy(rdata + *size, fields[i], length);
+				*size += length;
+			}
+
+			return 0;
+	}
+
+	return -1;
+}
+
+static int parse_record(char **fields, size_t count, struct zone_buffer *text, struct zone_record *record)
+{
+	unsigned char name[DNS_MAX_NAME_SIZE];
+	size_t name_size;
+	if (count < 3 || parse_name(fields[0], name, &name_size) != 0) return -1;
+
+	size_t field = 1;
+	unsigned long ttl = ZONE_DEFAULT_TTL;
+	if (isdigit((unsigned char) *fields[field]))
+	{
+		if (parse_number(fields[field], 0x7fffffff, &ttl) != 0) return -1;
+		field++;
+	}
+
+	if (field < count && strcasecmp(fields[field], "IN") == 0) field++;
+	if (field >= count) return -1;
+
+	const struct zone_type *type;
+	for (type = zone_types; type->name != NULL && strcasecmp(type->name, fields[field]) != 0; type++);
+	if (type->name == NULL) return -1;
+	field++;
+
+	unsigned char rdata[ZONE_MAX_RDATA];
+	size_t rdata_size;
+	if (parse_rdata(type->type, fields + field, count - field, rdata, &rdata_size) != 0) return -1;
+
+	record->name_size = (unsigned short) name_size;
+	record->type = type->type;
+	record->ttl = (unsigned int) ttl;
+	record->rdata_size = (unsigned short) rdata_size;
+
+	if (append_buffer(text, name, name_size, &record->name) != 0) return -1;
+	if (append_buffer(text, rdata, rdata_size, &record->rdata) != 0) return -1;
+
+	return 0;
+}
+
+static int read_records(const char *name, struct zone_buffer *text, struct zone_record **records, size_t *count)
+{
+	FILE *f = fopen(name, "r");
+	if (f == NULL)
+	{
+		log_errno("Can't open zone file %s.", name);
+		return -1;
+	}
+
+	size_t capacity = ZONE_INITIAL_RECORDS;
+	*records = malloc(capacity*sizeof(struct zone_record));
+	*count = 0;
+	if (*records == NULL)
+	{
+		log_errno("Can't allocate %lu zone records.", capacity);
+		fclose(f);
+		return -1;
+	}
+
+	char line[ZONE_LINE_SIZE];
+	size_t line_number = 0;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		line_number++;
+		if (strchr(line, '\n') == NULL && !feof(f))
+		{
+			log_error("Line %lu of zone file %s is too long.", line_number, name);
+			goto error;
+		}
+
+		char *fields[ZONE_MAX_FIELDS];
+		size_t field_count;
+		if (split_fields(line, fields, &field_count) != 0)
+		{
+			log_error("Line %lu of zone file %s has too many fields.", line_number, name);
+			goto error;
+		}
+
+		if (field_count == 0) continue;
+
+		if (*count == capacity)
+		{
+			capacity *= 2;
+			struct zone_record *grown = realloc(*records, capacity*sizeof(struct zone_record));
+			if (grown == NULL)
+			{
+				log_errno("Can't grow zone records to %lu.", capacity);
+				goto error;
+			}
+
+			*records = grown;
+		}
+
+		if (parse_record(fields, field_count, text, *records + *count) != 0)
+		{
+			log_error("Invalid record at line %lu of zone file %s.", line_number, name);
+			goto error;
+		}
+
+		(*count)++;
+	}
+
+	if (ferror(f))
+	{
+		log_errno("Error on reading zone file %s.", name);
+		goto error;
+	}
+
+	fclose(f);
+	return 0;
+
+error:
+	free(*records);
+	*records = NULL;
+	fclose(f);
+	return -1;
+}
+
+// qsort has no context argument, records are compared by names in this buffer.
+static const char *sort_text = NULL;
+
+static int compare_records(const void *a, const void *b)
+{
+	const struct zone_record *first = (const struct zone_record *) a;
+	const struct zone_record *second = (const struct zone_record *) b;
+
+	if (first->name_size != second->name_size) return (first->name_size < second->name_size)? -1 : 1;
+
+	int result = memcmp(sort_text + first->name, sort_text + second->name, first->name_size);
+	if (result != 0) return result;
+
+	if (first->type != second->type) return (first->type < second->type)? -1 : 1;
+	return 0;
+}
+
+static int append_record(struct zone_buffer *data, const struct zone_record *record, const char *text)
+{
+	unsigned char header[DNS_RECORD_HEADER_SIZE] = {
+		0xc0, 0x0c,
+		record->type >> 8, record->type & 0xff,
+		0, DNS_CLASS_IN,
+		record->ttl >> 24, (record->ttl >> 16) & 0xff, (record->ttl >> 8) & 0xff, record->ttl & 0xff,
+		record->rdata_size >> 8, record->rdata_size & 0xff
+	};
+
+	if (append_buffer(data, header, sizeof(header), NULL) != 0) return -1;
+	return append_buffer(data, text + record->rdata, record->rdata_size, NULL);
+}
+
+// Renders sorted records into names and sets, every name is followed by its
+// rendered sets in data.
+static int render_records(struct zone *zone, struct zone_buffer *data,
+                          const struct zone_record *records, size_t count, const char *text, size_t *labels)
+{
+	*labels = 0;
+
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		const struct zone_record *record = &records[i];
+		int same_name = i > 0 && record->name_size == records[i - 1].name_size &&
+		                memcmp(text + record->name, text + records[i - 1].name, record->name_size) == 0;
+
+		if (!same_name)
+		{
+			struct zone_entry *entry = &zone->entries[zone->entry_count++];
+			if (append_buffer(data, text + record->name, record->name_size, &entry->name) != 0) return -1;
+
+			entry->name_size = record->name_size;
+			entry->hash = hash_name(NULL, 0, (const unsigned char *) text + record->name, record->name_size);
+			entry->rrsets = (unsigned int) zone->rrset_count;
+			entry->rrset_count = 0;
+			entry->cname = -1;
+
+			// Parents are inserted later, there are at most as many as labels.
+			const unsigned char *name = (const unsigned char *) text + record->name;
+			size_t offset;
+			for (offset = 0; name[offset] != 0; offset += name[offset] + 1) (*labels)++;
+			(*labels)++;
+		}
+
+		struct zone_entry *entry = &zone->entries[zone->entry_count - 1];
+		if (!same_name || record->type != records[i - 1].type)
+		{
+			struct zone_rrset *rrset = &zone->rrsets[zone->rrset_count];
+			rrset->type = htons(record->type);
+			rrset->count = 0;
+			rrset->data = (unsigned int) data->size;
+			rrset->size = 0;
+
+			if (record->type == DNS_TYPE_CNAME) entry->cname = (int) zone->rrset_count;
+
+			zone->rrset_count++;
+			entry->rrset_count++;
+		}
+
+		struct zone_rrset *rrset = &zone->rrsets[zone->rrset_count - 1];
+		if (append_record(data, record, text) != 0) return -1;
+
+		rrset->count++;
+		rrset->size += DNS_RECORD_HEADER_SIZE + record->rdata_size;
+	}
+
+	return 0;
+}
+
+// Parents of every name as entries without sets, they point to the tail of
+// the name they were found in.
+static void add_parents(struct zone *zone)
+{
+	size_t count = zone->entry_count;
+
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		const unsigned char *name = (const unsigned char *) zone->data + zone->entries[i].name;
+		size_t size = zone->entries[i].name_size;
+
+		size_t offset;
+		for (offset = name[0] + 1; offset < size; offset += name[offset] + 1)
+		{
+			if (find_entry(zone, NULL, 0, name + offset, size - offset) >= 0) continue;
+
+			struct zone_entry *parent = &zone->entries[zone->entry_count];
+			parent->hash = hash_name(NULL, 0, name + offset, size - offset);
+			parent->name = zone->entries[i].name + (unsigned int) offset;
+			parent->name_size = (unsigned short) (size - offset);
+			parent->rrsets = 0;
+			parent->rrset_count = 0;
+			parent->cname = -1;
+
+			insert_entry(zone, zone->entry_count);
+			zone->entry_count++;
+		}
+	}
+}
+
+int load_zone(const char *name, struct zone *zone)
+{
+	memset(zone, 0, sizeof(*zone));
+
+	struct zone_buffer text = {0, 0, NULL};
+	struct zone_buffer data = {0, 0, NULL};
+	struct zone_record *records = NULL;
+	size_t count = 0;
+	if (read_records(name, &text, &records, &count) != 0) goto error;
+
+	if (count == 0)
+	{
+		log_error("No records found in zone file %s.", name);
+		goto error;
+	}
+
+	sort_text = text.data;
+	qsort(records, count, sizeof(struct zone_record), compare_records);
+
+	// Every record may start a new name and set, parents are counted on rendering.
+	zone->entries = malloc(count*sizeof(struct zone_entry));
+	zone->rrsets = malloc(count*sizeof(struct zone_rrset));
+	if (zone->entries == NULL || zone->rrsets == NULL)
+	{
+		log_errno("Can't allocate index of %lu zone records.", count);
+		goto error;
+	}
+
+	size_t labels;
+	if (render_records(zone, &data, records, count, text.data, &labels) != 0) goto error;
+
+	size_t names = zone->entry_count;
+	struct zone_entry *entries = realloc(zone->entries, (names + labels)*sizeof(struct zone_entry));
+	if (entries == NULL)
+	{
+		log_errno("Can't allocate %lu zone names.", names + labels);
+		goto error;
+	}
+	zone->entries = entries;
+
+	// At most half full with all the parents.
+	size_t table_size = ZONE_MIN_TABLE_SIZE;
+	while (table_size < 2*(names + labels)) table_size <<= 1;
+
+	zone->table = calloc(table_size, sizeof(unsigned int));
+	if (zone->table == NULL)
+	{
+		log_errno("Can't allocate zone hash table of %lu slots.", table_size);
+		goto error;
+	}
+	zone->mask = table_size - 1;
+
+	zone->data = data.data;
+	zone->size = data.size;
+	data.data = NULL;
+
+	size_t i;
+	for (i = 0; i < names; i++) insert_entry(zone, i);
+	add_parents(zone);
+
+	free(records);
+	free(text.data);
+
+	log_message("Loaded %lu records of %lu names (%lu with parents) and %lu sets from %s, %lu bytes rendered.",
+	            count, names, zone->entry_count, zone->rrset_count, name, zone->size);
+	return 0;
+
+error:
+	free(records);
+	free(text.data);
+	free(data.data);
+	free_zone(zone);
+	return -1;
+}
+
+void free_zone(struct zone *zone)
+{
+	free(zone->table);
+	free(zone->entries);
+	free(zone->rrsets);
+	free(zone->data);
+
+	memset(zone, 0, sizeof(*zone));
+}
+
+enum zone_result find_answer(const struct zone *zone, const unsigned char *name, size_t name_size,
+                             unsigned short type, struct zone_answer *answer)
+{
+	static const unsigned char wildcard[] = {1, '*'};
+
+	answer->count = 0;
+	answer->data = NULL;
+	answer->size = 0;
+
+	int index = find_entry(zone, NULL, 0, name, name_size);
+	if (index < 0)
+	{
+		// Wildcard of the closest existing parent or nothing.
+		size_t offset;
+		for (offset = name[0] + 1; offset < name_size; offset += name[offset] + 1)
+		{
+			index = find_entry(zone, wildcard, sizeof(wildcard), name + offset, name_size - offset);
+			if (index >= 0) break;
+
+			if (find_entry(zone, NULL, 0, name + offset, name_size - offset) >= 0) return ZONE_NXDOMAIN;
+		}
+
+		if (index < 0) return ZONE_NXDOMAIN;
+	}
+
+	const struct zone_entry *entry = &zone->entries[index];
+	const struct zone_rrset *rrset = NULL;
+
+	size_t i;
+	for (i = 0; i < entry->rrset_count && rrset == NULL; i++)
+	{
+		if (zone->rrsets[entry->rrsets + i].type == type) rrset = &zone->rrsets[entry->rrsets + i];
+	}
+
+	if (rrset == NULL && entry->cname >= 0) rrset = &zone->rrsets[entry->cname];
+	if (rrset == NULL) return ZONE_NODATA;
+
+	answer->count = rrset->count;
+	answer->data = zone->data + rrset->data;
+	answer->size = rrset->size;
+
+	return ZONE_ANSWER;
+}
@@ -0,0 +1,78 @@
+#ifndef __ZONE_H__
+#define __ZONE_H__
+
+#include <stddef.h>
+
+#define DNS_MAX_NAME_SIZE 255
+#define DNS_MAX_LABEL_SIZE 63
+
+// Records of the stub server loaded from a zone-like file. Every set of
+// records of one name and type is rendered to the answer section ahead of
+// time with owner names pointing to the question (0xc00c), so answering is a
+// lookup and a copy. Names are kept in lower case wire format in an open
+// addressing hash table, parents of every name are present too (without
+// records), so wildcards apply only below the closest existing name.
+struct zone_entry
+{
+	unsigned int hash;
+	unsigned int name;          // offset of the name in data
+	unsigned short name_size;
+	unsigned short rrset_count;
+	unsigned int rrsets;        // index of the first set of the name
+	int cname;                  // index of CNAME set, -1 if none
+};
+
+struct zone_rrset
+{
+	unsigned short type;        // network order, as in queries
+	unsigned short count;
+	unsigned int data;          // offset of rendered records in data
+	unsigned int size;
+};
+
+struct zone
+{
+	size_t mask;
+	unsigned int *table;        // entry index + 1, 0 for empty slots
+
+	size_t entry_count;
+	struct zone_entry *entries;
+
+	size_t rrset_count;
+	struct zone_rrset *rrsets;
+
+	size_t size;
+	char *data;
+};
+
+enum zone_result
+{
+	ZONE_ANSWER,
+	ZONE_NODATA,
+	ZONE_NXDOMAIN
+};
+
+struct zone_answer
+{
+	unsigned short count;
+	const char *data;
+	size_t size;
+};
+
+// Lines are "<name> [<ttl>] [IN] <type> <data>" for A, AAAA, NS, CNAME, PTR,
+// MX and TXT records, ";" starts a comment. Names are absolute with or
+// without the trailing dot, "*" as the first label makes a wildcard.
+int load_zone(const char *name, struct zone *zone);
+void free_zone(struct zone *zone);
+
+// Size of the name in wire format at the start of the buffer (names in the
+// question aren't compressed), 0 when it runs out of the buffer or is longer
+// than names may be.
+size_t get_name_size(const unsigned char *name, size_t size);
+
+// Name is in wire format as in the query (any case, no compression), type is
+// in network order. Names with CNAME record answer it to queries of other types.
+enum zone_result find_answer(const struct zone *zone, const unsigned char *name, size_t name_size,
+                             unsigned short type, struct zone_answer *answer);
+
+#endif // __ZONE_H__